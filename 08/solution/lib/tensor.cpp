@@ -1,13 +1,142 @@
+#include <algorithm>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+// Blocked GEMM in the style of GotoBLAS/BLIS: C (m x n) = A (m x k) * B (k x n),
+// all row-major and contiguous.
+//
+// The loops around the micro-kernel partition the operands so that every
+// level of the memory hierarchy holds the data that is reused from it:
+//   - a KC x NC block of B is packed once and stays in L3,
+//   - an MC x KC block of A is packed once per B block and stays in L2,
+//   - a KC x NR sliver of the packed B is streamed from L1 by the micro-kernel,
+//   - an MR x NR tile of C is accumulated in registers.
+// Packing copies the panels into the order in which the micro-kernel reads
+// them, so that its loads are contiguous and aligned regardless of the
+// leading dimensions. Partial panels are padded with zeros.
+
+/// Rows and columns of the register tile: 6 x 16 floats are 12 AVX2 or 6
+/// AVX-512 accumulator registers, leaving registers for the A broadcasts and
+/// the B loads.
+constexpr std::int64_t MR = 6;
+constexpr std::int64_t NR = 16;
+/// Depth of a packed panel, a KC x NR sliver of B (16 KiB) fits into L1.
+constexpr std::int64_t KC = 256;
+/// Rows of the packed A block, MC x KC floats (192 KiB) fit into L2.
+constexpr std::int64_t MC = 192;
+/// Columns of the packed B block, KC x NC floats (4 MiB) fit into L3.
+constexpr std::int64_t NC = 4096;
+
+constexpr std::size_t Alignment = 64;
+
+static_assert(MC % MR == 0 && NC % NR == 0);
+
+/// A row of the register tile. The backend splits it into the vector
+/// registers of the host, for which the JIT compiles the kernel.
+typedef float row_t __attribute__((vector_size(NR * sizeof(float))));
+
+float *allocate(std::int64_t count) {
+  std::size_t bytes = count * sizeof(float);
+  bytes = (bytes + Alignment - 1) / Alignment * Alignment;
+  return static_cast<float *>(std::aligned_alloc(Alignment, bytes));
+}
+
+/// Packs the mc x kc block of A at \p a into row panels of MR rows. Each panel
+/// stores its kc columns one after another, MR floats each.
+void pack_a(float *packed, const float *a, std::int64_t lda, std::int64_t mc,
+            std::int64_t kc) {
+  for (std::int64_t i = 0; i < mc; i += MR) {
+    std::int64_t rows = std::min(MR, mc - i);
+    for (std::int64_t p = 0; p < kc; ++p) {
+      for (std::int64_t r = 0; r < rows; ++r)
+        packed[r] = a[(i + r) * lda + p];
+      for (std::int64_t r = rows; r < MR; ++r)
+        packed[r] = 0.f;
+      packed += MR;
+    }
+  }
+}
+
+/// Packs the kc x nc block of B at \p b into column panels of NR columns. Each
+/// panel stores its kc rows one after another, NR floats each.
+void pack_b(float *packed, const float *b, std::int64_t ldb, std::int64_t kc,
+            std::int64_t nc) {
+  for (std::int64_t j = 0; j < nc; j += NR) {
+    std::int64_t cols = std::min(NR, nc - j);
+    for (std::int64_t p = 0; p < kc; ++p) {
+      std::memcpy(packed, b + p * ldb + j, cols * sizeof(float));
+      std::memset(packed + cols, 0, (NR - cols) * sizeof(float));
+      packed += NR;
+    }
+  }
+}
+
+/// Multiplies an MR x kc panel of A with a kc x NR panel of B. Stores the
+/// product to the rows x cols tile at \p c, or adds it if \p accumulate.
+void micro_kernel(std::int64_t kc, const float *a, const float *b, float *c,
+                  std::int64_t ldc, std::int64_t rows, std::int64_t cols,
+                  bool accumulate) {
+  row_t acc[MR] = {};
+  for (std::int64_t p = 0; p < kc; ++p) {
+    // packed panels are aligned to a whole row
+    row_t bp = *reinterpret_cast<const row_t *>(b + p * NR);
+    for (std::int64_t r = 0; r < MR; ++r)
+      acc[r] += a[p * MR + r] * bp;
+  }
+
+  if (rows == MR && cols == NR) {
+    // rows of C are not aligned, memcpy emits unaligned vector accesses
+    for (std::int64_t r = 0; r < MR; ++r) {
+      if (accumulate) {
+        row_t dest;
+        std::memcpy(&dest, c + r * ldc, sizeof(row_t));
+        acc[r] += dest;
+      }
+      std::memcpy(c + r * ldc, &acc[r], sizeof(row_t));
+    }
+    return;
+  }
+  for (std::int64_t r = 0; r < rows; ++r)
+    for (std::int64_t j = 0; j < cols; ++j)
+      c[r * ldc + j] = accumulate ? c[r * ldc + j] + acc[r][j] : acc[r][j];
+}
+} // namespace
 
 extern "C" void __mydsl_tensor_mmul_2_f32(float *dest_tensor, float *tensor_a,
-                                          float *tensor_b, std::int64_t size) {
+                                          float *tensor_b, std::int64_t m,
+                                          std::int64_t k, std::int64_t n) {
+  if (k == 0) {
+    std::fill(dest_tensor, dest_tensor + m * n, 0.f);
+    return;
+  }
+
+  float *packed_a =
+      allocate((std::min(MC, m) + MR - 1) / MR * MR * std::min(KC, k));
+  float *packed_b =
+      allocate((std::min(NC, n) + NR - 1) / NR * NR * std::min(KC, k));
+
+  for (std::int64_t jc = 0; jc < n; jc += NC) {
+    std::int64_t nc = std::min(NC, n - jc);
+    for (std::int64_t pc = 0; pc < k; pc += KC) {
+      std::int64_t kc = std::min(KC, k - pc);
+      pack_b(packed_b, tensor_b + pc * n + jc, n, kc, nc);
 
-  for (std::int64_t i = 0; i < size; ++i)
-    for (std::int64_t j = 0; j < size; ++j) {
-      float acc = 0.f;
-      for (std::int64_t k = 0; k < size; ++k)
-        acc += tensor_a[i * size + k] * tensor_b[k * size + j];
-      dest_tensor[i * size + j] = acc;
+      for (std::int64_t ic = 0; ic < m; ic += MC) {
+        std::int64_t mc = std::min(MC, m - ic);
+        pack_a(packed_a, tensor_a + ic * k + pc, k, mc, kc);
+
+        for (std::int64_t jr = 0; jr < nc; jr += NR)
+          for (std::int64_t ir = 0; ir < mc; ir += MR)
+            micro_kernel(kc, packed_a + ir * kc, packed_b + jr * kc,
+                         dest_tensor + (ic + ir) * n + jc + jr, n,
+                         std::min(MR, mc - ir), std::min(NR, nc - jr),
+                         pc != 0);
+      }
     }
+  }
+
+  std::free(packed_a);
+  std::free(packed_b);
 }
@@ -2,9 +2,11 @@
 #include "float_ops.hpp"
 #include "int_ops.hpp"
 #include "jit.hpp"
+#include "small_mmul.hpp"
 #include "tensor_ops.hpp"
 
 #include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <memory>
 #include <numeric>
@@ -18,15 +20,19 @@ using namespace MyDSL;
 using FloatT = Float::NativeType;
 using IntT = Integer::NativeType;
 
-void kernel(llvm::Value *DestTensor, llvm::Value *TensorA, llvm::Value *TensorB,
-            llvm::Value *S, llvm::Value *A, llvm::Value *B,
-            llvm::IRBuilder<> &Builder) {
+void kernel(llvm::Value *DestTensor, llvm::Value *SmallDestTensor,
+            llvm::Value *TensorA, llvm::Value *TensorB, llvm::Value *S,
+            llvm::Value *A, llvm::Value *B, MatmulShape Shape,
+            unsigned VectorWidth, llvm::IRBuilder<> &Builder) {
   Integer s(S, Builder);
   Tensor<Float, 2> T{{s, s}, TensorA, Builder};
   Tensor<Float, 2> T2{{s, s}, TensorB, Builder};
   Tensor<Float, 2> Dest{{s, s}, DestTensor, Builder};
+  Tensor<Float, 2> SmallDest{{s, s}, SmallDestTensor, Builder};
 
   T.mmul(Dest, T2);
+  // the same product with the kernel for the static shape, checked by main
+  T.mmul(SmallDest, T2, Shape, VectorWidth);
   ControlFlow CF(Builder);
   CF.Return();
 }
@@ -50,13 +56,15 @@ int main(int argc, const char *argv[]) {
   auto Kernel = make_kernel_function(
       M.get(), llvm::Type::getVoidTy(Ctx),
       {Tensor<Float, 2>::getType(Ctx), Tensor<Float, 2>::getType(Ctx),
-       Tensor<Float, 2>::getType(Ctx), Integer::getType(Ctx),
-       Float::getType(Ctx), Float::getType(Ctx)});
+       Tensor<Float, 2>::getType(Ctx), Tensor<Float, 2>::getType(Ctx),
+       Integer::getType(Ctx), Float::getType(Ctx), Float::getType(Ctx)});
 
   llvm::IRBuilder<> Builder(&Kernel->getEntryBlock());
 
+  MatmulShape Shape{Size, Size, Size};
   kernel(Kernel->getArg(0), Kernel->getArg(1), Kernel->getArg(2),
-         Kernel->getArg(3), Kernel->getArg(4), Kernel->getArg(5), Builder);
+         Kernel->getArg(3), Kernel->getArg(4), Kernel->getArg(5),
+         Kernel->getArg(6), Shape, getHostVectorWidth(JIT), Builder);
   llvm::errs() << *Kernel;
 
   linkBuiltinFunctions(*M);
@@ -78,16 +86,41 @@ int main(int argc, const char *argv[]) {
   });
 
   std::vector<Float::NativeType> Dest(Size * Size);
+  std::vector<Float::NativeType> SmallDest(Size * Size);
+  std::vector<Float::NativeType> HostDest(Size * Size);
 
   void (*FP)(typename Tensor<Float, 2>::NativeType,
+             typename Tensor<Float, 2>::NativeType,
              typename Tensor<Float, 2>::NativeType,
              typename Tensor<Float, 2>::NativeType, IntT, FloatT, FloatT) =
       ExitOnErr(JIT(std::move(M), std::move(Context))).toPtr<void (typename Tensor<Float, 2>::NativeType,
+                typename Tensor<Float, 2>::NativeType,
                 typename Tensor<Float, 2>::NativeType,
                 typename Tensor<Float, 2>::NativeType, IntT, FloatT,
                 FloatT)>();
 
-  FP(Dest.data(), T1.data(), T2.data(), Size, A, B);
+  FP(Dest.data(), SmallDest.data(), T1.data(), T2.data(), Size, A, B);
+
+  // the host-side entry point, batched over a single product
+  SmallMatmulCache Cache(JIT);
+  auto Small = ExitOnErr(SmallMatmul::Create(Cache, Shape));
+  float *HostC = HostDest.data();
+  const float *HostA = T1.data();
+  const float *HostB = T2.data();
+  Small(&HostC, &HostA, &HostB, 1);
+
+  // the kernels sum in a different order than the blocked GEMM
+  FloatT Tolerance = 1.f;
+  for (auto X : Dest)
+    Tolerance = std::max(Tolerance, std::abs(X));
+  Tolerance *= 1e-6f * Size;
+  for (IntT i = 0; i < Size * Size; ++i) {
+    if (std::abs(SmallDest[i] - Dest[i]) > Tolerance ||
+        std::abs(HostDest[i] - Dest[i]) > Tolerance) {
+      std::cerr << "small mmul differs from the GEMM at " << i << "\n";
+      return 1;
+    }
+  }
 
   for (int i = 0; i < Size; ++i) {
     for (int j = 0; j < Size; ++j) {
@@ -0,0 +1,274 @@
+#include "small_mmul.hpp"
+
+#include "jit.hpp"
+
+#include <algorithm>
+#include <string>
+
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/Twine.h>
+#include <llvm/Analysis/TargetTransformInfo.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Intrinsics.h>
+#include <llvm/IR/LLVMContext.h>
+
+namespace {
+/// Accumulators of a register tile. Leaves 4 of 16 vector registers for the
+/// rows of B and the broadcast of A.
+constexpr std::int64_t MaxAccumulators = 12;
+/// Largest number of vector multiply-adds that is emitted without a loop over
+/// K.
+constexpr std::int64_t MaxUnrolledOps = 4096;
+
+std::string getKernelName(llvm::StringRef Prefix, MyDSL::MatmulShape Shape) {
+  return (llvm::Twine(Prefix) + "_" + llvm::Twine(Shape.M) + "x" +
+          llvm::Twine(Shape.K) + "x" + llvm::Twine(Shape.N) + "_f32")
+      .str();
+}
+
+/// Emits one register tile: the rows [Row, Row + Rows) and the columns
+/// covered by \p Types, starting at \p Col, of C = A * B.
+void emitTile(llvm::IRBuilder<> &Builder, llvm::Value *C, llvm::Value *A,
+              llvm::Value *B, MyDSL::MatmulShape Shape, std::int64_t Row,
+              std::int64_t Rows, std::int64_t Col,
+              llvm::ArrayRef<llvm::FixedVectorType *> Types,
+              std::int64_t VectorWidth, bool Unroll) {
+  auto *FloatTy = Builder.getFloatTy();
+  auto *I64 = Builder.getInt64Ty();
+  auto [_, K, N] = Shape;
+
+  auto ElementPtr = [&](llvm::Value *Base, llvm::Value *Offset) {
+    return Builder.CreateInBoundsGEP(FloatTy, Base, Offset);
+  };
+
+  llvm::SmallVector<llvm::Value *, MaxAccumulators> Acc;
+  for (std::int64_t R = 0; R < Rows; ++R)
+    for (auto *Ty : Types)
+      Acc.push_back(llvm::Constant::getNullValue(Ty));
+
+  // Acc += A[Row:Row + Rows, P] * B[P, Col:...]
+  auto Step = [&](llvm::Value *P) {
+    llvm::SmallVector<llvm::Value *, 4> RowB;
+    for (std::size_t V = 0; V < Types.size(); ++V) {
+      auto *Offset =
+          Builder.CreateAdd(Builder.CreateMul(P, Builder.getInt64(N)),
+                            Builder.getInt64(Col + V * VectorWidth));
+      RowB.push_back(Builder.CreateAlignedLoad(
+          Types[V], ElementPtr(B, Offset), llvm::Align(4)));
+    }
+    for (std::int64_t R = 0; R < Rows; ++R) {
+      auto *Offset = Builder.CreateAdd(Builder.getInt64((Row + R) * K), P);
+      auto *ElemA = Builder.CreateLoad(FloatTy, ElementPtr(A, Offset));
+      for (std::size_t V = 0; V < Types.size(); ++V) {
+        auto *Broadcast =
+            Builder.CreateVectorSplat(Types[V]->getNumElements(), ElemA);
+        auto *&Sum = Acc[R * Types.size() + V];
+        Sum = Builder.CreateIntrinsic(llvm::Intrinsic::fmuladd,
+                                      {Sum->getType()},
+                                      {Broadcast, RowB[V], Sum});
+      }
+    }
+  };
+
+  if (Unroll) {
+    for (std::int64_t P = 0; P < K; ++P)
+      Step(Builder.getInt64(P));
+  } else {
+    auto *F = Builder.GetInsertBlock()->getParent();
+    auto *Preheader = Builder.GetInsertBlock();
+    auto *Loop = llvm::BasicBlock::Create(Builder.getContext(), "k", F);
+    auto *Exit = llvm::BasicBlock::Create(Builder.getContext(), "k.end", F);
+    Builder.CreateBr(Loop);
+    Builder.SetInsertPoint(Loop);
+
+    auto *P = Builder.CreatePHI(I64, 2, "p");
+    P->addIncoming(Builder.getInt64(0), Preheader);
+    llvm::SmallVector<llvm::PHINode *, MaxAccumulators> Phis;
+    for (auto *&Sum : Acc) {
+      auto *Phi = Builder.CreatePHI(Sum->getType(), 2, "acc");
+      Phi->addIncoming(Sum, Preheader);
+      Phis.push_back(Phi);
+      Sum = Phi;
+    }
+
+    Step(P);
+
+    auto *Next = Builder.CreateAdd(P, Builder.getInt64(1), "p.next",
+                                   /*HasNUW=*/true, /*HasNSW=*/true);
+    P->addIncoming(Next, Loop);
+    for (auto [Phi, Sum] : llvm::zip(Phis, Acc))
+      Phi->addIncoming(Sum, Loop);
+    Builder.CreateCondBr(Builder.CreateICmpULT(Next, Builder.getInt64(K)),
+                         Loop, Exit);
+    Builder.SetInsertPoint(Exit);
+  }
+
+  for (std::int64_t R = 0; R < Rows; ++R)
+    for (std::size_t V = 0; V < Types.size(); ++V)
+      Builder.CreateAlignedStore(
+          Acc[R * Types.size() + V],
+          ElementPtr(C, Builder.getInt64((Row + R) * N + Col +
+                                         V * VectorWidth)),
+          llvm::Align(4));
+}
+
+/// Emits C = A * B at the insertion point of \p Builder.
+void emitMatmul(llvm::IRBuilder<> &Builder, llvm::Value *C, llvm::Value *A,
+                llvm::Value *B, MyDSL::MatmulShape Shape,
+                std::int64_t VectorWidth) {
+  auto *FloatTy = Builder.getFloatTy();
+  auto [M, K, N] = Shape;
+
+  std::int64_t VectorsPerRow = (N + VectorWidth - 1) / VectorWidth;
+  std::int64_t TileVectors = std::min(VectorsPerRow, MaxAccumulators);
+  std::int64_t TileRows = std::max<std::int64_t>(
+      1, std::min(M, MaxAccumulators / TileVectors));
+  bool Unroll = M * K * VectorsPerRow <= MaxUnrolledOps;
+
+  for (std::int64_t Row = 0; Row < M; Row += TileRows) {
+    for (std::int64_t Col = 0; Col < N; Col += TileVectors * VectorWidth) {
+      // the last vector of a row may be narrower
+      llvm::SmallVector<llvm::FixedVectorType *, 4> Types;
+      for (std::int64_t V = 0; V < TileVectors; ++V) {
+        std::int64_t Begin = Col + V * VectorWidth;
+        if (Begin >= N)
+          break;
+        Types.push_back(llvm::FixedVectorType::get(
+            FloatTy, std::min(VectorWidth, N - Begin)));
+      }
+      emitTile(Builder, C, A, B, Shape, Row, std::min(TileRows, M - Row), Col,
+               Types, VectorWidth, Unroll);
+    }
+  }
+}
+
+llvm::Function *createFunction(llvm::Module &M, llvm::StringRef Name,
+                               llvm::ArrayRef<llvm::Type *> ArgTys) {
+  auto &Ctx = M.getContext();
+  auto *F = llvm::Function::Create(
+      llvm::FunctionType::get(llvm::Type::getVoidTy(Ctx), ArgTys, false),
+      llvm::GlobalValue::InternalLinkage, Name, M);
+  llvm::BasicBlock::Create(Ctx, "entry", F);
+  return F;
+}
+
+} // namespace
+
+namespace MyDSL {
+
+unsigned getHostVectorWidth(Jit &JIT) {
+  auto TM = JIT.getTargetMachine();
+  if (!TM) {
+    llvm::consumeError(TM.takeError());
+    return 4;
+  }
+  // a function without target attributes gets the subtarget of the host
+  llvm::LLVMContext Ctx;
+  llvm::Module M("host", Ctx);
+  auto *F = llvm::Function::Create(
+      llvm::FunctionType::get(llvm::Type::getVoidTy(Ctx), false),
+      llvm::GlobalValue::ExternalLinkage, "host", M);
+  auto Bits = (*TM)->getTargetTransformInfo(*F)
+                  .getRegisterBitWidth(
+                      llvm::TargetTransformInfo::RGK_FixedWidthVector)
+                  .getFixedValue();
+  return std::max<unsigned>(Bits / 32, 1);
+}
+
+llvm::Function *getSmallMatmulKernel(llvm::Module &M, MatmulShape Shape,
+                                     unsigned VectorWidth) {
+  auto Name = getKernelName("__mydsl_small_mmul", Shape);
+  if (auto *F = M.getFunction(Name))
+    return F;
+
+  auto *PtrTy = llvm::PointerType::getUnqual(M.getContext());
+  auto *F = createFunction(M, Name, {PtrTy, PtrTy, PtrTy});
+  for (auto &Arg : F->args())
+    Arg.addAttr(llvm::Attribute::NoAlias);
+
+  llvm::IRBuilder<> Builder(&F->getEntryBlock());
+  emitMatmul(Builder, F->getArg(0), F->getArg(1), F->getArg(2), Shape,
+             VectorWidth);
+  Builder.CreateRetVoid();
+  return F;
+}
+
+llvm::Function *getSmallMatmulBatchKernel(llvm::Module &M, MatmulShape Shape,
+                                          unsigned VectorWidth) {
+  auto Name = getKernelName("__mydsl_small_mmul_batch", Shape);
+  if (auto *F = M.getFunction(Name))
+    return F;
+
+  auto &Ctx = M.getContext();
+  auto *PtrTy = llvm::PointerType::getUnqual(Ctx);
+  auto *I64 = llvm::Type::getInt64Ty(Ctx);
+  auto *F = createFunction(M, Name, {PtrTy, PtrTy, PtrTy, I64});
+
+  // the product is emitted into the loop instead of calling the kernel, the
+  // operands of consecutive products may then be loaded ahead
+  auto *Entry = &F->getEntryBlock();
+  auto *Loop = llvm::BasicBlock::Create(Ctx, "batch", F);
+  auto *Exit = llvm::BasicBlock::Create(Ctx, "batch.end", F);
+  llvm::IRBuilder<> Builder(Entry);
+  Builder.CreateCondBr(
+      Builder.CreateICmpSGT(F->getArg(3), Builder.getInt64(0)), Loop, Exit);
+
+  Builder.SetInsertPoint(Loop);
+  auto *I = Builder.CreatePHI(I64, 2, "i");
+  I->addIncoming(Builder.getInt64(0), Entry);
+  auto Operand = [&](llvm::Value *Array) {
+    return Builder.CreateLoad(PtrTy,
+                              Builder.CreateInBoundsGEP(PtrTy, Array, I));
+  };
+  emitMatmul(Builder, Operand(F->getArg(0)), Operand(F->getArg(1)),
+             Operand(F->getArg(2)), Shape, VectorWidth);
+  auto *Next = Builder.CreateAdd(I, Builder.getInt64(1), "i.next",
+                                 /*HasNUW=*/true, /*HasNSW=*/true);
+  // the loop over K of large shapes ends in a new block
+  I->addIncoming(Next, Builder.GetInsertBlock());
+  Builder.CreateCondBr(Builder.CreateICmpSLT(Next, F->getArg(3)), Loop, Exit);
+
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateRetVoid();
+  return F;
+}
+
+llvm::Expected<SmallMatmul> SmallMatmul::Create(SmallMatmulCache &Cache,
+                                                MatmulShape Shape) {
+  auto Key = std::make_tuple(Shape.M, Shape.K, Shape.N);
+  if (auto It = Cache.Kernels.find(Key); It != Cache.Kernels.end())
+    return It->second;
+
+  auto &JIT = Cache.JIT;
+  auto KernelName = getKernelName("__mydsl_small_mmul", Shape);
+  auto BatchName = getKernelName("__mydsl_small_mmul_batch", Shape);
+
+  auto Ctx = std::make_unique<llvm::LLVMContext>();
+  auto M = std::make_unique<llvm::Module>(KernelName, *Ctx);
+  M->setDataLayout(JIT.getDataLayout());
+  unsigned VectorWidth = getHostVectorWidth(JIT);
+  getSmallMatmulKernel(*M, Shape, VectorWidth)
+      ->setLinkage(llvm::GlobalValue::ExternalLinkage);
+  getSmallMatmulBatchKernel(*M, Shape, VectorWidth)
+      ->setLinkage(llvm::GlobalValue::ExternalLinkage);
+  optimize(*M, JIT);
+
+  if (auto Err = JIT.addModule(
+          llvm::orc::ThreadSafeModule(std::move(M), std::move(Ctx))))
+    return std::move(Err);
+  auto Kernel = JIT.lookup(KernelName);
+  if (!Kernel)
+    return Kernel.takeError();
+  auto Batch = JIT.lookup(BatchName);
+  if (!Batch)
+    return Batch.takeError();
+
+  SmallMatmul Matmul(Shape, Kernel->getAddress().toPtr<KernelFn *>(),
+                     Batch->getAddress().toPtr<BatchFn *>());
+  Cache.Kernels.emplace(Key, Matmul);
+  return Matmul;
+}
+
+} // namespace MyDSL
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <tuple>
+
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/Error.h>
+
+namespace MyDSL {
+
+class Jit;
+class SmallMatmulCache;
+
+/// Static shape of a matrix product C (M x N) = A (M x K) * B (K x N).
+struct MatmulShape {
+  std::int64_t M, K, N;
+};
+
+/// Floats per fixed-width vector register of the host of \a JIT, from its
+/// TargetTransformInfo, 4 if the target machine cannot be created.
+unsigned getHostVectorWidth(Jit &JIT);
+
+/**
+ * @brief Returns the micro-kernel for the product of row-major, contiguous
+ * float matrices of the static \a Shape, generating it on first use.
+ *
+ * The kernel `void(float *C, const float *A, const float *B)` is meant for
+ * small matrices (up to about 64 x 64), where the blocking and packing of the
+ * GEMM builtin cost more than the product. The output is split into register
+ * tiles of up to 12 vector accumulators, each computed by a sequence of fused
+ * multiply-adds of a broadcast element of A and a row of B. The loop over K is
+ * fully unrolled unless the kernel would get too large.
+ *
+ * @param VectorWidth Floats per vector register of the target.
+ */
+llvm::Function *getSmallMatmulKernel(llvm::Module &M, MatmulShape Shape,
+                                     unsigned VectorWidth = 8);
+
+/**
+ * @brief Returns the batched variant of getSmallMatmulKernel():
+ * `void(float *const *C, const float *const *A, const float *const *B,
+ * int64_t Count)` computes C[i] = A[i] * B[i] for i < Count.
+ */
+llvm::Function *getSmallMatmulBatchKernel(llvm::Module &M, MatmulShape Shape,
+                                          unsigned VectorWidth = 8);
+
+/**
+ * @brief A small-matrix product JIT-compiled for one static shape, callable
+ * from the host, in the style of libxsmm.
+ *
+ * Create compiles the kernels of getSmallMatmulKernel() and
+ * getSmallMatmulBatchKernel() for the host into their own module of the Jit
+ * of a SmallMatmulCache, or returns the ones of the cache if the shape was
+ * compiled before. The batched entry point amortizes the call over many
+ * products, e.g. of all blocks of a tensor.
+ */
+class SmallMatmul {
+public:
+  using KernelFn = void(float *, const float *, const float *);
+  using BatchFn = void(float *const *, const float *const *,
+                       const float *const *, std::int64_t);
+
+  static llvm::Expected<SmallMatmul> Create(SmallMatmulCache &Cache,
+                                            MatmulShape Shape);
+
+  MatmulShape getShape() const { return Shape; }
+
+  void operator()(float *C, const float *A, const float *B) const {
+    Kernel(C, A, B);
+  }
+  void operator()(float *const *C, const float *const *A,
+                  const float *const *B, std::int64_t Count) const {
+    Batch(C, A, B, Count);
+  }
+
+private:
+  MatmulShape Shape;
+  KernelFn *Kernel;
+  BatchFn *Batch;
+
+  SmallMatmul(MatmulShape Shape, KernelFn *Kernel, BatchFn *Batch)
+      : Shape(Shape), Kernel(Kernel), Batch(Batch) {}
+};
+
+/// The SmallMatmul kernels compiled into one Jit, by shape. Must not outlive
+/// the Jit.
+class SmallMatmulCache {
+public:
+  explicit SmallMatmulCache(Jit &JIT) : JIT(JIT) {}
+
+private:
+  friend class SmallMatmul;
+
+  Jit &JIT;
+  std::map<std::tuple<std::int64_t, std::int64_t, std::int64_t>, SmallMatmul>
+      Kernels;
+};
+
+} // namespace MyDSL
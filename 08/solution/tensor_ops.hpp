@@ -4,12 +4,14 @@
 #include "control_flow.hpp"
 #include "int_ops.hpp"
 #include "ref.hpp"
+#include "small_mmul.hpp"
 
 #include <algorithm>
 #include <llvm/ADT/SmallVector.h>
 #include <llvm/ADT/Twine.h>
 #include <llvm/IR/DerivedTypes.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Intrinsics.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Metadata.h>
 
@@ -301,16 +303,42 @@ public:
   void mmul(Tensor<T,Dim>& dest, const Tensor<T, Dim> &other) const
     requires(Multiplicable<T, T> && Addable<T, T> && Dim == 2)
   {
-    // pre: size_[0] and size_[1] are equiv
+    // pre: size_[1] == other.size_[0], dest is size_[0] x other.size_[1]
 
     auto &M = *builder_.GetInsertBlock()->getModule();
     auto &Ctx = M.getContext();
 
     auto FC = M.getOrInsertFunction(
         "__mydsl_tensor_mmul_2_f32", builder_.getVoidTy(), getType(Ctx),
-        getType(Ctx), getType(Ctx), Integer::getType(Ctx));
+        getType(Ctx), getType(Ctx), Integer::getType(Ctx),
+        Integer::getType(Ctx), Integer::getType(Ctx));
 
-    builder_.CreateCall(FC, {dest.data_, data_, other.data_, size_[0]});
+    builder_.CreateCall(FC, {dest.data_, data_, other.data_, size_[0],
+                             size_[1], other.size_[1]});
+  }
+
+  /// Like mmul(), but for small matrices of the static \a shape: calls a
+  /// register-blocked kernel generated for exactly this shape (see
+  /// getSmallMatmulKernel) instead of the blocked GEMM builtin. \a
+  /// VectorWidth is the number of floats per vector register of the target,
+  /// see getHostVectorWidth. Traps if the sizes of the tensors do not match
+  /// \a shape.
+  void mmul(Tensor<T, Dim> &dest, const Tensor<T, Dim> &other,
+            MatmulShape shape, unsigned VectorWidth) const
+    requires(Multiplicable<T, T> && Addable<T, T> && Dim == 2)
+  {
+    // the kernel reads and writes exactly the elements of shape
+    ControlFlow CF(builder_);
+    Bool Matches = size_[0] == shape.M && size_[1] == shape.K &&
+                   other.size_[0] == shape.K && other.size_[1] == shape.N &&
+                   dest.size_[0] == shape.M && dest.size_[1] == shape.N;
+    CF.If(!Matches, [&] {
+      builder_.CreateIntrinsic(llvm::Intrinsic::trap, {}, {});
+    });
+
+    auto *F = getSmallMatmulKernel(*builder_.GetInsertBlock()->getModule(),
+                                   shape, VectorWidth);
+    builder_.CreateCall(F, {dest.data_, data_, other.data_});
   }
 };
 } // namespace MyDSL
@@ -4,11 +4,99 @@
 #include "float_ops.hpp"
 #include "int_ops.hpp"
 
+#include <llvm/ADT/APInt.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DerivedTypes.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
 
+namespace {
+using MyDSL::ReduceKind;
+
+/// Returns the neutral element of the reduction for scalar and vector types.
+llvm::Constant *getReduceIdentity(ReduceKind Kind, llvm::Type *Ty) {
+  if (Ty->isFPOrFPVectorTy()) {
+    switch (Kind) {
+    case ReduceKind::Add:
+      // -0.0, as +0.0 would turn a sum of negative zeros into +0.0
+      return llvm::ConstantFP::getNegativeZero(Ty);
+    case ReduceKind::Mul:
+      return llvm::ConstantFP::get(Ty, 1.0);
+    case ReduceKind::Min:
+      return llvm::ConstantFP::getInfinity(Ty, /*Negative=*/false);
+    case ReduceKind::Max:
+      return llvm::ConstantFP::getInfinity(Ty, /*Negative=*/true);
+    }
+  }
+
+  const unsigned Bits = Ty->getScalarSizeInBits();
+  switch (Kind) {
+  case ReduceKind::Add:
+    return llvm::ConstantInt::get(Ty, 0);
+  case ReduceKind::Mul:
+    return llvm::ConstantInt::get(Ty, 1);
+  case ReduceKind::Min:
+    return llvm::ConstantInt::get(Ty, llvm::APInt::getSignedMaxValue(Bits));
+  case ReduceKind::Max:
+    return llvm::ConstantInt::get(Ty, llvm::APInt::getSignedMinValue(Bits));
+  }
+  llvm_unreachable("unknown reduction kind");
+}
+
+/// Combines two (vector) values with the reduction operator.
+llvm::Value *emitReduceOp(llvm::IRBuilder<> &Builder, ReduceKind Kind,
+                          llvm::Value *LHS, llvm::Value *RHS) {
+  const bool IsFP = LHS->getType()->isFPOrFPVectorTy();
+  switch (Kind) {
+  case ReduceKind::Add:
+    return IsFP ? Builder.CreateFAdd(LHS, RHS) : Builder.CreateAdd(LHS, RHS);
+  case ReduceKind::Mul:
+    return IsFP ? Builder.CreateFMul(LHS, RHS) : Builder.CreateMul(LHS, RHS);
+  case ReduceKind::Min:
+    return IsFP ? Builder.CreateMinNum(LHS, RHS)
+                : Builder.CreateBinaryIntrinsic(llvm::Intrinsic::smin, LHS,
+                                                RHS);
+  case ReduceKind::Max:
+    return IsFP ? Builder.CreateMaxNum(LHS, RHS)
+                : Builder.CreateBinaryIntrinsic(llvm::Intrinsic::smax, LHS,
+                                                RHS);
+  }
+  llvm_unreachable("unknown reduction kind");
+}
+
+/// Reduces the lanes of a vector with the reduction operator.
+llvm::Value *emitHorizontalReduce(llvm::IRBuilder<> &Builder, ReduceKind Kind,
+                                  llvm::Value *Vec) {
+  auto *ScalarTy = Vec->getType()->getScalarType();
+  if (ScalarTy->isFloatingPointTy()) {
+    switch (Kind) {
+    case ReduceKind::Add:
+      return Builder.CreateFAddReduce(getReduceIdentity(Kind, ScalarTy), Vec);
+    case ReduceKind::Mul:
+      return Builder.CreateFMulReduce(getReduceIdentity(Kind, ScalarTy), Vec);
+    case ReduceKind::Min:
+      return Builder.CreateFPMinReduce(Vec);
+    case ReduceKind::Max:
+      return Builder.CreateFPMaxReduce(Vec);
+    }
+  }
+
+  switch (Kind) {
+  case ReduceKind::Add:
+    return Builder.CreateAddReduce(Vec);
+  case ReduceKind::Mul:
+    return Builder.CreateMulReduce(Vec);
+  case ReduceKind::Min:
+    return Builder.CreateIntMinReduce(Vec, /*IsSigned=*/true);
+  case ReduceKind::Max:
+    return Builder.CreateIntMaxReduce(Vec, /*IsSigned=*/true);
+  }
+  llvm_unreachable("unknown reduction kind");
+}
+} // namespace
+
 namespace MyDSL {
 
 void ControlFlow::If(const Bool &Cond, const std::function<void()> &ThenTgt,
@@ -119,6 +207,71 @@ void ControlFlow::For(const Integer &Start,
         });
 }
 
+template <class T>
+T ControlFlow::Reduce(ReduceKind Kind, const Integer &Start,
+                      const Integer &End,
+                      const std::function<T(const Integer &)> &Body,
+                      unsigned Accumulators) {
+  assert(Accumulators > 0 && "Need at least one accumulator");
+  auto *ScalarTy = T::getType(builder_.getContext());
+  auto *VecTy = llvm::FixedVectorType::get(ScalarTy, Accumulators);
+
+  // Only the combining operations may be reassociated, the body keeps the
+  // flags of the surrounding code.
+  auto Reassociable = [&](auto &&Emit) {
+    FastMathScope Scope(builder_, {FastMath::Reassoc});
+    return Emit();
+  };
+
+  // Each iteration of the main loop feeds one value into every lane of the
+  // partial results.
+  const auto Step = static_cast<Integer::NativeType>(Accumulators);
+  Integer VecEnd = End - (End - Start) % Step;
+
+  BaseOps Partial{getReduceIdentity(Kind, VecTy), builder_};
+  For(
+      Start, [&](const Integer &I) { return I < VecEnd; },
+      [&](const Integer &I) { return I + Step; },
+      [&](const Integer &I) {
+        llvm::Value *Values = llvm::PoisonValue::get(VecTy);
+        for (unsigned Lane = 0; Lane < Accumulators; ++Lane)
+          Values = builder_.CreateInsertElement(
+              Values, Body(I + static_cast<Integer::NativeType>(Lane)), Lane);
+        Partial = BaseOps{Reassociable([&] {
+                            return emitReduceOp(builder_, Kind, Partial,
+                                                Values);
+                          }),
+                          builder_};
+      });
+
+  BaseOps Result{Reassociable([&] {
+                   return emitHorizontalReduce(builder_, Kind, Partial);
+                 }),
+                 builder_};
+
+  // remainder
+  For(
+      VecEnd, [&](const Integer &I) { return I < End; },
+      [&](const Integer &I) { return I + 1; },
+      [&](const Integer &I) {
+        llvm::Value *Value = Body(I);
+        Result = BaseOps{Reassociable([&] {
+                           return emitReduceOp(builder_, Kind, Result, Value);
+                         }),
+                         builder_};
+      });
+
+  return T{Result};
+}
+
+template Integer ControlFlow::Reduce<Integer>(
+    ReduceKind, const Integer &, const Integer &,
+    const std::function<Integer(const Integer &)> &, unsigned);
+template Float
+ControlFlow::Reduce<Float>(ReduceKind, const Integer &, const Integer &,
+                           const std::function<Float(const Integer &)> &,
+                           unsigned);
+
 void ControlFlow::Return() { builder_.CreateRetVoid(); }
 
 void ControlFlow::Return(const Float &V) { builder_.CreateRet(V); }
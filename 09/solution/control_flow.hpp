@@ -11,6 +11,9 @@ namespace MyDSL {
 class Integer;
 class Float;
 
+/// The operator of a reduction emitted by ControlFlow::Reduce.
+enum class ReduceKind { Add, Mul, Min, Max };
+
 /**
  * @brief Helper class to introduce common control flow.
  */
@@ -83,6 +86,30 @@ public:
            const std::function<Integer(const Integer &)> &Step,
            const std::function<void(const Integer &)> &Body);
 
+  /**
+   * @brief Emits a reduction over the index range [\a Start, \a End).
+   *
+   * In contrast to accumulating into a value inside a #For loop, the
+   * reduction operator is declared to be associative. This allows keeping \a
+   * Accumulators independent partial results in a vector, which breaks the
+   * serial dependency chain between iterations. After the loop the partial
+   * results are combined by a tree reduction, a scalar loop handles the
+   * remaining iterations.
+   *
+   * @tparam T Type of the reduced value (Integer or Float).
+   * @param Kind The reduction operator.
+   * @param Start Integer value as start.
+   * @param End Integer value as end (exclusive).
+   * @param Body Functor that generates the value of one iteration. It receives
+   * the current loop index as value.
+   * @param Accumulators Number of independent partial results.
+   * @return T The reduced value.
+   */
+  template <class T>
+  T Reduce(ReduceKind Kind, const Integer &Start, const Integer &End,
+           const std::function<T(const Integer &)> &Body,
+           unsigned Accumulators = 8);
+
   // Emits a return statement.
   void Return();
   // Emits a return statement with a value.
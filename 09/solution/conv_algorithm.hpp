@@ -0,0 +1,208 @@
+#pragma once
+
+#include <cstdint>
+#include <initializer_list>
+
+// Shared by the DSL and the builtins in lib/tensor.cpp, so plain C++ only.
+
+namespace MyDSL {
+
+/**
+ * @brief Memory layouts of 4D tensors, which are always indexed as NCHW
+ * (batch, channel, row, column).
+ *
+ * The blocked layouts NCHW8c and NCHW16c split the channels into blocks of 8
+ * or 16 and store the channels of a block next to each other, i.e. as
+ * [N][C / 8][H][W][8]. A pixel of a block is then one contiguous vector. The
+ * last block is padded to the full block size.
+ */
+enum class TensorLayout {
+  /// Row-major, the only layout of tensors of other ranks.
+  NCHW,
+  /// The channels of a pixel next to each other.
+  NHWC,
+  NCHW8c,
+  NCHW16c,
+};
+
+/// Name of \a layout in the names of the builtins,
+/// `__mydsl_tensor_conv_<name>_4_<type>`.
+constexpr const char *getTensorLayoutName(TensorLayout layout) {
+  switch (layout) {
+  case TensorLayout::NCHW:
+    return "nchw";
+  case TensorLayout::NHWC:
+    return "nhwc";
+  case TensorLayout::NCHW8c:
+    return "nchw8c";
+  case TensorLayout::NCHW16c:
+    return "nchw16c";
+  }
+  return "";
+}
+
+/// Channels per block of a blocked \a layout, 0 for the other layouts.
+constexpr std::int64_t getLayoutBlock(TensorLayout layout) {
+  switch (layout) {
+  case TensorLayout::NCHW8c:
+    return 8;
+  case TensorLayout::NCHW16c:
+    return 16;
+  default:
+    return 0;
+  }
+}
+
+/// Algorithms of the 2D convolution builtins.
+enum class ConvAlgorithm {
+  /// One multiply-add per window element and output element.
+  Direct,
+  /// Copies the windows of an output row into a matrix and multiplies it with
+  /// the filter, which turns the window loops into contiguous dot products.
+  Im2col,
+  /// Winograd F(2x2, 3x3): 16 instead of 36 multiplications per 2x2 outputs,
+  /// 3x3 windows only.
+  Winograd,
+  /// Pointwise product of the Fourier transforms, independent of the window
+  /// size.
+  FFT,
+  /// A pass with the row and a pass with the column factor of a rank-1
+  /// filter, separable filters only.
+  Separable,
+};
+
+/// Name of \a algorithm in the names of the builtins,
+/// `__mydsl_tensor_conv_<name>_2_<type>`.
+constexpr const char *getConvAlgorithmName(ConvAlgorithm algorithm) {
+  switch (algorithm) {
+  case ConvAlgorithm::Direct:
+    return "direct";
+  case ConvAlgorithm::Im2col:
+    return "im2col";
+  case ConvAlgorithm::Winograd:
+    return "winograd";
+  case ConvAlgorithm::FFT:
+    return "fft";
+  case ConvAlgorithm::Separable:
+    return "separable";
+  }
+  return "";
+}
+
+/**
+ * @brief Estimated time (in ns) of convolving a \a size x \a size image with
+ * a \a window x \a window filter, negative if \a algorithm does not support
+ * the filter. \a separable tells whether the filter has rank 1.
+ *
+ * The costs per multiply-add, output or FFT butterfly are hand-tuned
+ * estimates for the f32 builtins, not measurements. Only their ratios matter
+ * for selectConvAlgorithm().
+ */
+constexpr double getConvCost(ConvAlgorithm algorithm, std::int64_t size,
+                             std::int64_t window, bool separable = false) {
+  double out = size - window + 1;
+  if (out <= 0)
+    return 0.;
+  double outputs = out * out;
+  double macs = outputs * window * window;
+  switch (algorithm) {
+  case ConvAlgorithm::Direct:
+    return 50. + 1.4 * macs;
+  case ConvAlgorithm::Im2col:
+    // the copies are amortized over the vectorized multiply-adds
+    return 500. + 0.8 * macs;
+  case ConvAlgorithm::Winograd:
+    return window == 3 ? 50. + 8.3 * outputs : -1.;
+  case ConvAlgorithm::FFT: {
+    double padded = 1.;
+    double log2 = 0.;
+    while (padded < size) {
+      padded *= 2.;
+      log2 += 1.;
+    }
+    // three 2D transforms of padded^2 points, each 2 * log2 passes
+    return 1000. + 4. * 3. * 2. * padded * padded * log2;
+  }
+  case ConvAlgorithm::Separable:
+    // the row pass covers all rows of the image
+    return separable ? 300. + 0.75 * (size + out) * out * window : -1.;
+  }
+  return -1.;
+}
+
+/// Returns the cheapest algorithm according to getConvCost().
+constexpr ConvAlgorithm selectConvAlgorithm(std::int64_t size,
+                                            std::int64_t window,
+                                            bool separable = false) {
+  ConvAlgorithm best = ConvAlgorithm::Direct;
+  double bestCost = getConvCost(best, size, window);
+  for (auto algorithm : {ConvAlgorithm::Im2col, ConvAlgorithm::Winograd,
+                         ConvAlgorithm::FFT, ConvAlgorithm::Separable}) {
+    double cost = getConvCost(algorithm, size, window, separable);
+    if (cost >= 0. && cost < bestCost) {
+      best = algorithm;
+      bestCost = cost;
+    }
+  }
+  return best;
+}
+
+/// Largest number of nonzero weights of a constant filter whose window is
+/// unrolled, see isUnrolledFilter().
+constexpr std::int64_t MaxUnrolledTaps = 64;
+
+/**
+ * @brief Returns true if the direct convolution with the constant row-major
+ * \a window x \a window filter is unrolled with its weights as immediates,
+ * see FuseTensorOpsPass: if it has at most MaxUnrolledTaps nonzero weights
+ * and, if it is \a separable, not more than the two 1D passes.
+ */
+constexpr bool isUnrolledFilter(const float *filter, std::int64_t window,
+                                bool separable) {
+  std::int64_t taps = 0;
+  for (std::int64_t k = 0; k < window * window; ++k)
+    taps += filter[k] != 0.f;
+  return taps <= MaxUnrolledTaps && (!separable || taps <= 2 * window);
+}
+
+/**
+ * @brief Factors a row-major \a window x \a window filter into the outer
+ * product of a column and a row, if it has rank 1 up to float rounding, e.g.
+ * the Sobel filter into [1, 2, 1]^T [1, 0, -1].
+ *
+ * @param factors Receives the \a window column factors followed by the \a
+ * window row factors.
+ * @return bool Whether the filter is separable.
+ */
+constexpr bool factorSeparableFilter(const float *filter, std::int64_t window,
+                                     float *factors) {
+  auto abs = [](float value) { return value < 0.f ? -value : value; };
+  // the largest element is the pivot, its row and column span the filter
+  std::int64_t pivot = 0;
+  for (std::int64_t k = 1; k < window * window; ++k)
+    if (abs(filter[k]) > abs(filter[pivot]))
+      pivot = k;
+  float scale = filter[pivot];
+  if (scale == 0.f) {
+    for (std::int64_t k = 0; k < 2 * window; ++k)
+      factors[k] = 0.f;
+    return true;
+  }
+
+  std::int64_t row = pivot / window;
+  std::int64_t column = pivot % window;
+  for (std::int64_t u = 0; u < window; ++u)
+    factors[u] = filter[u * window + column];
+  for (std::int64_t v = 0; v < window; ++v)
+    factors[window + v] = filter[row * window + v] / scale;
+
+  float tolerance = abs(scale) * 1e-6f;
+  for (std::int64_t u = 0; u < window; ++u)
+    for (std::int64_t v = 0; v < window; ++v)
+      if (abs(filter[u * window + v] - factors[u] * factors[window + v]) >
+          tolerance)
+        return false;
+  return true;
+}
+
+} // namespace MyDSL
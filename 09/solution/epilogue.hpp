@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+
+// Shared by FuseTensorOpsPass and the builtins in lib/tensor.cpp, so plain C++
+// only.
+
+namespace MyDSL {
+
+/// The elementwise operations that FuseTensorOpsPass folds into the output
+/// write of a convolution or product, see EpilogueOp.
+enum class EpilogueKind : std::int32_t {
+  /// Adds the bias of the channel of the element.
+  Bias,
+  /// Multiplies by factor.
+  Scale,
+  /// Replaces negative values by 0.
+  ReLU,
+  /// Clamps to [lower, upper].
+  Clamp,
+};
+
+/**
+ * @brief One post-op of a fused builtin, e.g.
+ * `__mydsl_fused_tensor_conv_nchw_epilogue_4_f32`, which takes an array of
+ * them and their number after the arguments of the unfused builtin. They are
+ * applied in order to every result before it is stored.
+ *
+ * FuseTensorOpsPass builds the array in the IR, as the struct
+ * `{i32, float, float, ptr, i64, i64, i64}`, so the layouts must match.
+ */
+struct EpilogueOp {
+  EpilogueKind kind;
+  /// The factor of Scale, the lower bound of Clamp.
+  float a = 0.f;
+  /// The upper bound of Clamp.
+  float b = 0.f;
+  /// The bias of Bias, per channel, of the element type of the result.
+  const void *bias = nullptr;
+  /// The channels of Bias, see getEpilogueChannel.
+  std::int64_t channels = 0, inner = 0, block = 0;
+};
+
+/**
+ * @brief Returns the channel of the element at the flat position \a index
+ * (in memory) of the result of a Bias op.
+ *
+ * The channels are dimension 1 of the result: the columns of matrices (inner
+ * 1), the channels of NCHW (inner H * W) or NHWC (inner 1) tensors. Blocked
+ * layouts store \a block channels next to each other, their inner is
+ * H * W * block. The channel may be a padding channel of the last block,
+ * which is not less than \a channels.
+ */
+constexpr std::int64_t getEpilogueChannel(const EpilogueOp &op,
+                                          std::int64_t index) {
+  std::int64_t groups = (op.channels + op.block - 1) / op.block;
+  return index / op.inner % groups * op.block + index % op.block;
+}
+
+} // namespace MyDSL
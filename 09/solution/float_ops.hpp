@@ -1,17 +1,86 @@
 #pragma once
 
 #include <cmath>
+#include <initializer_list>
 #include <ostream>
 
 #include "base_ops.hpp"
 #include "bool_ops.hpp"
 
 #include <llvm/IR/Constants.h>
+#include <llvm/IR/FMF.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/Support/raw_ostream.h>
 
 namespace MyDSL {
 class Integer;
+template <llvm::Type::TypeID ID> class ReducedFloat;
+using Half = ReducedFloat<llvm::Type::HalfTyID>;
+using BFloat16 = ReducedFloat<llvm::Type::BFloatTyID>;
+
+/// Fast-math flags that can be enabled by a FastMathScope.
+enum class FastMath {
+  Contract,
+  Reassoc,
+  NoNaNs,
+  NoInfs,
+  NoSignedZeros,
+  AllowReciprocal,
+  ApproxFunc,
+  Fast
+};
+
+/**
+ * @brief RAII scope that enables fast-math flags for all floating point
+ * operations emitted by the builder while the scope is alive.
+ * The previous flags of the builder are restored at the end of the scope.
+ *
+ * By default, Float operations are strict IEEE operations. Opting in to e.g.
+ * `{FastMath::Contract, FastMath::Reassoc}` allows LLVM to form FMAs and to
+ * vectorize reductions.
+ */
+class FastMathScope {
+  llvm::IRBuilderBase::FastMathFlagGuard guard_;
+
+public:
+  FastMathScope(llvm::IRBuilder<> &builder,
+                std::initializer_list<FastMath> flags)
+      : guard_(builder) {
+    llvm::FastMathFlags FMF = builder.getFastMathFlags();
+    for (auto flag : flags) {
+      switch (flag) {
+      case FastMath::Contract:
+        FMF.setAllowContract();
+        break;
+      case FastMath::Reassoc:
+        FMF.setAllowReassoc();
+        break;
+      case FastMath::NoNaNs:
+        FMF.setNoNaNs();
+        break;
+      case FastMath::NoInfs:
+        FMF.setNoInfs();
+        break;
+      case FastMath::NoSignedZeros:
+        FMF.setNoSignedZeros();
+        break;
+      case FastMath::AllowReciprocal:
+        FMF.setAllowReciprocal();
+        break;
+      case FastMath::ApproxFunc:
+        FMF.setApproxFunc();
+        break;
+      case FastMath::Fast:
+        FMF.setFast();
+        break;
+      }
+    }
+    builder.setFastMathFlags(FMF);
+  }
+
+  FastMathScope(const FastMathScope &) = delete;
+  FastMathScope &operator=(const FastMathScope &) = delete;
+};
 
 class Float : public BaseOps {
 public:
@@ -41,6 +110,11 @@ public:
     assert(base.getType()->isFloatTy());
   }
 
+  /// Extends a Half or BFloat16, which is exact. Also keeps reduced floats
+  /// away from the BaseOps constructor.
+  template <llvm::Type::TypeID ID>
+  explicit Float(const ReducedFloat<ID> &value);
+
   /// Get the type, that all Floats have in our DSL.
   static llvm::Type *getType(llvm::LLVMContext &Ctx) {
     return llvm::Type::getFloatTy(Ctx);
@@ -152,8 +226,229 @@ public:
 
   Float operator^(NativeType f) const { return *this ^ getConst(f); }
 
+  /// Fused multiply-add: computes `*this * mul + add` with a single rounding.
+  Float fma(const Float &mul, const Float &add) const {
+    return {
+        builder_.CreateCall(llvm::Intrinsic::getOrInsertDeclaration(
+                                builder_.GetInsertBlock()->getModule(),
+                                llvm::Intrinsic::fma, {getValue()->getType()}),
+                            {getValue(), mul.getValue(), add.getValue()}),
+        builder_};
+  }
+
+  Float fma(NativeType mul, NativeType add) const {
+    return fma(getConst(mul), getConst(add));
+  }
+
+  /// Rounds to the nearest integral value, ties to even.
+  Float round() const {
+    return {builder_.CreateUnaryIntrinsic(llvm::Intrinsic::roundeven,
+                                          getValue()),
+            builder_};
+  }
+
   Integer toInteger() const;
   explicit operator Integer() const;
+
+  /// Rounds to the nearest Half or BFloat16, ties to even.
+  Half toHalf() const;
+  BFloat16 toBFloat16() const;
+
+  template <llvm::Type::TypeID ID> friend class ReducedFloat;
+};
+
+/**
+ * @brief A 16 bit floating point type, used to halve the memory footprint and
+ * bandwidth of tensors. Only the storage is reduced: every operation extends
+ * its operands to Float, computes in f32 and rounds the result back.
+ * Reductions over tensors of reduced floats accumulate in Float.
+ *
+ * @tparam ID The LLVM type of the storage, `half` (IEEE binary16) for Half or
+ * `bfloat` (the upper half of an f32) for BFloat16.
+ */
+template <llvm::Type::TypeID ID> class ReducedFloat : public BaseOps {
+  static_assert(ID == llvm::Type::HalfTyID || ID == llvm::Type::BFloatTyID);
+
+public:
+  /// Native values are given as float and rounded to the storage type.
+  using NativeType = float;
+
+private:
+  ReducedFloat getConst(NativeType value) const {
+    return {llvm::ConstantFP::get(getType(builder_.getContext()), value),
+            builder_};
+  }
+
+  /// Ref constructor.
+  ReducedFloat(llvm::Type *type, llvm::Value *value,
+               llvm::IRBuilder<> &builder)
+      : BaseOps(type, value, builder) {}
+
+  template <class T> friend class Ref;
+
+  /// Extends a value of the storage type to f32, which is exact.
+  static llvm::Value *extend(llvm::Value *value, llvm::IRBuilder<> &builder) {
+    if constexpr (ID == llvm::Type::HalfTyID) {
+      return builder.CreateFPExt(value, builder.getFloatTy());
+    } else {
+      auto *Bits = builder.CreateZExt(
+          builder.CreateBitCast(value, builder.getInt16Ty()),
+          builder.getInt32Ty());
+      return builder.CreateBitCast(builder.CreateShl(Bits, 16),
+                                   builder.getFloatTy());
+    }
+  }
+
+  /// Rounds an f32 value to the storage type. bfloat is rounded on the bit
+  /// pattern, not every target can lower an fptrunc to bfloat.
+  static llvm::Value *round(llvm::Value *value, llvm::IRBuilder<> &builder) {
+    auto *Ty = getType(builder.getContext());
+    if constexpr (ID == llvm::Type::HalfTyID) {
+      return builder.CreateFPTrunc(value, Ty);
+    } else {
+      auto *Bits = builder.CreateBitCast(value, builder.getInt32Ty());
+      auto *Odd = builder.CreateAnd(builder.CreateLShr(Bits, 16), 1);
+      auto *Bias = builder.CreateAdd(Odd, builder.getInt32(0x7FFF));
+      auto *Rounded = builder.CreateLShr(builder.CreateAdd(Bits, Bias), 16);
+      // keep NaNs quiet NaNs, rounding could turn them into infinities
+      auto *Result =
+          builder.CreateSelect(builder.CreateFCmpUNO(value, value),
+                               builder.getInt32(0x7FC0), Rounded);
+      return builder.CreateBitCast(
+          builder.CreateTrunc(Result, builder.getInt16Ty()), Ty);
+    }
+  }
+
+  ReducedFloat compute(llvm::Instruction::BinaryOps op,
+                       const ReducedFloat &other) const {
+    return {round(builder_.CreateBinOp(op, extend(getValue(), builder_),
+                                       extend(other.getValue(), builder_)),
+                  builder_),
+            builder_};
+  }
+
+  Bool compare(llvm::CmpInst::Predicate pred,
+               const ReducedFloat &other) const {
+    return {builder_.CreateFCmp(pred, extend(getValue(), builder_),
+                                extend(other.getValue(), builder_)),
+            builder_};
+  }
+
+public:
+  ReducedFloat(NativeType value, llvm::IRBuilder<> &builder)
+      : BaseOps(llvm::ConstantFP::get(getType(builder.getContext()), value),
+                builder) {}
+  ReducedFloat(llvm::Value *value, llvm::IRBuilder<> &builder)
+      : BaseOps(value, builder) {}
+
+  explicit ReducedFloat(const BaseOps &base) : BaseOps(base) {
+    assert(base.getType()->getTypeID() == ID);
+  }
+
+  /// Rounds \a value to the nearest representable value, ties to even.
+  explicit ReducedFloat(const Float &value)
+      : BaseOps(round(value.getValue(), value.builder_), value.builder_) {}
+
+  /// Get the storage type.
+  static llvm::Type *getType(llvm::LLVMContext &Ctx) {
+    if constexpr (ID == llvm::Type::HalfTyID)
+      return llvm::Type::getHalfTy(Ctx);
+    else
+      return llvm::Type::getBFloatTy(Ctx);
+  }
+
+  /**
+   * @brief Assignment operator.
+   * Stores the native value, rounded to the storage type, to the alloca.
+   *
+   * @param other The native value to store.
+   * @return BaseOps& this.
+   */
+  BaseOps &operator=(NativeType other) {
+    store(getConst(other));
+    return *this;
+  }
+
+  /// arithmetic operators
+  ReducedFloat operator+(const ReducedFloat &other) const {
+    return compute(llvm::Instruction::FAdd, other);
+  }
+  ReducedFloat operator-(const ReducedFloat &other) const {
+    return compute(llvm::Instruction::FSub, other);
+  }
+  ReducedFloat operator*(const ReducedFloat &other) const {
+    return compute(llvm::Instruction::FMul, other);
+  }
+  ReducedFloat operator/(const ReducedFloat &other) const {
+    return compute(llvm::Instruction::FDiv, other);
+  }
+  ReducedFloat operator-() const {
+    return {builder_.CreateFNeg(getValue()), builder_};
+  }
+
+  ReducedFloat operator+(NativeType f) const { return *this + getConst(f); }
+  ReducedFloat operator-(NativeType f) const { return *this - getConst(f); }
+  ReducedFloat operator*(NativeType f) const { return *this * getConst(f); }
+  ReducedFloat operator/(NativeType f) const { return *this / getConst(f); }
+
+  /// relational operators
+  Bool operator==(const ReducedFloat &other) const {
+    return compare(llvm::CmpInst::FCMP_OEQ, other);
+  }
+  Bool operator!=(const ReducedFloat &other) const {
+    return compare(llvm::CmpInst::FCMP_ONE, other);
+  }
+  Bool operator<(const ReducedFloat &other) const {
+    return compare(llvm::CmpInst::FCMP_OLT, other);
+  }
+  Bool operator<=(const ReducedFloat &other) const {
+    return compare(llvm::CmpInst::FCMP_OLE, other);
+  }
+  Bool operator>(const ReducedFloat &other) const {
+    return compare(llvm::CmpInst::FCMP_OGT, other);
+  }
+  Bool operator>=(const ReducedFloat &other) const {
+    return compare(llvm::CmpInst::FCMP_OGE, other);
+  }
+
+  Bool operator==(NativeType f) const { return *this == getConst(f); }
+  Bool operator!=(NativeType f) const { return *this != getConst(f); }
+  Bool operator<(NativeType f) const { return *this < getConst(f); }
+  Bool operator<=(NativeType f) const { return *this <= getConst(f); }
+  Bool operator>(NativeType f) const { return *this > getConst(f); }
+  Bool operator>=(NativeType f) const { return *this >= getConst(f); }
+
+  /// compound assignment operators
+  ReducedFloat &operator+=(const ReducedFloat &other) {
+    store(*this + other);
+    return *this;
+  }
+  ReducedFloat &operator-=(const ReducedFloat &other) {
+    store(*this - other);
+    return *this;
+  }
+  ReducedFloat &operator*=(const ReducedFloat &other) {
+    store(*this * other);
+    return *this;
+  }
+  ReducedFloat &operator/=(const ReducedFloat &other) {
+    store(*this / other);
+    return *this;
+  }
+
+  ReducedFloat &operator+=(NativeType f) { return *this += getConst(f); }
+  ReducedFloat &operator-=(NativeType f) { return *this -= getConst(f); }
+  ReducedFloat &operator*=(NativeType f) { return *this *= getConst(f); }
+  ReducedFloat &operator/=(NativeType f) { return *this /= getConst(f); }
+
+  /// Extends to Float, which is exact.
+  Float toFloat() const { return {extend(getValue(), builder_), builder_}; }
 };
 
+template <llvm::Type::TypeID ID>
+Float::Float(const ReducedFloat<ID> &value) : Float(value.toFloat()) {}
+
+inline Half Float::toHalf() const { return Half{*this}; }
+inline BFloat16 Float::toBFloat16() const { return BFloat16{*this}; }
+
 } // namespace MyDSL
@@ -15,4 +15,74 @@ Float Integer::toFloat() const {
 
 Integer::operator Float() const { return toFloat(); }
 
+InvariantDivisor::InvariantDivisor(const Integer &divisor)
+    : divisor_(divisor), magic_(0, divisor.builder_),
+      shift_(0, divisor.builder_), roundUp_(0, divisor.builder_),
+      sign_(0, divisor.builder_) {
+  auto &B = divisor.builder_;
+  auto *I64 = B.getInt64Ty();
+  auto *I128 = B.getInt128Ty();
+
+  llvm::Value *D = divisor_.getValue();
+  llvm::Value *AbsD = divisor_.abs().getValue();
+  // floor(log2(|d|)), |d| = 2^63 for INT64_MIN
+  llvm::Value *Log2 = B.CreateSub(
+      B.getInt64(63), B.CreateBinaryIntrinsic(llvm::Intrinsic::ctlz, AbsD,
+                                              B.getTrue()));
+  llvm::Value *IsPow2 = B.CreateICmpEQ(
+      B.CreateAnd(AbsD, B.CreateSub(AbsD, B.getInt64(1))), B.getInt64(0));
+
+  // m = 2 * floor(2^(63 + l) / |d|) rounded up, which fits into 64 bits
+  // because 2^l < |d| < 2^(l + 1) if |d| is no power of two. Powers of two
+  // select magic 0 instead, they are divided by the shift alone.
+  llvm::Value *Numerator = B.CreateShl(
+      llvm::ConstantInt::get(I128, 1),
+      B.CreateZExt(B.CreateAdd(Log2, B.getInt64(63)), I128));
+  llvm::Value *Quotient128 = B.CreateUDiv(Numerator, B.CreateZExt(AbsD, I128));
+  llvm::Value *Quotient = B.CreateTrunc(Quotient128, I64);
+  llvm::Value *Rem = B.CreateTrunc(
+      B.CreateSub(Numerator,
+                  B.CreateMul(Quotient128, B.CreateZExt(AbsD, I128))),
+      I64);
+  llvm::Value *TwiceRem = B.CreateAdd(Rem, Rem);
+  llvm::Value *RoundsUp = B.CreateOr(B.CreateICmpUGE(TwiceRem, AbsD),
+                                     B.CreateICmpULT(TwiceRem, Rem));
+  llvm::Value *Magic =
+      B.CreateAdd(B.CreateAdd(Quotient, Quotient),
+                  B.CreateAdd(B.CreateZExt(RoundsUp, I64), B.getInt64(1)));
+
+  magic_ = Integer{B.CreateSelect(IsPow2, B.getInt64(0), Magic), B};
+  shift_ = Integer{Log2, B};
+  roundUp_ = Integer{
+      B.CreateSub(B.CreateShl(B.getInt64(1), Log2), B.CreateZExt(IsPow2, I64)),
+      B};
+  sign_ = Integer{B.CreateAShr(D, B.getInt64(63)), B};
+}
+
+Integer InvariantDivisor::divide(const Integer &dividend) const {
+  auto &B = divisor_.builder_;
+  auto *I64 = B.getInt64Ty();
+  auto *I128 = B.getInt128Ty();
+
+  llvm::Value *N = dividend.getValue();
+  // high half of the signed product with the magic number, plus the implied
+  // 2^64 * n
+  llvm::Value *Q = B.CreateAdd(
+      B.CreateTrunc(
+          B.CreateLShr(B.CreateMul(B.CreateSExt(magic_.getValue(), I128),
+                                   B.CreateSExt(N, I128)),
+                       64),
+          I64),
+      N);
+  // the shift rounds towards -inf, fix up negative quotients
+  Q = B.CreateAdd(Q, B.CreateAnd(B.CreateAShr(Q, 63), roundUp_.getValue()));
+  Q = B.CreateAShr(Q, shift_.getValue());
+  llvm::Value *Sign = sign_.getValue();
+  return {B.CreateSub(B.CreateXor(Q, Sign), Sign), B};
+}
+
+Integer InvariantDivisor::remainder(const Integer &dividend) const {
+  return dividend - divide(dividend) * divisor_;
+}
+
 } // namespace MyDSL
@@ -219,5 +219,150 @@ public:
 
   Float toFloat() const;
   explicit operator Float() const;
+
+  friend class Int8;
+  friend class InvariantDivisor;
+};
+
+/**
+ * @brief An 8 bit signed integer, the element type of quantized tensors (see
+ * QTensor). Arithmetic wraps around, use toInteger() to compute without
+ * overflow.
+ */
+class Int8 : public BaseOps {
+public:
+  using NativeType = std::int8_t;
+
+private:
+  Int8 getConst(NativeType value) const {
+    return {builder_.getInt8(value), builder_};
+  }
+
+  /// Ref constructor.
+  Int8(llvm::Type *type, llvm::Value *value, llvm::IRBuilder<> &builder)
+      : BaseOps(type, value, builder) {}
+
+  template <class T> friend class Ref;
+
+public:
+  Int8(NativeType value, llvm::IRBuilder<> &builder)
+      : BaseOps(builder.getInt8(value), builder) {}
+  Int8(llvm::Value *value, llvm::IRBuilder<> &builder)
+      : BaseOps(value, builder) {
+    assert(value->getType()->isIntegerTy(8) && "Value must be an i8");
+  }
+
+  explicit Int8(const BaseOps &base) : BaseOps(base) {
+    assert(base.getType()->isIntegerTy(8) && "Value must be an i8");
+  }
+
+  /// Keeps the lowest 8 bits of \a value.
+  explicit Int8(const Integer &value)
+      : BaseOps(value.builder_.CreateTrunc(value.getValue(),
+                                           value.builder_.getInt8Ty()),
+                value.builder_) {}
+
+  /// Clamps \a value to the range of Int8.
+  static Int8 saturate(const Integer &value) {
+    auto &builder = value.builder_;
+    auto *Clamped = builder.CreateBinaryIntrinsic(
+        llvm::Intrinsic::smin,
+        builder.CreateBinaryIntrinsic(llvm::Intrinsic::smax, value.getValue(),
+                                      builder.getInt64(INT8_MIN)),
+        builder.getInt64(INT8_MAX));
+    return {builder.CreateTrunc(Clamped, builder.getInt8Ty()), builder};
+  }
+
+  static llvm::Type *getType(llvm::LLVMContext &Ctx) {
+    return llvm::IntegerType::get(Ctx, 8);
+  }
+
+  BaseOps &operator=(NativeType other) {
+    store(getConst(other));
+    return *this;
+  }
+
+  /// arithmetic operators
+  Int8 operator+(const Int8 &other) const {
+    return {builder_.CreateAdd(getValue(), other.getValue()), builder_};
+  }
+  Int8 operator-(const Int8 &other) const {
+    return {builder_.CreateSub(getValue(), other.getValue()), builder_};
+  }
+  Int8 operator*(const Int8 &other) const {
+    return {builder_.CreateMul(getValue(), other.getValue()), builder_};
+  }
+  Int8 operator-() const { return {builder_.CreateNeg(getValue()), builder_}; }
+
+  Int8 operator+(NativeType value) const { return *this + getConst(value); }
+  Int8 operator-(NativeType value) const { return *this - getConst(value); }
+  Int8 operator*(NativeType value) const { return *this * getConst(value); }
+
+  /// relational operators
+  Bool operator==(const Int8 &other) const {
+    return {builder_.CreateICmpEQ(getValue(), other.getValue()), builder_};
+  }
+  Bool operator!=(const Int8 &other) const {
+    return {builder_.CreateICmpNE(getValue(), other.getValue()), builder_};
+  }
+  Bool operator<(const Int8 &other) const {
+    return {builder_.CreateICmpSLT(getValue(), other.getValue()), builder_};
+  }
+  Bool operator<=(const Int8 &other) const {
+    return {builder_.CreateICmpSLE(getValue(), other.getValue()), builder_};
+  }
+  Bool operator>(const Int8 &other) const {
+    return {builder_.CreateICmpSGT(getValue(), other.getValue()), builder_};
+  }
+  Bool operator>=(const Int8 &other) const {
+    return {builder_.CreateICmpSGE(getValue(), other.getValue()), builder_};
+  }
+
+  /// Sign-extends to Integer.
+  Integer toInteger() const {
+    return {builder_.CreateSExt(getValue(), Integer::getType(
+                                                builder_.getContext())),
+            builder_};
+  }
+};
+
+/**
+ * @brief An Integer divisor that divides many dividends, e.g. the width in
+ * `row = i / width; col = i % width` inside a loop.
+ *
+ * The constructor computes the magic numbers of a multiply-shift division
+ * (the branchfree signed algorithm of libdivide) from the divisor, so
+ * construct it before the loop. A division by it is then a 64x64->128 bit
+ * multiplication, shifts and adds instead of an sdiv. The quotient is rounded
+ * towards zero like Integer::operator/, the divisor must not be 0.
+ */
+class InvariantDivisor {
+  Integer divisor_;
+  /// Low 64 bits of the 65 bit magic number (2^64 is implied), 0 if the
+  /// absolute divisor is a power of two.
+  Integer magic_;
+  /// floor(log2(|divisor|))
+  Integer shift_;
+  /// Added to negative intermediate quotients to round towards zero.
+  Integer roundUp_;
+  /// -1 if the divisor is negative, 0 otherwise.
+  Integer sign_;
+
+public:
+  explicit InvariantDivisor(const Integer &divisor);
+
+  const Integer &divisor() const { return divisor_; }
+
+  Integer divide(const Integer &dividend) const;
+  Integer remainder(const Integer &dividend) const;
+
+  friend Integer operator/(const Integer &dividend,
+                           const InvariantDivisor &divisor) {
+    return divisor.divide(dividend);
+  }
+  friend Integer operator%(const Integer &dividend,
+                           const InvariantDivisor &divisor) {
+    return divisor.remainder(dividend);
+  }
 };
 } // namespace MyDSL
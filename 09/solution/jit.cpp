@@ -1,6 +1,7 @@
 #include "jit.hpp"
 #include "passes/strip_nooptmd.hpp"
 
+#include <llvm/Analysis/TargetTransformInfo.h>
 #include <llvm/Bitcode/BitcodeReader.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Module.h>
@@ -44,6 +45,14 @@ llvm::Function *make_kernel_function(llvm::Module *M, llvm::Type *RetTy,
   return F;
 }
 
+unsigned getNativeVectorBits(Jit &JIT, const llvm::Function &F) {
+  llvm::ExitOnError ExitOnErr;
+  auto TM = ExitOnErr(JIT.getTargetMachine());
+  return TM->getTargetTransformInfo(F)
+      .getRegisterBitWidth(llvm::TargetTransformInfo::RGK_FixedWidthVector)
+      .getFixedValue();
+}
+
 void optimize(llvm::Module &M, Jit &JIT) {
   llvm::ExitOnError ExitOnErr;
   llvm::PipelineTuningOptions PTO;
@@ -18,6 +18,7 @@
 #include <llvm/ExecutionEngine/Orc/Shared/ExecutorSymbolDef.h>
 #include <llvm/ExecutionEngine/SectionMemoryManager.h>
 #include <llvm/IR/DataLayout.h>
+#include <llvm/IR/Function.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/Support/Error.h>
 #include <llvm/Target/TargetMachine.h>
@@ -146,6 +147,9 @@ llvm::Function *make_kernel_function(llvm::Module *M, llvm::Type *RetTy,
 // Optimize the module.
 void optimize(llvm::Module &M, Jit &JIT);
 
+// Get the width in bits of the fixed-width vector registers of the host.
+unsigned getNativeVectorBits(Jit &JIT, const llvm::Function &F);
+
 // Dump the module to a file.
 void dumpModule(llvm::Module &M, llvm::StringRef Filename);
 
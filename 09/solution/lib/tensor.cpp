@@ -1,19 +1,337 @@
+#include "../conv_algorithm.hpp"
+#include "../epilogue.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cmath>
 #include <concepts>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <utility>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+/// Tensor elements of the DSL types Half and BFloat16, as raw bits. The
+/// builtins convert them to float for computing and accumulating.
+struct f16 {
+  std::uint16_t bits;
+};
+struct bf16 {
+  std::uint16_t bits;
+};
+
+inline float to_float(float value) { return value; }
+
+inline float to_float(bf16 value) {
+  std::uint32_t bits = std::uint32_t{value.bits} << 16;
+  float result;
+  std::memcpy(&result, &bits, sizeof(result));
+  return result;
+}
+
+inline float to_float(f16 value) {
+  std::uint32_t sign = std::uint32_t{value.bits & 0x8000u} << 16;
+  std::uint32_t exponent = (value.bits >> 10) & 0x1F;
+  std::uint32_t mantissa = value.bits & 0x3FF;
+  std::uint32_t bits;
+  if (exponent == 0x1F) {
+    // infinity or NaN
+    bits = sign | 0x7F800000 | (mantissa << 13);
+  } else if (exponent != 0) {
+    bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  } else if (mantissa == 0) {
+    bits = sign;
+  } else {
+    // subnormal, normalize the mantissa
+    exponent = 113;
+    while (!(mantissa & 0x400)) {
+      mantissa <<= 1;
+      --exponent;
+    }
+    bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+  }
+  float result;
+  std::memcpy(&result, &bits, sizeof(result));
+  return result;
+}
+
+/// Converts a float to the element type T, rounding to nearest even.
+template <class T> T from_float(float value);
+
+template <> inline float from_float<float>(float value) { return value; }
+
+template <> inline bf16 from_float<bf16>(float value) {
+  std::uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  // on the bits, the builtins are compiled with -ffast-math
+  if ((bits & 0x7FFFFFFF) > 0x7F800000)
+    return {0x7FC0};
+  bits += 0x7FFF + ((bits >> 16) & 1);
+  return {static_cast<std::uint16_t>(bits >> 16)};
+}
+
+template <> inline f16 from_float<f16>(float value) {
+  std::uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  std::uint32_t sign = (bits >> 16) & 0x8000;
+  std::uint32_t magnitude = bits & 0x7FFFFFFF;
+  auto round = [](std::uint32_t mantissa, std::uint32_t shift) {
+    std::uint32_t result = mantissa >> shift;
+    std::uint32_t rest = mantissa & ((1u << shift) - 1);
+    std::uint32_t half = 1u << (shift - 1);
+    if (rest > half || (rest == half && (result & 1)))
+      ++result; // may carry into the exponent, which is still correct
+    return result;
+  };
+
+  std::uint32_t result;
+  if (magnitude >= 0x7F800000) // infinity or NaN
+    result = 0x7C00 | (magnitude > 0x7F800000 ? 0x200 : 0);
+  else if (magnitude >= 0x477FF000) // rounds to a value larger than 65504
+    result = 0x7C00;
+  else if (magnitude >= 0x38800000) // normal, rebias the exponent
+    result = round(magnitude - (112u << 23), 13);
+  else if (magnitude >= 0x33000000) // subnormal
+    result =
+        round((magnitude & 0x7FFFFF) | 0x800000, 126 - (magnitude >> 23));
+  else
+    result = 0;
+  return {static_cast<std::uint16_t>(sign | result)};
+}
+
+template <class T>
+inline void tensor_elementwise_mul(T *dest_tensor, T *tensor_a, T *tensor_b,
+                                   std::int64_t count) {
+  for (std::int64_t i = 0; i < count; i++) {
+    dest_tensor[i] =
+        from_float<T>(to_float(tensor_a[i]) * to_float(tensor_b[i]));
+  }
+}
+
 extern "C" void __mydsl_tensor_elementwise_mul_2_f32(float *dest_tensor,
                                                      float *tensor_a,
                                                      float *tensor_b,
-                                                     std::int64_t size) {
-  for (int i = 0; i < size * size; i++) {
-    dest_tensor[i] = tensor_a[i] * tensor_b[i];
+                                                     std::int64_t count) {
+  tensor_elementwise_mul(dest_tensor, tensor_a, tensor_b, count);
+}
+
+extern "C" void __mydsl_tensor_elementwise_mul_2_f16(f16 *dest_tensor,
+                                                     f16 *tensor_a,
+                                                     f16 *tensor_b,
+                                                     std::int64_t count) {
+  tensor_elementwise_mul(dest_tensor, tensor_a, tensor_b, count);
+}
+
+extern "C" void __mydsl_tensor_elementwise_mul_2_bf16(bf16 *dest_tensor,
+                                                      bf16 *tensor_a,
+                                                      bf16 *tensor_b,
+                                                      std::int64_t count) {
+  tensor_elementwise_mul(dest_tensor, tensor_a, tensor_b, count);
+}
+
+/// Rounds a float to the element type T and back, like storing and loading
+/// a result.
+template <class T> inline float round_to(float value) {
+  return to_float(from_float<T>(value));
+}
+
+/// Applies \p op to \p value, an element of channel \p channel (only used
+/// by Bias) of a tensor of element type T.
+template <class T>
+inline float apply_epilogue_op(const MyDSL::EpilogueOp &op, float value,
+                               std::int64_t channel) {
+  switch (op.kind) {
+  case MyDSL::EpilogueKind::Bias:
+    return value + to_float(static_cast<const T *>(op.bias)[channel]);
+  case MyDSL::EpilogueKind::Scale:
+    return value * op.a;
+  case MyDSL::EpilogueKind::ReLU:
+    return value < 0.f ? 0.f : value;
+  case MyDSL::EpilogueKind::Clamp:
+    return std::min(std::max(value, op.a), op.b);
   }
+  return value;
 }
 
-template <class T, class F>
-inline void tensor_conv(T *dest_tensor, F &&input_value, T *filter,
-                        std::int64_t size, std::int64_t window)
+// The post-ops of convolutions and products, in place or into dest. Each has
+// a variant that FuseTensorOpsPass folds into the output write of the
+// producer, see epilogue.
+
+template <class T>
+inline void tensor_elementwise_epilogue(T *dest_tensor, const T *tensor_a,
+                                        const MyDSL::EpilogueOp &op,
+                                        std::int64_t count) {
+  for (std::int64_t i = 0; i < count; ++i)
+    dest_tensor[i] =
+        from_float<T>(apply_epilogue_op<T>(op, to_float(tensor_a[i]), 0));
+}
+
+/// Adds bias[c] to the elements of channel c, see MyDSL::getEpilogueChannel.
+/// The padding channels of blocked layouts are copied.
+template <class T>
+inline void tensor_elementwise_bias(T *dest_tensor, const T *tensor_a,
+                                    const T *bias, std::int64_t count,
+                                    std::int64_t channels, std::int64_t inner,
+                                    std::int64_t block) {
+  // the runs of elements of one channel vectorize
+  const std::int64_t groups = (channels + block - 1) / block;
+  for (std::int64_t o = 0; o < count; o += groups * inner)
+    for (std::int64_t g = 0; g < groups; ++g)
+      for (std::int64_t p = 0; p < inner; p += block)
+        for (std::int64_t l = 0; l < block; ++l) {
+          const std::int64_t c = g * block + l;
+          const std::int64_t i = o + g * inner + p + l;
+          dest_tensor[i] =
+              c < channels ? from_float<T>(to_float(tensor_a[i]) +
+                                           to_float(bias[c]))
+                           : tensor_a[i];
+        }
+}
+
+#define TENSOR_ELEMENTWISE_EPILOGUE(RANK, SUFFIX, T)                           \
+  extern "C" void __mydsl_tensor_elementwise_bias_##RANK##_##SUFFIX(           \
+      T *dest_tensor, T *tensor_a, T *bias, std::int64_t count,                \
+      std::int64_t channels, std::int64_t inner, std::int64_t block) {         \
+    tensor_elementwise_bias(dest_tensor, tensor_a, bias, count, channels,      \
+                            inner, block);                                     \
+  }                                                                            \
+  extern "C" void __mydsl_tensor_elementwise_scale_##RANK##_##SUFFIX(          \
+      T *dest_tensor, T *tensor_a, float factor, std::int64_t count) {         \
+    tensor_elementwise_epilogue(                                               \
+        dest_tensor, tensor_a,                                                 \
+        MyDSL::EpilogueOp{MyDSL::EpilogueKind::Scale, factor}, count);         \
+  }                                                                            \
+  extern "C" void __mydsl_tensor_elementwise_relu_##RANK##_##SUFFIX(           \
+      T *dest_tensor, T *tensor_a, std::int64_t count) {                       \
+    tensor_elementwise_epilogue(dest_tensor, tensor_a,                         \
+                                MyDSL::EpilogueOp{MyDSL::EpilogueKind::ReLU},  \
+                                count);                                        \
+  }                                                                            \
+  extern "C" void __mydsl_tensor_elementwise_clamp_##RANK##_##SUFFIX(          \
+      T *dest_tensor, T *tensor_a, float lower, float upper,                   \
+      std::int64_t count) {                                                    \
+    tensor_elementwise_epilogue(                                               \
+        dest_tensor, tensor_a,                                                 \
+        MyDSL::EpilogueOp{MyDSL::EpilogueKind::Clamp, lower, upper}, count);   \
+  }
+
+#define TENSOR_ELEMENTWISE_EPILOGUES(SUFFIX, T)                                \
+  TENSOR_ELEMENTWISE_EPILOGUE(2, SUFFIX, T)                                    \
+  TENSOR_ELEMENTWISE_EPILOGUE(4, SUFFIX, T)
+
+TENSOR_ELEMENTWISE_EPILOGUES(f32, float)
+TENSOR_ELEMENTWISE_EPILOGUES(f16, f16)
+TENSOR_ELEMENTWISE_EPILOGUES(bf16, bf16)
+
+/// The post-ops of a fused builtin (see MyDSL::EpilogueOp), applied to every
+/// result before it is stored. Like the unfused operations, the result and
+/// every step are rounded to T.
+///
+/// The producer passes the flat index of each result and its channel, i.e.
+/// its index in dimension 1. Bias ops whose channels are numbered
+/// differently, e.g. of a reshaped result, compute the channel from the
+/// index.
+template <class T> class epilogue {
+  const MyDSL::EpilogueOp *ops_;
+  std::int64_t count_;
+  bool same_channels_ = true;
+
+public:
+  /// \p channels, \p inner and \p block describe the channels of the
+  /// producer, see MyDSL::getEpilogueChannel.
+  epilogue(const MyDSL::EpilogueOp *ops, std::int64_t count,
+           std::int64_t channels, std::int64_t inner, std::int64_t block = 1)
+      : ops_(ops), count_(count) {
+    for (std::int64_t k = 0; k < count; ++k)
+      if (ops[k].kind == MyDSL::EpilogueKind::Bias)
+        same_channels_ &= ops[k].channels == channels &&
+                          ops[k].inner == inner && ops[k].block == block;
+  }
+
+  float operator()(float value, std::int64_t index,
+                   std::int64_t channel) const {
+    value = round_to<T>(value);
+    for (std::int64_t k = 0; k < count_; ++k) {
+      const auto &op = ops_[k];
+      value = round_to<T>(apply_epilogue_op<T>(
+          op, value,
+          same_channels_ ? channel : MyDSL::getEpilogueChannel(op, index)));
+    }
+    return value;
+  }
+
+  /// Applies the post-ops in place to the vector \p values of the channels
+  /// [channel, channel + lanes) of one pixel, at the indices index + l *
+  /// step. Matches the scalar operator(), the lanes after \p lanes are
+  /// unspecified.
+  template <class V>
+  void operator()(V &values, std::int64_t lanes, std::int64_t index,
+                  std::int64_t step, std::int64_t channel) const {
+    if (!same_channels_) {
+      for (std::int64_t l = 0; l < lanes; ++l)
+        values[l] = (*this)(values[l], index + l * step, channel + l);
+      return;
+    }
+    auto round = [lanes](V &values) {
+      if constexpr (!std::is_same_v<T, float>)
+        for (std::int64_t l = 0; l < lanes; ++l)
+          values[l] = round_to<T>(values[l]);
+    };
+    round(values);
+    for (std::int64_t k = 0; k < count_; ++k) {
+      const auto &op = ops_[k];
+      switch (op.kind) {
+      case MyDSL::EpilogueKind::Bias: {
+        V bias = {};
+        for (std::int64_t l = 0; l < lanes; ++l)
+          bias[l] = to_float(static_cast<const T *>(op.bias)[channel + l]);
+        values += bias;
+        break;
+      }
+      case MyDSL::EpilogueKind::Scale:
+        values *= op.a;
+        break;
+      case MyDSL::EpilogueKind::ReLU:
+        values = values < 0.f ? V{} : values;
+        break;
+      case MyDSL::EpilogueKind::Clamp: {
+        const V lower = V{} + op.a;
+        const V upper = V{} + op.b;
+        values = values < lower ? lower : values;
+        values = upper < values ? upper : values;
+        break;
+      }
+      }
+      round(values);
+    }
+  }
+};
+
+/// The epilogue of the unfused builtins.
+struct no_epilogue {
+  float operator()(float value, std::int64_t, std::int64_t) const {
+    return value;
+  }
+  template <class V>
+  void operator()(V &, std::int64_t, std::int64_t, std::int64_t,
+                  std::int64_t) const {}
+};
+
+// The 2D convolutions compute the valid part of the correlation of a size x
+// size image with a window x window filter (window odd), reading the image
+// through input_value(index) as float. Every result is stored once, through
+// epilogue(value, index, column), which applies the post-ops of the fused
+// builtins.
+
+template <class T, class F, class E = no_epilogue>
+inline void tensor_conv_direct(T *dest_tensor, F &&input_value, T *filter,
+                               std::int64_t size, std::int64_t window,
+                               const E &epilogue = {})
   requires std::invocable<F, int>
 {
   // padding for filter
@@ -24,29 +342,983 @@ inline void tensor_conv(T *dest_tensor, F &&input_value, T *filter,
       for (std::int64_t u = 0; u < window; ++u) {
         for (std::int64_t v = 0; v < window; ++v) {
           auto idx = (i + u) * size + j + v;
-          acc += std::forward<F>(input_value)(idx) * filter[u * window + v];
+          acc += std::forward<F>(input_value)(idx) *
+                 to_float(filter[u * window + v]);
         }
       }
-      dest_tensor[i * (size - offset * 2) + j] = acc;
+      const std::int64_t index = i * (size - offset * 2) + j;
+      dest_tensor[index] = from_float<T>(epilogue(acc, index, j));
+    }
+  }
+}
+
+/// Copies the windows of one output row at a time into the columns of a
+/// matrix, one row per filter element, and multiplies the filter as a vector
+/// with it. The product accumulates whole rows, which vectorizes across the
+/// outputs.
+template <class T, class F, class E = no_epilogue>
+inline void tensor_conv_im2col(T *dest_tensor, F &&input_value, T *filter,
+                               std::int64_t size, std::int64_t window,
+                               const E &epilogue = {})
+  requires std::invocable<F, int>
+{
+  const std::int64_t out = size - window + 1;
+  const std::int64_t taps = window * window;
+  auto *columns = static_cast<float *>(std::malloc(taps * out * sizeof(float)));
+  auto *acc = static_cast<float *>(std::malloc(out * sizeof(float)));
+
+  for (std::int64_t i = 0; i < out; ++i) {
+    for (std::int64_t u = 0; u < window; ++u)
+      for (std::int64_t v = 0; v < window; ++v)
+        for (std::int64_t j = 0; j < out; ++j)
+          columns[(u * window + v) * out + j] =
+              std::forward<F>(input_value)((i + u) * size + j + v);
+
+    for (std::int64_t j = 0; j < out; ++j)
+      acc[j] = 0.f;
+    for (std::int64_t k = 0; k < taps; ++k) {
+      float weight = to_float(filter[k]);
+      for (std::int64_t j = 0; j < out; ++j)
+        acc[j] += weight * columns[k * out + j];
+    }
+    for (std::int64_t j = 0; j < out; ++j)
+      dest_tensor[i * out + j] =
+          from_float<T>(epilogue(acc[j], i * out + j, j));
+  }
+  std::free(columns);
+  std::free(acc);
+}
+
+/// Winograd F(2x2, 3x3) (Lavin and Gray): every 2x2 block of outputs is
+/// computed from a 4x4 block of the image as Y = A^T [(G g G^T) . (B^T d B)] A.
+/// An odd last row or column of outputs is computed directly.
+template <class T, class F, class E = no_epilogue>
+inline void tensor_conv_winograd(T *dest_tensor, F &&input_value, T *filter,
+                                 std::int64_t size,
+                                 [[maybe_unused]] std::int64_t window,
+                                 const E &epilogue = {})
+  requires std::invocable<F, int>
+{
+  assert(window == 3 && "Winograd F(2x2, 3x3) needs a 3x3 filter");
+  const std::int64_t out = size - 2;
+
+  // U = G g G^T, G = [1 0 0; .5 .5 .5; .5 -.5 .5; 0 0 1]
+  float g[3][3], gg[4][3], u[4][4];
+  for (int r = 0; r < 3; ++r)
+    for (int c = 0; c < 3; ++c)
+      g[r][c] = to_float(filter[r * 3 + c]);
+  for (int c = 0; c < 3; ++c) {
+    gg[0][c] = g[0][c];
+    gg[1][c] = .5f * (g[0][c] + g[1][c] + g[2][c]);
+    gg[2][c] = .5f * (g[0][c] - g[1][c] + g[2][c]);
+    gg[3][c] = g[2][c];
+  }
+  for (int r = 0; r < 4; ++r) {
+    u[r][0] = gg[r][0];
+    u[r][1] = .5f * (gg[r][0] + gg[r][1] + gg[r][2]);
+    u[r][2] = .5f * (gg[r][0] - gg[r][1] + gg[r][2]);
+    u[r][3] = gg[r][2];
+  }
+
+  auto direct = [&](std::int64_t i, std::int64_t j) {
+    float acc{0.f};
+    for (std::int64_t r = 0; r < 3; ++r)
+      for (std::int64_t c = 0; c < 3; ++c)
+        acc += std::forward<F>(input_value)((i + r) * size + j + c) * g[r][c];
+    dest_tensor[i * out + j] = from_float<T>(epilogue(acc, i * out + j, j));
+  };
+
+  for (std::int64_t i = 0; i + 1 < out; i += 2) {
+    for (std::int64_t j = 0; j + 1 < out; j += 2) {
+      float d[4][4], bd[4][4], m[4][4], am[2][4];
+      for (int r = 0; r < 4; ++r)
+        for (int c = 0; c < 4; ++c)
+          d[r][c] = std::forward<F>(input_value)((i + r) * size + j + c);
+      // B^T d, B^T = [1 0 -1 0; 0 1 1 0; 0 -1 1 0; 0 1 0 -1]
+      for (int c = 0; c < 4; ++c) {
+        bd[0][c] = d[0][c] - d[2][c];
+        bd[1][c] = d[1][c] + d[2][c];
+        bd[2][c] = d[2][c] - d[1][c];
+        bd[3][c] = d[1][c] - d[3][c];
+      }
+      // (B^T d B) . U
+      for (int r = 0; r < 4; ++r) {
+        m[r][0] = (bd[r][0] - bd[r][2]) * u[r][0];
+        m[r][1] = (bd[r][1] + bd[r][2]) * u[r][1];
+        m[r][2] = (bd[r][2] - bd[r][1]) * u[r][2];
+        m[r][3] = (bd[r][1] - bd[r][3]) * u[r][3];
+      }
+      // A^T m A, A^T = [1 1 1 0; 0 1 -1 -1]
+      for (int c = 0; c < 4; ++c) {
+        am[0][c] = m[0][c] + m[1][c] + m[2][c];
+        am[1][c] = m[1][c] - m[2][c] - m[3][c];
+      }
+      for (int r = 0; r < 2; ++r) {
+        const std::int64_t index = (i + r) * out + j;
+        dest_tensor[index] = from_float<T>(
+            epilogue(am[r][0] + am[r][1] + am[r][2], index, j));
+        dest_tensor[index + 1] = from_float<T>(
+            epilogue(am[r][1] - am[r][2] - am[r][3], index + 1, j + 1));
+      }
+    }
+    if (out % 2) {
+      direct(i, out - 1);
+      direct(i + 1, out - 1);
+    }
+  }
+  if (out % 2)
+    for (std::int64_t j = 0; j < out; ++j)
+      direct(out - 1, j);
+}
+
+struct complex_f32 {
+  float re, im;
+};
+
+/// In-place radix-2 FFT of the \p n (a power of two) points at \p data with
+/// the distance \p stride, inverse (unnormalized) if \p inverse.
+inline void fft(complex_f32 *data, std::int64_t n, std::int64_t stride,
+                bool inverse) {
+  for (std::int64_t i = 1, j = 0; i < n; ++i) {
+    std::int64_t bit = n >> 1;
+    for (; j & bit; bit >>= 1)
+      j ^= bit;
+    j ^= bit;
+    if (i < j)
+      std::swap(data[i * stride], data[j * stride]);
+  }
+  for (std::int64_t len = 2; len <= n; len <<= 1) {
+    float angle = (inverse ? 2.f : -2.f) * 3.14159265358979f / len;
+    complex_f32 step{std::cos(angle), std::sin(angle)};
+    for (std::int64_t i = 0; i < n; i += len) {
+      complex_f32 w{1.f, 0.f};
+      for (std::int64_t k = 0; k < len / 2; ++k) {
+        auto &a = data[(i + k) * stride];
+        auto &b = data[(i + k + len / 2) * stride];
+        complex_f32 t{b.re * w.re - b.im * w.im, b.re * w.im + b.im * w.re};
+        b = {a.re - t.re, a.im - t.im};
+        a = {a.re + t.re, a.im + t.im};
+        w = {w.re * step.re - w.im * step.im, w.re * step.im + w.im * step.re};
+      }
+    }
+  }
+}
+
+/// 2D FFT of an n x n row-major array, rows then columns.
+inline void fft_2d(complex_f32 *data, std::int64_t n, bool inverse) {
+  for (std::int64_t r = 0; r < n; ++r)
+    fft(data + r * n, n, 1, inverse);
+  for (std::int64_t c = 0; c < n; ++c)
+    fft(data + c, n, n, inverse);
+}
+
+/// The correlation is the inverse transform of X . conj(F), for image and
+/// filter zero-padded to a power of two. The valid outputs do not wrap
+/// around.
+template <class T, class F, class E = no_epilogue>
+inline void tensor_conv_fft(T *dest_tensor, F &&input_value, T *filter,
+                            std::int64_t size, std::int64_t window,
+                            const E &epilogue = {})
+  requires std::invocable<F, int>
+{
+  const std::int64_t out = size - window + 1;
+  std::int64_t n = 1;
+  while (n < size)
+    n <<= 1;
+
+  auto *image =
+      static_cast<complex_f32 *>(std::calloc(n * n, sizeof(complex_f32)));
+  auto *kernel =
+      static_cast<complex_f32 *>(std::calloc(n * n, sizeof(complex_f32)));
+  for (std::int64_t r = 0; r < size; ++r)
+    for (std::int64_t c = 0; c < size; ++c)
+      image[r * n + c].re = std::forward<F>(input_value)(r * size + c);
+  for (std::int64_t r = 0; r < window; ++r)
+    for (std::int64_t c = 0; c < window; ++c)
+      kernel[r * n + c].re = to_float(filter[r * window + c]);
+
+  fft_2d(image, n, false);
+  fft_2d(kernel, n, false);
+  for (std::int64_t k = 0; k < n * n; ++k) {
+    auto x = image[k], f = kernel[k];
+    image[k] = {x.re * f.re + x.im * f.im, x.im * f.re - x.re * f.im};
+  }
+  fft_2d(image, n, true);
+
+  const float scale = 1.f / static_cast<float>(n * n);
+  for (std::int64_t r = 0; r < out; ++r)
+    for (std::int64_t c = 0; c < out; ++c)
+      dest_tensor[r * out + c] = from_float<T>(
+          epilogue(image[r * n + c].re * scale, r * out + c, c));
+  std::free(image);
+  std::free(kernel);
+}
+
+/// Convolves with the outer product of the column factors[0, window) and the
+/// row factors[window, 2 window) of a separable filter (see
+/// MyDSL::factorSeparableFilter): a pass with the row over all rows of the
+/// image, then a pass with the column. Both passes accumulate whole rows,
+/// which vectorizes across the outputs.
+template <class T, class F, class E = no_epilogue>
+inline void tensor_conv_separable(T *dest_tensor, F &&input_value,
+                                  const float *factors, std::int64_t size,
+                                  std::int64_t window, const E &epilogue = {})
+  requires std::invocable<F, int>
+{
+  const std::int64_t out = size - window + 1;
+  auto *rows = static_cast<float *>(std::malloc(size * out * sizeof(float)));
+  auto *acc = static_cast<float *>(std::malloc(out * sizeof(float)));
+
+  for (std::int64_t r = 0; r < size; ++r) {
+    float *row = rows + r * out;
+    for (std::int64_t j = 0; j < out; ++j)
+      row[j] = 0.f;
+    for (std::int64_t v = 0; v < window; ++v) {
+      float weight = factors[window + v];
+      for (std::int64_t j = 0; j < out; ++j)
+        row[j] += weight * std::forward<F>(input_value)(r * size + j + v);
+    }
+  }
+
+  for (std::int64_t i = 0; i < out; ++i) {
+    for (std::int64_t j = 0; j < out; ++j)
+      acc[j] = 0.f;
+    for (std::int64_t u = 0; u < window; ++u) {
+      float weight = factors[u];
+      for (std::int64_t j = 0; j < out; ++j)
+        acc[j] += weight * rows[(i + u) * out + j];
     }
+    for (std::int64_t j = 0; j < out; ++j)
+      dest_tensor[i * out + j] =
+          from_float<T>(epilogue(acc[j], i * out + j, j));
+  }
+  std::free(rows);
+  std::free(acc);
+}
+
+/// Largest window for which the builtins check if the filter is separable.
+constexpr std::int64_t max_separable_window = 32;
+
+/// Dispatches to the algorithm that the cost model considers cheapest for the
+/// shape.
+template <class T, class F, class E = no_epilogue>
+inline void tensor_conv(T *dest_tensor, F &&input_value, T *filter,
+                        std::int64_t size, std::int64_t window,
+                        const E &epilogue = {})
+  requires std::invocable<F, int>
+{
+  // separable filters are detected on the fly, at O(window^2) this is cheap
+  // compared to the convolution
+  float factors[2 * max_separable_window];
+  bool separable = false;
+  if (window <= max_separable_window) {
+    float weights[max_separable_window * max_separable_window];
+    for (std::int64_t k = 0; k < window * window; ++k)
+      weights[k] = to_float(filter[k]);
+    separable = MyDSL::factorSeparableFilter(weights, window, factors);
+  }
+
+  switch (MyDSL::selectConvAlgorithm(size, window, separable)) {
+  case MyDSL::ConvAlgorithm::Direct:
+    return tensor_conv_direct(dest_tensor, std::forward<F>(input_value),
+                              filter, size, window, epilogue);
+  case MyDSL::ConvAlgorithm::Im2col:
+    return tensor_conv_im2col(dest_tensor, std::forward<F>(input_value),
+                              filter, size, window, epilogue);
+  case MyDSL::ConvAlgorithm::Winograd:
+    return tensor_conv_winograd(dest_tensor, std::forward<F>(input_value),
+                                filter, size, window, epilogue);
+  case MyDSL::ConvAlgorithm::FFT:
+    return tensor_conv_fft(dest_tensor, std::forward<F>(input_value), filter,
+                           size, window, epilogue);
+  case MyDSL::ConvAlgorithm::Separable:
+    return tensor_conv_separable(dest_tensor, std::forward<F>(input_value),
+                                 factors, size, window, epilogue);
   }
 }
 
-extern "C" void __mydsl_tensor_conv_2_f32(float *dest_tensor, float *tensor_a,
-                                          float *filter, std::int64_t size,
+/// The epilogue of the fused 2D convolutions, whose channels are the columns
+/// of the result.
+template <class T>
+inline epilogue<T> conv_epilogue(const MyDSL::EpilogueOp *ops,
+                                 std::int64_t count, std::int64_t size,
+                                 std::int64_t window) {
+  return {ops, count, size - window + 1, 1};
+}
+
+// Every builtin has a fused variant with post-ops, which takes the array of
+// MyDSL::EpilogueOp and its length after the arguments of the builtin, e.g.
+// `__mydsl_fused_tensor_conv_epilogue_2_f32`.
+
+#define TENSOR_CONV(SUFFIX, T)                                                 \
+  extern "C" void __mydsl_tensor_conv_2_##SUFFIX(                              \
+      T *dest_tensor, T *tensor_a, T *filter, std::int64_t size,               \
+      std::int64_t window) {                                                   \
+    tensor_conv(                                                               \
+        dest_tensor,                                                           \
+        [tensor_a](std::int64_t idx) { return to_float(tensor_a[idx]); },      \
+        filter, size, window);                                                 \
+  }                                                                            \
+  extern "C" void __mydsl_fused_tensor_conv_epilogue_2_##SUFFIX(               \
+      T *dest_tensor, T *tensor_a, T *filter, std::int64_t size,               \
+      std::int64_t window, const MyDSL::EpilogueOp *ops,                       \
+      std::int64_t count) {                                                    \
+    tensor_conv(                                                               \
+        dest_tensor,                                                           \
+        [tensor_a](std::int64_t idx) { return to_float(tensor_a[idx]); },      \
+        filter, size, window, conv_epilogue<T>(ops, count, size, window));     \
+  }
+
+TENSOR_CONV(f32, float)
+TENSOR_CONV(f16, f16)
+TENSOR_CONV(bf16, bf16)
+
+/// The convolution with a fixed algorithm, e.g.
+/// `__mydsl_tensor_conv_winograd_2_f32`, which Tensor::conv2d calls if it
+/// selects the algorithm at JIT time.
+#define TENSOR_CONV_ALGORITHM(ALGORITHM, SUFFIX, T)                            \
+  extern "C" void __mydsl_tensor_conv_##ALGORITHM##_2_##SUFFIX(                \
+      T *dest_tensor, T *tensor_a, T *filter, std::int64_t size,               \
+      std::int64_t window) {                                                   \
+    tensor_conv_##ALGORITHM(                                                   \
+        dest_tensor,                                                           \
+        [tensor_a](std::int64_t idx) { return to_float(tensor_a[idx]); },      \
+        filter, size, window);                                                 \
+  }                                                                            \
+  extern "C" void __mydsl_fused_tensor_conv_##ALGORITHM##_epilogue_2_##SUFFIX( \
+      T *dest_tensor, T *tensor_a, T *filter, std::int64_t size,               \
+      std::int64_t window, const MyDSL::EpilogueOp *ops,                       \
+      std::int64_t count) {                                                    \
+    tensor_conv_##ALGORITHM(                                                   \
+        dest_tensor,                                                           \
+        [tensor_a](std::int64_t idx) { return to_float(tensor_a[idx]); },      \
+        filter, size, window, conv_epilogue<T>(ops, count, size, window));     \
+  }
+
+#define TENSOR_CONV_ALGORITHMS(SUFFIX, T)                                      \
+  TENSOR_CONV_ALGORITHM(direct, SUFFIX, T)                                     \
+  TENSOR_CONV_ALGORITHM(im2col, SUFFIX, T)                                     \
+  TENSOR_CONV_ALGORITHM(winograd, SUFFIX, T)                                   \
+  TENSOR_CONV_ALGORITHM(fft, SUFFIX, T)
+
+TENSOR_CONV_ALGORITHMS(f32, float)
+TENSOR_CONV_ALGORITHMS(f16, f16)
+TENSOR_CONV_ALGORITHMS(bf16, bf16)
+
+/// The convolution with a separable filter, given by its factors instead of
+/// the filter. Tensor::conv2d factors constant filters at JIT time.
+#define TENSOR_CONV_SEPARABLE(SUFFIX, T)                                       \
+  extern "C" void __mydsl_tensor_conv_separable_2_##SUFFIX(                    \
+      T *dest_tensor, T *tensor_a, float *factors, std::int64_t size,          \
+      std::int64_t window) {                                                   \
+    tensor_conv_separable(                                                     \
+        dest_tensor,                                                           \
+        [tensor_a](std::int64_t idx) { return to_float(tensor_a[idx]); },      \
+        factors, size, window);                                                \
+  }                                                                            \
+  extern "C" void __mydsl_fused_tensor_conv_separable_epilogue_2_##SUFFIX(     \
+      T *dest_tensor, T *tensor_a, float *factors, std::int64_t size,          \
+      std::int64_t window, const MyDSL::EpilogueOp *ops,                       \
+      std::int64_t count) {                                                    \
+    tensor_conv_separable(                                                     \
+        dest_tensor,                                                           \
+        [tensor_a](std::int64_t idx) { return to_float(tensor_a[idx]); },      \
+        factors, size, window, conv_epilogue<T>(ops, count, size, window));    \
+  }
+
+TENSOR_CONV_SEPARABLE(f32, float)
+TENSOR_CONV_SEPARABLE(f16, f16)
+TENSOR_CONV_SEPARABLE(bf16, bf16)
+
+template <class T>
+inline void tensor_conv_strided(T *dest_tensor, std::int64_t dest_row_stride,
+                                std::int64_t dest_col_stride, T *tensor_a,
+                                std::int64_t a_row_stride,
+                                std::int64_t a_col_stride, T *filter,
+                                std::int64_t filter_row_stride,
+                                std::int64_t filter_col_stride,
+                                std::int64_t size, std::int64_t window) {
+  const std::int64_t offset = window / 2;
+  for (std::int64_t i = 0; i < size - offset * 2; i++) {
+    for (std::int64_t j = 0; j < size - offset * 2; j++) {
+      float acc{0.f};
+      for (std::int64_t u = 0; u < window; ++u) {
+        for (std::int64_t v = 0; v < window; ++v) {
+          auto a = tensor_a[(i + u) * a_row_stride + (j + v) * a_col_stride];
+          auto f = filter[u * filter_row_stride + v * filter_col_stride];
+          acc += to_float(a) * to_float(f);
+        }
+      }
+      dest_tensor[i * dest_row_stride + j * dest_col_stride] =
+          from_float<T>(acc);
+    }
+  }
+}
+
+/// Like __mydsl_tensor_conv_2_*, for tensor views with arbitrary strides
+/// (in elements) for rows and columns.
+#define TENSOR_CONV_STRIDED(SUFFIX, T)                                         \
+  extern "C" void __mydsl_tensor_conv_strided_2_##SUFFIX(                      \
+      T *dest_tensor, std::int64_t dest_row_stride,                            \
+      std::int64_t dest_col_stride, T *tensor_a, std::int64_t a_row_stride,    \
+      std::int64_t a_col_stride, T *filter, std::int64_t filter_row_stride,    \
+      std::int64_t filter_col_stride, std::int64_t size,                       \
+      std::int64_t window) {                                                   \
+    tensor_conv_strided(dest_tensor, dest_row_stride, dest_col_stride,         \
+                        tensor_a, a_row_stride, a_col_stride, filter,          \
+                        filter_row_stride, filter_col_stride, size, window);   \
+  }
+
+TENSOR_CONV_STRIDED(f32, float)
+TENSOR_CONV_STRIDED(f16, f16)
+TENSOR_CONV_STRIDED(bf16, bf16)
+
+// The convolutions of batches of multi-channel images compute
+// dest[n][o][y][x] as the sum of
+// input[n][c][y * stride_h + u * dilation_h - pad_top]
+//      [x * stride_w + v * dilation_w - pad_left] * filter[o][c][u][v]
+// over the input channels c and the window (u, v), with zeros outside the
+// input. Input and dest are stored in one of the layouts of
+// MyDSL::TensorLayout, the filter is OIHW.
+
+/// Offsets of the elements of a 4D tensor in \p layout, indexed as NCHW.
+template <MyDSL::TensorLayout layout> struct layout_offsets {
+  std::int64_t channels, height, width;
+
+  std::int64_t operator()(std::int64_t n, std::int64_t c, std::int64_t y,
+                          std::int64_t x) const {
+    constexpr std::int64_t block = MyDSL::getLayoutBlock(layout);
+    if constexpr (layout == MyDSL::TensorLayout::NCHW)
+      return ((n * channels + c) * height + y) * width + x;
+    else if constexpr (layout == MyDSL::TensorLayout::NHWC)
+      return ((n * height + y) * width + x) * channels + c;
+    else
+      return (((n * ((channels + block - 1) / block) + c / block) * height +
+               y) *
+                  width +
+              x) *
+                 block +
+             c % block;
+  }
+};
+
+/// Output channels per block of the convolutions in \p layout. The channels
+/// of a block are the lanes of one vector, 16 floats are one AVX-512 or two
+/// AVX2 registers. The blocked layouts use their own block size, so a block
+/// of outputs is one contiguous store.
+template <MyDSL::TensorLayout layout>
+constexpr std::int64_t conv_channel_block =
+    MyDSL::getLayoutBlock(layout) ? MyDSL::getLayoutBlock(layout) : 16;
+/// Output columns per register tile of \p lanes channels, like the rows of
+/// the GEMM micro-kernel. A tile has 96 accumulators, 6 AVX-512 or 12 AVX2
+/// registers.
+template <std::int64_t lanes>
+constexpr std::int64_t conv_column_block = 96 / lanes;
+
+template <std::int64_t lanes> struct channel_vector {
+  typedef float type __attribute__((vector_size(lanes * sizeof(float))));
+};
+
+/// Accumulates the products of the inputs of the output row \p y with the
+/// packed weights of one channel block into the tile of the columns
+/// [x, x + columns). Without \p checked, all inputs of the tile are inside
+/// the image and the tile is full.
+///
+/// The layouts that store the channels of a pixel next to each other loop
+/// over the channels inside the window, so consecutive loads are adjacent.
+template <bool checked, MyDSL::TensorLayout layout, class T, class V>
+inline void conv_tile(V *acc, const T *input, const V *weights,
+                      const layout_offsets<layout> &offsets, std::int64_t n,
+                      std::int64_t y, std::int64_t x, std::int64_t columns,
+                      std::int64_t kernel_h, std::int64_t kernel_w,
+                      std::int64_t stride_h, std::int64_t stride_w,
+                      std::int64_t dilation_h, std::int64_t dilation_w,
+                      std::int64_t pad_top, std::int64_t pad_left) {
+  constexpr std::int64_t columns_max =
+      conv_column_block<sizeof(V) / sizeof(float)>;
+  // adjacent pixels of a row are a fixed distance apart in all layouts
+  const std::int64_t pixel = offsets(0, 0, 0, 1) - offsets(0, 0, 0, 0);
+  auto accumulate = [&](std::int64_t c, std::int64_t u, std::int64_t iy,
+                        std::int64_t v) {
+    const T *row = input + offsets(n, c, iy, 0);
+    const V &w = weights[(c * kernel_h + u) * kernel_w + v];
+    std::int64_t ix = x * stride_w + v * dilation_w - pad_left;
+    for (std::int64_t t = 0; t < columns_max; ++t) {
+      std::int64_t i = ix + t * stride_w;
+      float value;
+      if constexpr (checked)
+        value = t < columns && i >= 0 && i < offsets.width
+                    ? to_float(row[i * pixel])
+                    : 0.f;
+      else
+        value = to_float(row[i * pixel]);
+      acc[t] += value * w;
+    }
+  };
+
+  for (std::int64_t u = 0; u < kernel_h; ++u) {
+    std::int64_t iy = y * stride_h + u * dilation_h - pad_top;
+    if (iy < 0 || iy >= offsets.height)
+      continue; // zero padding
+    if constexpr (layout == MyDSL::TensorLayout::NCHW) {
+      for (std::int64_t c = 0; c < offsets.channels; ++c)
+        for (std::int64_t v = 0; v < kernel_w; ++v)
+          accumulate(c, u, iy, v);
+    } else {
+      for (std::int64_t v = 0; v < kernel_w; ++v)
+        for (std::int64_t c = 0; c < offsets.channels; ++c)
+          accumulate(c, u, iy, v);
+    }
+  }
+}
+
+template <MyDSL::TensorLayout layout, class T, class E = no_epilogue>
+inline void
+tensor_conv_layout(T *dest_tensor, const T *tensor_a, const T *filter,
+                   std::int64_t batch, std::int64_t in_channels,
+                   std::int64_t height, std::int64_t width,
+                   std::int64_t out_channels, std::int64_t kernel_h,
+                   std::int64_t kernel_w, std::int64_t out_h,
+                   std::int64_t out_w, std::int64_t stride_h,
+                   std::int64_t stride_w, std::int64_t dilation_h,
+                   std::int64_t dilation_w, std::int64_t pad_top,
+                   std::int64_t pad_left, const E &epilogue = {}) {
+  constexpr std::int64_t lanes = conv_channel_block<layout>;
+  constexpr std::int64_t tile = conv_column_block<lanes>;
+  using V = typename channel_vector<lanes>::type;
+  const layout_offsets<layout> in{in_channels, height, width};
+  const layout_offsets<layout> out{out_channels, out_h, out_w};
+
+  // the weights of the channels of a block are packed into one vector per
+  // input channel and window element, zero for channels after the last one
+  const std::int64_t taps = in_channels * kernel_h * kernel_w;
+  const std::int64_t blocks = (out_channels + lanes - 1) / lanes;
+  auto *packed = static_cast<V *>(std::aligned_alloc(
+      sizeof(V), std::max<std::int64_t>(blocks * taps, 1) * sizeof(V)));
+  for (std::int64_t b = 0; b < blocks; ++b)
+    for (std::int64_t k = 0; k < taps; ++k)
+      for (std::int64_t l = 0; l < lanes; ++l) {
+        std::int64_t o = b * lanes + l;
+        packed[b * taps + k][l] =
+            o < out_channels ? to_float(filter[o * taps + k]) : 0.f;
+      }
+
+  // the columns of output tiles whose windows lie inside the image
+  const std::int64_t x_begin = (pad_left + stride_w - 1) / stride_w;
+  const std::int64_t x_end =
+      (width - 1 - (kernel_w - 1) * dilation_w + pad_left) / stride_w + 1;
+  // adjacent channels of a block, 1 unless the layout is NCHW
+  const std::int64_t channel = out(0, 1, 0, 0) - out(0, 0, 0, 0);
+
+  for (std::int64_t n = 0; n < batch; ++n) {
+    for (std::int64_t b = 0; b < blocks; ++b) {
+      const V *weights = packed + b * taps;
+      const std::int64_t channels = std::min(lanes, out_channels - b * lanes);
+      for (std::int64_t y = 0; y < out_h; ++y) {
+        for (std::int64_t x = 0; x < out_w; x += tile) {
+          const std::int64_t columns = std::min(tile, out_w - x);
+          V acc[tile] = {};
+          if (columns == tile && x >= x_begin && x + tile <= x_end)
+            conv_tile<false>(acc, tensor_a, weights, in, n, y, x, columns,
+                             kernel_h, kernel_w, stride_h, stride_w,
+                             dilation_h, dilation_w, pad_top, pad_left);
+          else
+            conv_tile<true>(acc, tensor_a, weights, in, n, y, x, columns,
+                            kernel_h, kernel_w, stride_h, stride_w, dilation_h,
+                            dilation_w, pad_top, pad_left);
+
+          // each output element is written once
+          for (std::int64_t t = 0; t < columns; ++t) {
+            const std::int64_t pixel = out(n, b * lanes, y, x + t);
+            epilogue(acc[t], channels, pixel, channel, b * lanes);
+            for (std::int64_t l = 0; l < channels; ++l)
+              dest_tensor[pixel + l * channel] = from_float<T>(acc[t][l]);
+          }
+        }
+      }
+    }
+  }
+  std::free(packed);
+}
+
+/// The epilogue of the fused convolutions of 4D tensors in \p layout, see
+/// MyDSL::getEpilogueChannel.
+template <MyDSL::TensorLayout layout, class T>
+inline epilogue<T> layout_epilogue(const MyDSL::EpilogueOp *ops,
+                                   std::int64_t count, std::int64_t channels,
+                                   std::int64_t height, std::int64_t width) {
+  constexpr std::int64_t block = MyDSL::getLayoutBlock(layout);
+  if constexpr (layout == MyDSL::TensorLayout::NCHW)
+    return {ops, count, channels, height * width};
+  else if constexpr (layout == MyDSL::TensorLayout::NHWC)
+    return {ops, count, channels, 1};
+  else
+    return {ops, count, channels, height * width * block, block};
+}
+
+/// The convolution of 4D tensors in one layout with an OIHW filter, e.g.
+/// `__mydsl_tensor_conv_nhwc_4_f32`, see Tensor::conv2d.
+#define TENSOR_CONV_LAYOUT(NAME, LAYOUT, SUFFIX, T)                            \
+  extern "C" void __mydsl_tensor_conv_##NAME##_4_##SUFFIX(                     \
+      T *dest_tensor, T *tensor_a, T *filter, std::int64_t batch,              \
+      std::int64_t in_channels, std::int64_t height, std::int64_t width,       \
+      std::int64_t out_channels, std::int64_t kernel_h, std::int64_t kernel_w, \
+      std::int64_t out_h, std::int64_t out_w, std::int64_t stride_h,           \
+      std::int64_t stride_w, std::int64_t dilation_h,                          \
+      std::int64_t dilation_w, std::int64_t pad_top, std::int64_t pad_left) {  \
+    tensor_conv_layout<MyDSL::TensorLayout::LAYOUT>(                           \
+        dest_tensor, tensor_a, filter, batch, in_channels, height, width,      \
+        out_channels, kernel_h, kernel_w, out_h, out_w, stride_h, stride_w,    \
+        dilation_h, dilation_w, pad_top, pad_left);                            \
+  }                                                                            \
+  extern "C" void __mydsl_fused_tensor_conv_##NAME##_epilogue_4_##SUFFIX(      \
+      T *dest_tensor, T *tensor_a, T *filter, std::int64_t batch,              \
+      std::int64_t in_channels, std::int64_t height, std::int64_t width,       \
+      std::int64_t out_channels, std::int64_t kernel_h, std::int64_t kernel_w, \
+      std::int64_t out_h, std::int64_t out_w, std::int64_t stride_h,           \
+      std::int64_t stride_w, std::int64_t dilation_h,                          \
+      std::int64_t dilation_w, std::int64_t pad_top, std::int64_t pad_left,    \
+      const MyDSL::EpilogueOp *ops, std::int64_t count) {                      \
+    tensor_conv_layout<MyDSL::TensorLayout::LAYOUT>(                           \
+        dest_tensor, tensor_a, filter, batch, in_channels, height, width,      \
+        out_channels, kernel_h, kernel_w, out_h, out_w, stride_h, stride_w,    \
+        dilation_h, dilation_w, pad_top, pad_left,                             \
+        layout_epilogue<MyDSL::TensorLayout::LAYOUT, T>(                       \
+            ops, count, out_channels, out_h, out_w));                          \
+  }
+
+#define TENSOR_CONV_LAYOUTS(SUFFIX, T)                                         \
+  TENSOR_CONV_LAYOUT(nchw, NCHW, SUFFIX, T)                                    \
+  TENSOR_CONV_LAYOUT(nhwc, NHWC, SUFFIX, T)                                    \
+  TENSOR_CONV_LAYOUT(nchw8c, NCHW8c, SUFFIX, T)                                \
+  TENSOR_CONV_LAYOUT(nchw16c, NCHW16c, SUFFIX, T)
+
+TENSOR_CONV_LAYOUTS(f32, float)
+TENSOR_CONV_LAYOUTS(f16, f16)
+TENSOR_CONV_LAYOUTS(bf16, bf16)
+
+/// An element of the input of the fused elementwise and conv builtins, as
+/// float: the result of a chain of elementwise operations, which
+/// FuseTensorOpsPass generates from their semantics. \p operands holds the
+/// tensors and scalars of the chain.
+using elementwise_input = float(const void *operands, std::int64_t index);
+
+/// Reads the image of the convolution through the generated \p input. Once
+/// the builtin is inlined into the kernel, the call is a direct one and the
+/// chain is evaluated in the window loops.
+inline auto chain_input(elementwise_input *input, const void *operands) {
+  return [input, operands](std::int64_t idx) { return input(operands, idx); };
+}
+
+#define FUSED_TENSOR_ELEMENTWISE_CONV(SUFFIX, T)                               \
+  extern "C" void __mydsl_fused_tensor_elementwise_conv_2_##SUFFIX(            \
+      T *dest_tensor, elementwise_input *input, const void *operands,          \
+      T *filter, std::int64_t size, std::int64_t window) {                     \
+    tensor_conv(dest_tensor, chain_input(input, operands), filter, size,       \
+                window);                                                       \
+  }                                                                            \
+  extern "C" void __mydsl_fused_tensor_elementwise_conv_epilogue_2_##SUFFIX(   \
+      T *dest_tensor, elementwise_input *input, const void *operands,          \
+      T *filter, std::int64_t size, std::int64_t window,                       \
+      const MyDSL::EpilogueOp *ops, std::int64_t count) {                      \
+    tensor_conv(dest_tensor, chain_input(input, operands), filter, size,       \
+                window, conv_epilogue<T>(ops, count, size, window));           \
+  }
+
+FUSED_TENSOR_ELEMENTWISE_CONV(f32, float)
+FUSED_TENSOR_ELEMENTWISE_CONV(f16, f16)
+FUSED_TENSOR_ELEMENTWISE_CONV(bf16, bf16)
+
+#define FUSED_TENSOR_ELEMENTWISE_CONV_ALGORITHM(ALGORITHM, SUFFIX, T)          \
+  extern "C" void                                                              \
+      __mydsl_fused_tensor_elementwise_conv_##ALGORITHM##_2_##SUFFIX(          \
+          T *dest_tensor, elementwise_input *input, const void *operands,      \
+          T *filter, std::int64_t size, std::int64_t window) {                 \
+    tensor_conv_##ALGORITHM(dest_tensor, chain_input(input, operands), filter, \
+                            size, window);                                     \
+  }                                                                            \
+  extern "C" void                                                              \
+      __mydsl_fused_tensor_elementwise_conv_##ALGORITHM##_epilogue_2_##SUFFIX( \
+          T *dest_tensor, elementwise_input *input, const void *operands,      \
+          T *filter, std::int64_t size, std::int64_t window,                   \
+          const MyDSL::EpilogueOp *ops, std::int64_t count) {                  \
+    tensor_conv_##ALGORITHM(dest_tensor, chain_input(input, operands), filter, \
+                            size, window,                                      \
+                            conv_epilogue<T>(ops, count, size, window));       \
+  }
+
+#define FUSED_TENSOR_ELEMENTWISE_CONV_ALGORITHMS(SUFFIX, T)                    \
+  FUSED_TENSOR_ELEMENTWISE_CONV_ALGORITHM(direct, SUFFIX, T)                   \
+  FUSED_TENSOR_ELEMENTWISE_CONV_ALGORITHM(im2col, SUFFIX, T)                   \
+  FUSED_TENSOR_ELEMENTWISE_CONV_ALGORITHM(winograd, SUFFIX, T)                 \
+  FUSED_TENSOR_ELEMENTWISE_CONV_ALGORITHM(fft, SUFFIX, T)
+
+FUSED_TENSOR_ELEMENTWISE_CONV_ALGORITHMS(f32, float)
+FUSED_TENSOR_ELEMENTWISE_CONV_ALGORITHMS(f16, f16)
+FUSED_TENSOR_ELEMENTWISE_CONV_ALGORITHMS(bf16, bf16)
+
+#define FUSED_TENSOR_ELEMENTWISE_CONV_SEPARABLE(SUFFIX, T)                     \
+  extern "C" void __mydsl_fused_tensor_elementwise_conv_separable_2_##SUFFIX(  \
+      T *dest_tensor, elementwise_input *input, const void *operands,          \
+      float *factors, std::int64_t size, std::int64_t window) {                \
+    tensor_conv_separable(dest_tensor, chain_input(input, operands), factors,  \
+                          size, window);                                       \
+  }                                                                            \
+  extern "C" void                                                              \
+      __mydsl_fused_tensor_elementwise_conv_separable_epilogue_2_##SUFFIX(     \
+          T *dest_tensor, elementwise_input *input, const void *operands,      \
+          float *factors, std::int64_t size, std::int64_t window,              \
+          const MyDSL::EpilogueOp *ops, std::int64_t count) {                  \
+    tensor_conv_separable(dest_tensor, chain_input(input, operands), factors,  \
+                          size, window,                                        \
+                          conv_epilogue<T>(ops, count, size, window));         \
+  }
+
+FUSED_TENSOR_ELEMENTWISE_CONV_SEPARABLE(f32, float)
+FUSED_TENSOR_ELEMENTWISE_CONV_SEPARABLE(f16, f16)
+FUSED_TENSOR_ELEMENTWISE_CONV_SEPARABLE(bf16, bf16)
+
+/// Instruction set extensions for int8 dot products.
+enum class i8_isa : int { portable, avx2, avx_vnni, avx512_vnni };
+
+inline i8_isa detect_i8_isa() {
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE) ||
+      !(ecx & bit_AVX))
+    return i8_isa::portable;
+  // the OS has to save the ymm registers, and for AVX-512 the zmm and mask
+  // registers
+  unsigned xcr0, xcr0_high;
+  __asm__("xgetbv" : "=a"(xcr0), "=d"(xcr0_high) : "c"(0));
+  if ((xcr0 & 0x6) != 0x6)
+    return i8_isa::portable;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) || !(ebx & bit_AVX2))
+    return i8_isa::portable;
+  if ((ecx & bit_AVX512VNNI) && (ebx & bit_AVX512VL) &&
+      (xcr0 & 0xE6) == 0xE6)
+    return i8_isa::avx512_vnni;
+  if (__get_cpuid_count(7, 1, &eax, &ebx, &ecx, &edx) && (eax & bit_AVXVNNI))
+    return i8_isa::avx_vnni;
+  return i8_isa::avx2;
+#else
+  return i8_isa::portable;
+#endif
+}
+
+/// The extensions of the host, detected on first use.
+inline i8_isa host_i8_isa() {
+  // constant initialized, so there is no guard variable
+  static std::atomic<int> cached{-1};
+  int isa = cached.load(std::memory_order_relaxed);
+  if (isa < 0) {
+    isa = static_cast<int>(detect_i8_isa());
+    cached.store(isa, std::memory_order_relaxed);
+  }
+  return static_cast<i8_isa>(isa);
+}
+
+inline std::int32_t dot_i8_portable(const std::int8_t *a, const std::int8_t *b,
+                                    std::int64_t k) {
+  std::int32_t acc = 0;
+  for (std::int64_t i = 0; i < k; ++i)
+    acc += std::int32_t{a[i]} * std::int32_t{b[i]};
+  return acc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) inline std::int32_t hsum_i32(__m256i v) {
+  __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v),
+                              _mm256_extracti128_si256(v, 1));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4E));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xB1));
+  return _mm_cvtsi128_si32(sum);
+}
+
+/// pmaddubsw would saturate the sums of two u8 x s8 products to 16 bits, so
+/// both operands are sign-extended to 16 bits for pmaddwd instead, which
+/// sums pairs of products into 32 bit lanes exactly.
+__attribute__((target("avx2"))) std::int32_t
+dot_i8_avx2(const std::int8_t *a, const std::int8_t *b, std::int64_t k) {
+  __m256i acc = _mm256_setzero_si256();
+  std::int64_t i = 0;
+  for (; i + 16 <= k; i += 16) {
+    __m256i va = _mm256_cvtepi8_epi16(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i)));
+    __m256i vb = _mm256_cvtepi8_epi16(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i)));
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va, vb));
+  }
+  return hsum_i32(acc) + dot_i8_portable(a + i, b + i, k - i);
+}
+
+// vpdpbusd multiplies unsigned by signed bytes and sums groups of four
+// products into 32 bit lanes. a + 128 is unsigned, the excess 128 * b is
+// accumulated separately and subtracted at the end.
+
+__attribute__((target("avx2,avxvnni"))) std::int32_t
+dot_i8_avx_vnni(const std::int8_t *a, const std::int8_t *b, std::int64_t k) {
+  const __m256i bias = _mm256_set1_epi8(static_cast<char>(0x80));
+  __m256i acc = _mm256_setzero_si256();
+  __m256i excess = _mm256_setzero_si256();
+  std::int64_t i = 0;
+  for (; i + 32 <= k; i += 32) {
+    __m256i va = _mm256_xor_si256(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i)), bias);
+    __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i));
+    acc = _mm256_dpbusd_avx_epi32(acc, va, vb);
+    excess = _mm256_dpbusd_avx_epi32(excess, bias, vb);
+  }
+  return hsum_i32(acc) - hsum_i32(excess) +
+         dot_i8_portable(a + i, b + i, k - i);
+}
+
+__attribute__((target("avx2,avx512vnni,avx512vl"))) std::int32_t
+dot_i8_avx512_vnni(const std::int8_t *a, const std::int8_t *b,
+                   std::int64_t k) {
+  const __m256i bias = _mm256_set1_epi8(static_cast<char>(0x80));
+  __m256i acc = _mm256_setzero_si256();
+  __m256i excess = _mm256_setzero_si256();
+  std::int64_t i = 0;
+  for (; i + 32 <= k; i += 32) {
+    __m256i va = _mm256_xor_si256(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i)), bias);
+    __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i));
+    acc = _mm256_dpbusd_epi32(acc, va, vb);
+    excess = _mm256_dpbusd_epi32(excess, bias, vb);
+  }
+  return hsum_i32(acc) - hsum_i32(excess) +
+         dot_i8_portable(a + i, b + i, k - i);
+}
+#endif
+
+/// Computes the dot product of two int8 vectors of length k exactly, with
+/// the best instructions of the host.
+inline std::int32_t dot_i8(const std::int8_t *a, const std::int8_t *b,
+                           std::int64_t k) {
+#if defined(__x86_64__) || defined(__i386__)
+  switch (host_i8_isa()) {
+  case i8_isa::avx512_vnni:
+    return dot_i8_avx512_vnni(a, b, k);
+  case i8_isa::avx_vnni:
+    return dot_i8_avx_vnni(a, b, k);
+  case i8_isa::avx2:
+    return dot_i8_avx2(a, b, k);
+  case i8_isa::portable:
+    break;
+  }
+#endif
+  return dot_i8_portable(a, b, k);
+}
+
+inline std::int32_t sum_i8(const std::int8_t *a, std::int64_t k) {
+  std::int32_t sum = 0;
+  for (std::int64_t i = 0; i < k; ++i)
+    sum += a[i];
+  return sum;
+}
+
+/// Computes dest = scale * (A - a_zero)(B - b_zero) for the int8 (m x k)
+/// matrix A and (k x n) matrix B, with int32 accumulators. The zero points
+/// are applied to the sums:
+/// sum((a - za)(b - zb)) = sum(ab) - zb sum(a) - za sum(b) + k za zb.
+template <class E = no_epilogue>
+inline void qtensor_mmul(float *dest_tensor, const std::int8_t *tensor_a,
+                         std::int32_t a_zero, const std::int8_t *tensor_b,
+                         std::int32_t b_zero, float scale, std::int64_t m,
+                         std::int64_t k, std::int64_t n,
+                         const E &epilogue = {}) {
+  // the columns of B are packed into rows, so every element of the product
+  // is the dot product of two contiguous vectors
+  auto *b_sums =
+      static_cast<std::int32_t *>(std::malloc(n * (sizeof(std::int32_t) + k)));
+  auto *packed_b = reinterpret_cast<std::int8_t *>(b_sums + n);
+  for (std::int64_t j = 0; j < n; ++j) {
+    for (std::int64_t l = 0; l < k; ++l)
+      packed_b[j * k + l] = tensor_b[l * n + j];
+    b_sums[j] = sum_i8(packed_b + j * k, k);
+  }
+
+  const std::int32_t zero_product =
+      static_cast<std::int32_t>(k) * a_zero * b_zero;
+  for (std::int64_t i = 0; i < m; ++i) {
+    const std::int8_t *row = tensor_a + i * k;
+    const std::int32_t a_sum = sum_i8(row, k);
+    for (std::int64_t j = 0; j < n; ++j) {
+      std::int32_t acc = dot_i8(row, packed_b + j * k, k) - b_zero * a_sum -
+                         a_zero * b_sums[j] + zero_product;
+      dest_tensor[i * n + j] =
+          epilogue(scale * static_cast<float>(acc), i * n + j, j);
+    }
+  }
+  std::free(b_sums);
+}
+
+extern "C" void __mydsl_qtensor_mmul_2_i8(float *dest_tensor,
+                                          const std::int8_t *tensor_a,
+                                          std::int32_t a_zero,
+                                          const std::int8_t *tensor_b,
+                                          std::int32_t b_zero, float scale,
+                                          std::int64_t m, std::int64_t k,
+                                          std::int64_t n) {
+  qtensor_mmul(dest_tensor, tensor_a, a_zero, tensor_b, b_zero, scale, m, k,
+               n);
+}
+
+/// The post-ops are numbered by the columns of the product.
+extern "C" void __mydsl_fused_qtensor_mmul_epilogue_2_i8(
+    float *dest_tensor, const std::int8_t *tensor_a, std::int32_t a_zero,
+    const std::int8_t *tensor_b, std::int32_t b_zero, float scale,
+    std::int64_t m, std::int64_t k, std::int64_t n,
+    const MyDSL::EpilogueOp *ops, std::int64_t count) {
+  qtensor_mmul(dest_tensor, tensor_a, a_zero, tensor_b, b_zero, scale, m, k,
+               n, epilogue<float>(ops, count, n, 1));
+}
+
+/// Quantized version of __mydsl_tensor_conv_2_f32: convolves the int8 tensor
+/// with the int8 filter in int32 and stores the sums multiplied by scale.
+template <class E = no_epilogue>
+inline void qtensor_conv(float *dest_tensor, const std::int8_t *tensor_a,
+                         std::int32_t a_zero, const std::int8_t *filter,
+                         std::int32_t filter_zero, float scale,
+                         std::int64_t size, std::int64_t window,
+                         const E &epilogue = {}) {
+  const std::int64_t offset = window / 2;
+  const std::int32_t filter_sum = sum_i8(filter, window * window);
+  const std::int32_t zero_product =
+      static_cast<std::int32_t>(window * window) * a_zero * filter_zero;
+  for (std::int64_t i = 0; i < size - offset * 2; i++) {
+    for (std::int64_t j = 0; j < size - offset * 2; j++) {
+      std::int32_t acc = 0;
+      std::int32_t a_sum = 0;
+      for (std::int64_t u = 0; u < window; ++u) {
+        const std::int8_t *row = tensor_a + (i + u) * size + j;
+        acc += dot_i8(row, filter + u * window, window);
+        a_sum += sum_i8(row, window);
+      }
+      acc += zero_product - filter_zero * a_sum - a_zero * filter_sum;
+      const std::int64_t index = i * (size - offset * 2) + j;
+      dest_tensor[index] = epilogue(scale * static_cast<float>(acc), index, j);
+    }
+  }
+}
+
+extern "C" void __mydsl_qtensor_conv_2_i8(float *dest_tensor,
+                                          const std::int8_t *tensor_a,
+                                          std::int32_t a_zero,
+                                          const std::int8_t *filter,
+                                          std::int32_t filter_zero,
+                                          float scale, std::int64_t size,
                                           std::int64_t window) {
-  tensor_conv(
-      dest_tensor, [tensor_a](std::int64_t idx) { return tensor_a[idx]; },
-      filter, size, window);
-}
-
-extern "C" void __mydsl_fused_tensor_elementwise_mul_conv_2_f32(
-    float *dest_tensor, float *tensor_a, float *tensor_b, float *filter,
-    std::int64_t size, std::int64_t window) {
-  tensor_conv(
-      dest_tensor,
-      [tensor_a, tensor_b](std::int64_t idx) {
-        return tensor_a[idx] * tensor_b[idx];
-      },
-      filter, size, window);
+  qtensor_conv(dest_tensor, tensor_a, a_zero, filter, filter_zero, scale,
+               size, window);
+}
+
+extern "C" void __mydsl_fused_qtensor_conv_epilogue_2_i8(
+    float *dest_tensor, const std::int8_t *tensor_a, std::int32_t a_zero,
+    const std::int8_t *filter, std::int32_t filter_zero, float scale,
+    std::int64_t size, std::int64_t window, const MyDSL::EpilogueOp *ops,
+    std::int64_t count) {
+  qtensor_conv(dest_tensor, tensor_a, a_zero, filter, filter_zero, scale,
+               size, window, conv_epilogue<float>(ops, count, size, window));
 }
@@ -3,6 +3,7 @@
 #include "int_ops.hpp"
 #include "jit.hpp"
 #include "passes/fuse_ops.hpp"
+#include "passes/plan_memory.hpp"
 #include "tensor_ops.hpp"
 
 #include <algorithm>
@@ -30,18 +31,9 @@ void kernel(llvm::Value *Result, llvm::Value *Tensor1, llvm::Value *Tensor2,
                                          s - (windowsize - 1)};
   Tensor<Float, 2> Tres{res_size, Result, Builder};
 
-  llvm::SmallVector<Integer, 2> window{windowsize, windowsize};
-  Tensor<Float, 2> filter{window, Builder};
-
-  filter[0][0] = 1.f;
-  filter[0][1] = 0.f;
-  filter[0][2] = -1.f;
-  filter[1][0] = 2.f;
-  filter[1][1] = 0.f;
-  filter[1][2] = -2.f;
-  filter[2][0] = 1.f;
-  filter[2][1] = 0.f;
-  filter[2][2] = -1.f;
+  auto filter = Tensor<Float, 2>::fromConstant(
+      {1.f, 0.f, -1.f, 2.f, 0.f, -2.f, 1.f, 0.f, -1.f}, Extents<3, 3>{},
+      Builder);
 
   T *= T2;
 
@@ -63,6 +55,10 @@ int main(int argc, const char *argv[]) {
       {Tensor<Float, 2>::getType(Ctx), Tensor<Float, 2>::getType(Ctx),
        Tensor<Float, 2>::getType(Ctx), Integer::getType(Ctx)});
 
+  // elementwise tensor operations use the vector registers of the host
+  vectorizeTensorOps(*Kernel, getNativeVectorBits(JIT, *Kernel),
+                     TailPolicy::Masked);
+
   llvm::IRBuilder<> Builder(&Kernel->getEntryBlock());
 
   kernel(Kernel->getArg(0), Kernel->getArg(1), Kernel->getArg(2),
@@ -71,6 +67,8 @@ int main(int argc, const char *argv[]) {
 
   fuseOps(*M);
 
+  planTensorMemory(*M);
+
   linkBuiltinFunctions(*M);
 
   optimize(*M, JIT);
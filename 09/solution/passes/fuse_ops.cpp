@@ -1,30 +1,33 @@
 #include "fuse_ops.hpp"
 
+#include "../conv_algorithm.hpp"
+#include "../epilogue.hpp"
+
 #include <algorithm>
+#include <bit>
+#include <optional>
 #include <llvm/ADT/MapVector.h>
-#include <llvm/IR/Dominators.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/StringSwitch.h>
+#include <llvm/ADT/Twine.h>
 #include <llvm/IR/FMF.h>
+#include <llvm/IR/InstIterator.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Metadata.h>
 #include <llvm/Passes/PassBuilder.h>
+#include <llvm/Transforms/Utils/Mem2Reg.h>
 
 namespace {
-llvm::CallInst *isElementwiseOp(llvm::Value &V) {
-  if (auto *CI = llvm::dyn_cast<llvm::CallInst>(&V)) {
-    if (auto *F = CI->getCalledFunction()) {
-      if (F->getName().starts_with("__mydsl_tensor_elementwise"))
-        return CI;
-    }
-  }
-  return nullptr;
-}
-
+/// Matches the contiguous 2D convolutions, `__mydsl_tensor_conv_2_*` and the
+/// ones with a fixed algorithm, e.g. `__mydsl_tensor_conv_winograd_2_*`.
 llvm::CallInst *isConvolutionOp(llvm::Value &V) {
   if (auto *CI = llvm::dyn_cast<llvm::CallInst>(&V)) {
     if (auto *F = CI->getCalledFunction()) {
-      if (F->getName().starts_with("__mydsl_tensor_conv_2_f"))
+      if (F->getName().starts_with("__mydsl_tensor_conv_") &&
+          !F->getName().starts_with("__mydsl_tensor_conv_strided_") &&
+          F->getName().contains("_2_"))
         return CI;
     }
   }
@@ -41,81 +44,1101 @@ llvm::CallInst *isTensorOp(llvm::Value &V) {
   return nullptr;
 }
 
-std::string getFusedOpName(llvm::CallInst *Elem, llvm::CallInst *Conv) {
-  const auto offset = sizeof("__mydsl_tensor_") - 1;
-  const auto offset_end = sizeof("_2_f32") + offset - 1;
-  auto ElemName = Elem->getCalledFunction()->getName();
-  auto ConvName = Conv->getCalledFunction()->getName();
-  return ("__mydsl_fused_tensor_" +
-          ElemName.substr(offset, ElemName.size() - offset_end) + "_" +
-          ConvName.substr(offset, ConvName.size() - offset_end) + "_2_f32")
-      .str();
+/// Splits the name of a tensor builtin, e.g. `__mydsl_tensor_conv_2_f16`,
+/// into the operation `conv` and the suffix `_2_f16` of rank and element type.
+std::pair<llvm::StringRef, llvm::StringRef> splitOpName(llvm::StringRef Name) {
+  Name.consume_front("__mydsl_tensor_");
+  auto Pos = Name.rfind('_', Name.rfind('_'));
+  return {Name.take_front(Pos), Name.drop_front(Pos)};
+}
+
+/// The elementwise builtins, `__mydsl_tensor_elementwise_<op>_<rank>_<type>`,
+/// whose semantics the fused kernels are generated from.
+enum class ElementwiseKind { Mul, Bias, Scale, ReLU, Clamp };
+
+/**
+ * @brief A call of an elementwise builtin, which computes
+ * `Dest[i] = op(Src[i], Operands...)` for all elements of a dense tensor, see
+ * Tensor::callElementwiseBuiltin.
+ */
+struct ElementwiseOp {
+  llvm::CallInst *Call;
+  ElementwiseKind Kind;
+  /// Rank and element type, e.g. `_2_f16`.
+  llvm::StringRef Suffix;
+  llvm::Value *Dest, *Src;
+  /// The other factor of Mul, the bias and its channels of Bias (see
+  /// MyDSL::getEpilogueChannel), the factor of Scale, the bounds of Clamp.
+  llvm::SmallVector<llvm::Value *, 4> Operands;
+
+  /// Returns the number of elements, the argument after the operands.
+  llvm::Value *getCount() const {
+    return Call->getArgOperand(Kind == ElementwiseKind::ReLU    ? 2
+                               : Kind == ElementwiseKind::Clamp ? 4
+                                                                : 3);
+  }
+};
+
+std::optional<ElementwiseOp> getElementwiseOp(llvm::CallInst &CI) {
+  auto *F = CI.getCalledFunction();
+  if (!F)
+    return std::nullopt;
+  auto Name = F->getName();
+  if (!Name.consume_front("__mydsl_tensor_elementwise_"))
+    return std::nullopt;
+  auto Pos = Name.find('_');
+  auto Kind = llvm::StringSwitch<std::optional<ElementwiseKind>>(
+                  Name.take_front(Pos))
+                  .Case("mul", ElementwiseKind::Mul)
+                  .Case("bias", ElementwiseKind::Bias)
+                  .Case("scale", ElementwiseKind::Scale)
+                  .Case("relu", ElementwiseKind::ReLU)
+                  .Case("clamp", ElementwiseKind::Clamp)
+                  .Default(std::nullopt);
+  if (!Kind)
+    return std::nullopt;
+
+  ElementwiseOp Op{&CI, *Kind, Name.drop_front(Pos), CI.getArgOperand(0),
+                   CI.getArgOperand(1), {}};
+  // the arguments of the builtins, see Tensor::callElementwiseBuiltin
+  switch (*Kind) {
+  case ElementwiseKind::Mul:
+  case ElementwiseKind::Scale:
+    Op.Operands.push_back(CI.getArgOperand(2));
+    break;
+  case ElementwiseKind::Bias:
+    for (unsigned Arg : {2, 4, 5, 6})
+      Op.Operands.push_back(CI.getArgOperand(Arg));
+    break;
+  case ElementwiseKind::ReLU:
+    break;
+  case ElementwiseKind::Clamp:
+    Op.Operands.push_back(CI.getArgOperand(2));
+    Op.Operands.push_back(CI.getArgOperand(3));
+    break;
+  }
+  return Op;
+}
+
+/// Returns true if \p A and \p B compute the same value, e.g. the extents of
+/// one tensor multiplied twice, looking through \p Depth instructions.
+bool isSameValue(llvm::Value *A, llvm::Value *B, unsigned Depth = 4) {
+  if (A == B)
+    return true;
+  auto *IA = llvm::dyn_cast<llvm::Instruction>(A);
+  auto *IB = llvm::dyn_cast<llvm::Instruction>(B);
+  if (!IA || !IB || !Depth || llvm::isa<llvm::PHINode>(IA) ||
+      IA->mayReadOrWriteMemory() || !IA->isSameOperationAs(IB))
+    return false;
+  for (unsigned I = 0; I < IA->getNumOperands(); ++I)
+    if (!isSameValue(IA->getOperand(I), IB->getOperand(I), Depth - 1))
+      return false;
+  return true;
 }
 
-llvm::DenseMap<llvm::CallInst *, llvm::CallInst *>
-getFusableTensorOps(llvm::Function &F, llvm::DominatorTree &DT) {
-  llvm::DenseMap<llvm::CallInst *, llvm::CallInst *> FuseMap;
+/**
+ * @brief Elementwise ops that follow each other in a block, the first one
+ * computes Dest from Src, the others compute in place on Dest. Only
+ * instructions that access neither memory nor Dest are between them.
+ *
+ * A generated kernel computes the whole chain in a single pass: it reads Src
+ * and the operands once and writes Dest once. Like the builtins, it rounds to
+ * the element type after every op, so the results are the same.
+ */
+struct ElementwiseChain {
+  llvm::SmallVector<ElementwiseOp, 4> Ops;
+
+  llvm::Value *getDest() const { return Ops.front().Dest; }
+  llvm::Value *getSrc() const { return Ops.front().Src; }
+  llvm::StringRef getSuffix() const { return Ops.front().Suffix; }
+
+  /// Returns the first Bias op. All Bias ops of a chain have the same
+  /// channels.
+  const ElementwiseOp *getBias() const {
+    auto It = llvm::find_if(Ops, [](const ElementwiseOp &Op) {
+      return Op.Kind == ElementwiseKind::Bias;
+    });
+    return It != Ops.end() ? &*It : nullptr;
+  }
+
+  /// Returns true if \p Op continues the chain.
+  bool isContinuedBy(const ElementwiseOp &Op) const {
+    auto *Dest = getDest();
+    if (Op.Src != Dest || Op.Dest != Dest || Op.Suffix != getSuffix())
+      return false;
+    // Dest holds the result of the previous op, not the one of the chain
+    if (llvm::is_contained(Op.Operands, Dest))
+      return false;
+    auto *Bias = getBias();
+    if (Op.Kind != ElementwiseKind::Bias || !Bias)
+      return true;
+    for (unsigned I = 1; I < 4; ++I)
+      if (!isSameValue(Op.Operands[I], Bias->Operands[I]))
+        return false;
+    return true;
+  }
+
+  /// Returns the name of a generated function, e.g.
+  /// `__mydsl_fused_tensor_elementwise_mul_relu_2_f32`.
+  std::string getName(llvm::StringRef Variant = "") const {
+    std::string Name = "__mydsl_fused_tensor_elementwise";
+    for (auto &Op : Ops) {
+      auto OpName = Op.Call->getCalledFunction()->getName();
+      OpName.consume_front("__mydsl_tensor_elementwise");
+      Name += OpName.drop_back(Op.Suffix.size());
+    }
+    return Name + Variant.str() + getSuffix().str();
+  }
+
+  /// Returns the arguments of the generated functions after Dest: Src, then
+  /// the operands of all ops.
+  llvm::SmallVector<llvm::Value *, 8> getOperands() const {
+    llvm::SmallVector<llvm::Value *, 8> Operands{getSrc()};
+    for (auto &Op : Ops)
+      Operands.append(Op.Operands.begin(), Op.Operands.end());
+    return Operands;
+  }
+};
+
+llvm::SmallVector<ElementwiseChain, 4> getElementwiseChains(llvm::Function &F) {
+  llvm::SmallVector<ElementwiseChain, 4> Chains;
   for (auto &BB : F) {
+    bool Open = false;
     for (auto &I : BB) {
-      if (auto *CI = isElementwiseOp(I)) {
-        for (auto &U : CI->getArgOperand(0)->uses()) {
-          if (auto Conv = isConvolutionOp(*U.getUser())) {
-            if (DT.dominates(CI, Conv) &&
-                std::find_if(
-                    CI->getArgOperand(0)->use_begin(),
-                    CI->getArgOperand(0)->use_end(), [&](llvm::Use &U) {
-                      return U.getUser() != CI && U.getUser() != Conv &&
-                             U.getOperandNo() == 0 && DT.dominates(CI, U) &&
-                             DT.dominates(U, Conv);
-                    }) == CI->getArgOperand(0)->use_end()) {
-              // should be done: assert the elem result is only used by conv
-              llvm::errs() << "Fusable tensor op: " << *CI << " with " << *Conv
-                           << "\n";
-              FuseMap[CI] = Conv;
-            }
-          }
-        }
+      auto *CI = llvm::dyn_cast<llvm::CallInst>(&I);
+      auto Op = CI ? getElementwiseOp(*CI) : std::nullopt;
+      if (Op && Open && Chains.back().isContinuedBy(*Op)) {
+        Chains.back().Ops.push_back(*Op);
+      } else if (Op) {
+        Chains.emplace_back().Ops.push_back(*Op);
+        Open = true;
+      } else if (Open && (I.mayReadOrWriteMemory() ||
+                          llvm::is_contained(I.operands(),
+                                             Chains.back().getDest()))) {
+        Open = false;
       }
     }
   }
-  return FuseMap;
+  return Chains;
+}
+
+/// Returns the type of the elements of the builtins with \p Suffix.
+llvm::Type *getElementType(llvm::LLVMContext &Ctx, llvm::StringRef Suffix) {
+  return llvm::StringSwitch<llvm::Type *>(Suffix.rsplit('_').second)
+      .Case("f16", llvm::Type::getHalfTy(Ctx))
+      .Case("bf16", llvm::Type::getBFloatTy(Ctx))
+      .Default(llvm::Type::getFloatTy(Ctx));
+}
+
+/// Extends elements, or vectors of them, to f32 like ReducedFloat does.
+llvm::Value *extendElements(llvm::IRBuilder<> &Builder, llvm::Value *Value) {
+  auto *Ty = Value->getType();
+  auto *FloatTy = Ty->getWithNewType(Builder.getFloatTy());
+  if (Ty->getScalarType()->isFloatTy())
+    return Value;
+  if (Ty->getScalarType()->isHalfTy())
+    return Builder.CreateFPExt(Value, FloatTy);
+  // bfloat is the upper half of an f32
+  auto *Bits = Builder.CreateZExt(
+      Builder.CreateBitCast(Value, Ty->getWithNewType(Builder.getInt16Ty())),
+      Ty->getWithNewType(Builder.getInt32Ty()));
+  return Builder.CreateBitCast(Builder.CreateShl(Bits, 16), FloatTy);
+}
+
+/// Rounds f32 values, or vectors of them, to \p ElementTy, to nearest even.
+/// bfloat is rounded on the bit pattern, see ReducedFloat.
+llvm::Value *roundElements(llvm::IRBuilder<> &Builder, llvm::Value *Value,
+                           llvm::Type *ElementTy) {
+  auto *Ty = Value->getType()->getWithNewType(ElementTy);
+  if (ElementTy->isFloatTy())
+    return Value;
+  if (ElementTy->isHalfTy())
+    return Builder.CreateFPTrunc(Value, Ty);
+  auto *I32 = Value->getType()->getWithNewType(Builder.getInt32Ty());
+  auto *Bits = Builder.CreateBitCast(Value, I32);
+  auto *Odd = Builder.CreateAnd(Builder.CreateLShr(Bits, 16), 1);
+  auto *Bias = Builder.CreateAdd(Odd, llvm::ConstantInt::get(I32, 0x7FFF));
+  auto *Rounded = Builder.CreateLShr(Builder.CreateAdd(Bits, Bias), 16);
+  // keep NaNs quiet NaNs, rounding could turn them into infinities
+  auto *Result =
+      Builder.CreateSelect(Builder.CreateFCmpUNO(Value, Value),
+                           llvm::ConstantInt::get(I32, 0x7FC0), Rounded);
+  return Builder.CreateBitCast(
+      Builder.CreateTrunc(Result, Ty->getWithNewType(Builder.getInt16Ty())),
+      Ty);
+}
+
+/**
+ * @brief The elements a generated function computes at once: \p Lanes
+ * consecutive elements from \p Index, only those in \p Mask if it is not
+ * null.
+ *
+ * \p Channel is the channel of the first element for Bias. The channels of
+ * the others follow it if \p Contiguous, otherwise they are the same.
+ */
+struct ElementwiseLanes {
+  llvm::Value *Index;
+  unsigned Lanes;
+  llvm::Value *Mask;
+  llvm::Value *Channel;
+  bool Contiguous;
+};
+
+/// Returns the type in which elements of \p ElementTy are loaded and stored.
+/// bfloat is moved as i16, not every target can select bfloat loads.
+llvm::Type *getStorageType(llvm::Type *ElementTy) {
+  if (ElementTy->isBFloatTy())
+    return llvm::Type::getInt16Ty(ElementTy->getContext());
+  return ElementTy;
+}
+
+/// Loads the elements of \p Where from \p Base.
+llvm::Value *loadElements(llvm::IRBuilder<> &Builder, llvm::Type *ElementTy,
+                          llvm::Value *Base, llvm::Value *Index,
+                          const ElementwiseLanes &Where,
+                          llvm::Value *Mask = nullptr) {
+  auto *StorageTy = getStorageType(ElementTy);
+  auto *Ptr = Builder.CreateInBoundsGEP(StorageTy, Base, Index);
+  if (Where.Lanes == 1)
+    return Builder.CreateBitCast(Builder.CreateLoad(StorageTy, Ptr),
+                                 ElementTy);
+  auto *VecTy = llvm::FixedVectorType::get(StorageTy, Where.Lanes);
+  llvm::Align Align(StorageTy->getPrimitiveSizeInBits() / 8);
+  if (!Mask)
+    Mask = Where.Mask;
+  // the masked lanes are not used
+  llvm::Value *Value;
+  if (Mask)
+    Value = Builder.CreateMaskedLoad(VecTy, Ptr, Align, Mask,
+                                     llvm::PoisonValue::get(VecTy));
+  else
+    Value = Builder.CreateAlignedLoad(VecTy, Ptr, Align);
+  return Builder.CreateBitCast(Value, VecTy->getWithNewType(ElementTy));
+}
+
+/// Rounds \p Value, the elements of \p Where as f32, to \p ElementTy and
+/// stores them to \p Base.
+void storeElements(llvm::IRBuilder<> &Builder, llvm::Type *ElementTy,
+                   llvm::Value *Value, llvm::Value *Base,
+                   const ElementwiseLanes &Where) {
+  auto *StorageTy = getStorageType(ElementTy);
+  auto *Result = Builder.CreateBitCast(
+      roundElements(Builder, Value, ElementTy),
+      Value->getType()->getWithNewType(StorageTy));
+  auto *Ptr = Builder.CreateInBoundsGEP(StorageTy, Base, Where.Index);
+  llvm::Align Align(StorageTy->getPrimitiveSizeInBits() / 8);
+  if (Where.Mask)
+    Builder.CreateMaskedStore(Result, Ptr, Align, Where.Mask);
+  else
+    Builder.CreateAlignedStore(Result, Ptr, Align);
+}
+
+/// Returns the vector `<0, 1, ..., Lanes - 1>` of i64.
+llvm::Constant *getLaneOffsets(llvm::LLVMContext &Ctx, unsigned Lanes) {
+  llvm::SmallVector<llvm::Constant *, 16> Offsets;
+  for (unsigned Lane = 0; Lane < Lanes; ++Lane)
+    Offsets.push_back(
+        llvm::ConstantInt::get(llvm::Type::getInt64Ty(Ctx), Lane));
+  return llvm::ConstantVector::get(Offsets);
+}
+
+/**
+ * @brief Emits the semantics of the builtin of \p Kind, see lib/tensor.cpp:
+ * applies it to \p Value, the elements of \p Where as f32, and rounds the
+ * result to \p ElementTy.
+ *
+ * @param Operands The values of ElementwiseOp::Operands in the generated
+ * function.
+ */
+llvm::Value *emitElementwiseOp(llvm::IRBuilder<> &Builder,
+                               ElementwiseKind Kind,
+                               llvm::ArrayRef<llvm::Value *> Operands,
+                               llvm::Type *ElementTy, llvm::Value *Value,
+                               const ElementwiseLanes &Where) {
+  auto Splat = [&](llvm::Value *Scalar) {
+    return Where.Lanes == 1 ? Scalar
+                            : Builder.CreateVectorSplat(Where.Lanes, Scalar);
+  };
+  auto *Zero = llvm::Constant::getNullValue(Value->getType());
+
+  llvm::Value *Result = nullptr;
+  switch (Kind) {
+  case ElementwiseKind::Mul:
+    Result = Builder.CreateFMul(
+        Value, extendElements(Builder, loadElements(Builder, ElementTy,
+                                                    Operands[0], Where.Index,
+                                                    Where)));
+    break;
+  case ElementwiseKind::Bias: {
+    // the elements of the padding channels of blocked layouts are kept
+    auto *Channels = Operands[1];
+    llvm::Value *Valid;
+    llvm::Value *Bias;
+    if (Where.Contiguous && Where.Lanes > 1) {
+      auto *Channel =
+          Builder.CreateAdd(Splat(Where.Channel),
+                            getLaneOffsets(Builder.getContext(), Where.Lanes));
+      Valid = Builder.CreateICmpSLT(Channel, Splat(Channels));
+      auto *Mask = Where.Mask ? Builder.CreateAnd(Where.Mask, Valid) : Valid;
+      Bias = loadElements(Builder, ElementTy, Operands[0], Where.Channel,
+                          Where, Mask);
+    } else {
+      Valid = Builder.CreateICmpSLT(Where.Channel, Channels);
+      auto *Channel =
+          Builder.CreateSelect(Valid, Where.Channel, Builder.getInt64(0));
+      Bias = Splat(loadElements(Builder, ElementTy, Operands[0], Channel,
+                                {Channel, 1, nullptr, nullptr, false}));
+      Valid = Splat(Valid);
+    }
+    Result = Builder.CreateSelect(
+        Valid, Builder.CreateFAdd(Value, extendElements(Builder, Bias)),
+        Value);
+    break;
+  }
+  case ElementwiseKind::Scale:
+    Result = Builder.CreateFMul(Value, Splat(Operands[0]));
+    break;
+  case ElementwiseKind::ReLU:
+    Result =
+        Builder.CreateSelect(Builder.CreateFCmpOLT(Value, Zero), Zero, Value);
+    break;
+  case ElementwiseKind::Clamp: {
+    auto *Lower = Splat(Operands[0]);
+    auto *Upper = Splat(Operands[1]);
+    Result = Builder.CreateSelect(Builder.CreateFCmpOLT(Value, Lower), Lower,
+                                  Value);
+    Result = Builder.CreateSelect(Builder.CreateFCmpOLT(Upper, Result), Upper,
+                                  Result);
+    break;
+  }
+  }
+  return extendElements(Builder, roundElements(Builder, Result, ElementTy));
+}
+
+/// Emits the result of \p Chain for the elements of \p Where, as f32.
+/// \p Operands are the values of ElementwiseChain::getOperands in the
+/// generated function.
+llvm::Value *emitChain(llvm::IRBuilder<> &Builder,
+                       const ElementwiseChain &Chain,
+                       llvm::ArrayRef<llvm::Value *> Operands,
+                       llvm::Type *ElementTy, const ElementwiseLanes &Where) {
+  auto *Value = extendElements(
+      Builder,
+      loadElements(Builder, ElementTy, Operands[0], Where.Index, Where));
+  Operands = Operands.drop_front();
+  for (auto &Op : Chain.Ops) {
+    Value = emitElementwiseOp(Builder, Op.Kind,
+                              Operands.take_front(Op.Operands.size()),
+                              ElementTy, Value, Where);
+    Operands = Operands.drop_front(Op.Operands.size());
+  }
+  return Value;
+}
+
+/// Emits `for (I = Begin; I < End; I += Step) Body(I)` at the insertion point
+/// of \p Builder, which is left behind the loop.
+void emitLoop(llvm::IRBuilder<> &Builder, llvm::Value *Begin, llvm::Value *End,
+              llvm::Value *Step,
+              llvm::function_ref<void(llvm::Value *)> Body) {
+  auto &Ctx = Builder.getContext();
+  auto *F = Builder.GetInsertBlock()->getParent();
+  auto *Preheader = Builder.GetInsertBlock();
+  auto *Loop = llvm::BasicBlock::Create(Ctx, "loop", F);
+  auto *Exit = llvm::BasicBlock::Create(Ctx, "loop.end", F);
+  Builder.CreateCondBr(Builder.CreateICmpSLT(Begin, End), Loop, Exit);
+
+  Builder.SetInsertPoint(Loop);
+  auto *I = Builder.CreatePHI(Begin->getType(), 2, "i");
+  I->addIncoming(Begin, Preheader);
+  Body(I);
+  auto *Next = Builder.CreateAdd(I, Step, "i.next", /*HasNUW=*/true,
+                                 /*HasNSW=*/true);
+  // the body may end in a new block
+  I->addIncoming(Next, Builder.GetInsertBlock());
+  Builder.CreateCondBr(Builder.CreateICmpSLT(Next, End), Loop, Exit);
+  Builder.SetInsertPoint(Exit);
+}
+
+/// Lanes of the generated kernels: the vector width given to
+/// vectorizeTensorOps in f32 lanes, or 8.
+unsigned getChainLanes(const llvm::Function &F) {
+  unsigned Bits = 256;
+  if (F.hasFnAttribute("mydsl-vector-bits"))
+    F.getFnAttribute("mydsl-vector-bits").getValueAsString().getAsInteger(10,
+                                                                          Bits);
+  return std::bit_floor(std::clamp(Bits / 32, 2u, 16u));
+}
+
+/**
+ * @brief Returns the kernel of \p Chain, `void(ptr Dest, i64 Count, ptr Src,
+ * operands...)`, generating it on first use. The operands are those of
+ * ElementwiseChain::getOperands after Src. Its name contains \p Lanes, e.g.
+ * `__mydsl_fused_tensor_elementwise_mul_relu_v8_2_f32`, kernels of functions
+ * with different vector widths are different.
+ *
+ * The kernel computes \p Lanes elements per vector, the last vector of a run
+ * is masked. Without Bias, the run is the whole tensor. With Bias, a run is
+ * a stretch whose channels either are the same (NCHW, a run per channel of
+ * H * W elements) or follow each other (the channels of a pixel of NHWC, the
+ * columns of a matrix row, the channel block of a pixel of blocked layouts),
+ * so the bias is either broadcast or loaded as a vector.
+ */
+llvm::Function *getChainKernel(llvm::Module &M, const ElementwiseChain &Chain,
+                               unsigned Lanes) {
+  auto Name = Chain.getName(("_v" + llvm::Twine(Lanes)).str());
+  if (auto *F = M.getFunction(Name))
+    return F;
+
+  auto &Ctx = M.getContext();
+  auto *I64 = llvm::Type::getInt64Ty(Ctx);
+  llvm::SmallVector<llvm::Type *, 12> ArgTys{
+      llvm::PointerType::getUnqual(Ctx), I64};
+  for (auto *Operand : Chain.getOperands())
+    ArgTys.push_back(Operand->getType());
+  auto *F = llvm::Function::Create(
+      llvm::FunctionType::get(llvm::Type::getVoidTy(Ctx), ArgTys, false),
+      llvm::GlobalValue::InternalLinkage, Name, M);
+  auto *ElementTy = getElementType(Ctx, Chain.getSuffix());
+  llvm::SmallVector<llvm::Value *, 8> Operands;
+  for (auto &Arg : llvm::drop_begin(F->args(), 2))
+    Operands.push_back(&Arg);
+  auto *Dest = F->getArg(0);
+  auto *Count = F->getArg(1);
+
+  llvm::IRBuilder<> Builder(llvm::BasicBlock::Create(Ctx, "entry", F));
+  auto *Step = Builder.getInt64(Lanes);
+
+  // computes [Begin, Begin + Length), whose first channel is Channel
+  auto EmitRun = [&](llvm::Value *Begin, llvm::Value *Length,
+                     llvm::Value *Channel, bool Contiguous) {
+    auto Store = [&](llvm::Value *Offset, llvm::Value *Mask) {
+      auto *Index = Builder.CreateAdd(Begin, Offset);
+      ElementwiseLanes Where{
+          Index, Lanes, Mask,
+          Channel && Contiguous ? Builder.CreateAdd(Channel, Offset) : Channel,
+          Contiguous};
+      storeElements(Builder, ElementTy,
+                    emitChain(Builder, Chain, Operands, ElementTy, Where),
+                    Dest, Where);
+    };
+    auto *MainEnd =
+        Builder.CreateSub(Length, Builder.CreateSRem(Length, Step));
+    emitLoop(Builder, Builder.getInt64(0), MainEnd, Step,
+             [&](llvm::Value *Offset) { Store(Offset, nullptr); });
+
+    auto *Tail = llvm::BasicBlock::Create(Ctx, "tail", F);
+    auto *Done = llvm::BasicBlock::Create(Ctx, "tail.end", F);
+    Builder.CreateCondBr(Builder.CreateICmpSLT(MainEnd, Length), Tail, Done);
+    Builder.SetInsertPoint(Tail);
+    auto *Mask = Builder.CreateICmpSLT(
+        Builder.CreateAdd(Builder.CreateVectorSplat(Lanes, MainEnd),
+                          getLaneOffsets(Ctx, Lanes)),
+        Builder.CreateVectorSplat(Lanes, Length));
+    Store(MainEnd, Mask);
+    Builder.CreateBr(Done);
+    Builder.SetInsertPoint(Done);
+  };
+
+  auto *Bias = Chain.getBias();
+  if (!Bias) {
+    EmitRun(Builder.getInt64(0), Count, nullptr, false);
+    Builder.CreateRetVoid();
+    return F;
+  }
+
+  // the channels of the element at Index, see MyDSL::getEpilogueChannel
+  auto It = Operands.begin() + 1;
+  for (auto &Op : Chain.Ops) {
+    if (&Op == Bias)
+      break;
+    It += Op.Operands.size();
+  }
+  auto *Channels = It[1];
+  auto *Inner = It[2];
+  auto *Block = It[3];
+  auto *One = Builder.getInt64(1);
+  auto *Groups = Builder.CreateSDiv(
+      Builder.CreateSub(Builder.CreateAdd(Channels, Block), One), Block);
+  auto *Blocked = Builder.CreateICmpSGT(Block, One);
+  auto *Run = Builder.CreateSelect(
+      Blocked, Block,
+      Builder.CreateSelect(Builder.CreateICmpSGT(Inner, One), Inner,
+                           Channels));
+
+  auto EmitRuns = [&](bool Contiguous) {
+    emitLoop(Builder, Builder.getInt64(0), Count, Run, [&](llvm::Value *Begin) {
+      auto *Channel = Builder.CreateMul(
+          Builder.CreateSRem(Builder.CreateSDiv(Begin, Inner), Groups), Block);
+      EmitRun(Begin, Run, Channel, Contiguous);
+    });
+  };
+  auto *Contiguous = llvm::BasicBlock::Create(Ctx, "contiguous", F);
+  auto *Broadcast = llvm::BasicBlock::Create(Ctx, "broadcast", F);
+  auto *Exit = llvm::BasicBlock::Create(Ctx, "exit", F);
+  Builder.CreateCondBr(
+      Builder.CreateOr(Blocked, Builder.CreateICmpEQ(Inner, One)), Contiguous,
+      Broadcast);
+  Builder.SetInsertPoint(Contiguous);
+  EmitRuns(true);
+  Builder.CreateBr(Exit);
+  Builder.SetInsertPoint(Broadcast);
+  EmitRuns(false);
+  Builder.CreateBr(Exit);
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateRetVoid();
+  return F;
+}
+
+/// Returns the struct of the operands of \p Chain that the fused elementwise
+/// and conv builtins pass to the input, see getChainInput.
+llvm::StructType *getChainOperandsType(const ElementwiseChain &Chain) {
+  llvm::SmallVector<llvm::Type *, 8> Types;
+  for (auto *Operand : Chain.getOperands())
+    Types.push_back(Operand->getType());
+  return llvm::StructType::get(Chain.getSrc()->getContext(), Types);
+}
+
+/// Emits the channel of the element at the flat \p Index for the Bias ops of
+/// \p Chain, see MyDSL::getEpilogueChannel, null without Bias. \p Operands
+/// are the values of ElementwiseChain::getOperands in the generated function.
+llvm::Value *emitChannel(llvm::IRBuilder<> &Builder,
+                         const ElementwiseChain &Chain,
+                         llvm::ArrayRef<llvm::Value *> Operands,
+                         llvm::Value *Index) {
+  auto *Bias = Chain.getBias();
+  if (!Bias)
+    return nullptr;
+  unsigned Field = 1;
+  for (auto &Op : Chain.Ops) {
+    if (&Op == Bias)
+      break;
+    Field += Op.Operands.size();
+  }
+  auto *Channels = Operands[Field + 1];
+  auto *Inner = Operands[Field + 2];
+  auto *Block = Operands[Field + 3];
+  auto *Groups = Builder.CreateSDiv(
+      Builder.CreateSub(Builder.CreateAdd(Channels, Block),
+                        Builder.getInt64(1)),
+      Block);
+  return Builder.CreateAdd(
+      Builder.CreateMul(
+          Builder.CreateSRem(Builder.CreateSDiv(Index, Inner), Groups), Block),
+      Builder.CreateSRem(Index, Block));
+}
+
+/**
+ * @brief Returns the input of the fused elementwise and conv builtins for
+ * \p Chain, `float(ptr Operands, i64 Index)`, generating it on first use. It
+ * returns the result of the chain at the flat \p Index as f32. Operands
+ * points to the struct of getChainOperandsType.
+ */
+llvm::Function *getChainInput(llvm::Module &M, const ElementwiseChain &Chain) {
+  auto Name = Chain.getName("_input");
+  if (auto *F = M.getFunction(Name))
+    return F;
+
+  auto &Ctx = M.getContext();
+  auto *I64 = llvm::Type::getInt64Ty(Ctx);
+  auto *F = llvm::Function::Create(
+      llvm::FunctionType::get(llvm::Type::getFloatTy(Ctx),
+                              {llvm::PointerType::getUnqual(Ctx), I64}, false),
+      llvm::GlobalValue::InternalLinkage, Name, M);
+  // it is called for every element of every window
+  F->addFnAttr(llvm::Attribute::AlwaysInline);
+
+  llvm::IRBuilder<> Builder(llvm::BasicBlock::Create(Ctx, "entry", F));
+  auto *OperandsTy = getChainOperandsType(Chain);
+  llvm::SmallVector<llvm::Value *, 8> Operands;
+  for (unsigned I = 0; I < OperandsTy->getNumElements(); ++I)
+    Operands.push_back(Builder.CreateLoad(
+        OperandsTy->getElementType(I),
+        Builder.CreateStructGEP(OperandsTy, F->getArg(0), I)));
+
+  auto *Index = F->getArg(1);
+  ElementwiseLanes Where{Index, 1, nullptr,
+                         emitChannel(Builder, Chain, Operands, Index), false};
+  Builder.CreateRet(emitChain(Builder, Chain, Operands,
+                              getElementType(Ctx, Chain.getSuffix()), Where));
+  return F;
+}
+
+/// Returns the convolution that reads the result of \p Chain next, if the
+/// result is not used otherwise. The chain can then be evaluated while the
+/// convolution reads its input.
+llvm::CallInst *getConvolutionOfChain(const ElementwiseChain &Chain) {
+  auto *Dest = Chain.getDest();
+  auto *Last = Chain.Ops.back().Call;
+  llvm::CallInst *Conv = nullptr;
+  for (auto &I : llvm::make_range(std::next(Last->getIterator()),
+                                  Last->getParent()->end())) {
+    if (I.mayReadOrWriteMemory() || llvm::is_contained(I.operands(), Dest)) {
+      Conv = isConvolutionOp(I);
+      break;
+    }
+  }
+  if (!Conv || Conv->getArgOperand(1) != Dest ||
+      Conv->getArgOperand(0) == Dest ||
+      splitOpName(Conv->getCalledFunction()->getName()).second !=
+          Chain.getSuffix())
+    return nullptr;
+  for (auto *User : Dest->users())
+    if (User != Conv && llvm::none_of(Chain.Ops, [&](const ElementwiseOp &Op) {
+          return Op.Call == User;
+        }))
+      return nullptr;
+  return Conv;
+}
+
+/**
+ * @brief Returns the weights of the filter of \p Conv, rounded to float, if
+ * \p Conv is a direct convolution with a constant (see Tensor::fromConstant)
+ * filter whose window is unrolled, see MyDSL::isUnrolledFilter.
+ */
+std::optional<llvm::SmallVector<float, 16>>
+getUnrolledFilter(llvm::CallInst &Conv) {
+  if (splitOpName(Conv.getCalledFunction()->getName()).first != "conv_direct")
+    return std::nullopt;
+  auto *GV = llvm::dyn_cast<llvm::GlobalVariable>(Conv.getArgOperand(2));
+  auto *Window = llvm::dyn_cast<llvm::ConstantInt>(Conv.getArgOperand(4));
+  if (!GV || !GV->isConstant() || !GV->hasDefinitiveInitializer() ||
+      !Window || Window->getSExtValue() < 1 || Window->getSExtValue() % 2 == 0)
+    return std::nullopt;
+
+  auto Extent = Window->getSExtValue();
+  llvm::SmallVector<float, 16> Weights;
+  for (std::int64_t K = 0; K < Extent * Extent; ++K) {
+    auto *C = llvm::dyn_cast_or_null<llvm::ConstantFP>(
+        GV->getInitializer()->getAggregateElement(K));
+    if (!C)
+      return std::nullopt;
+    llvm::APFloat Value = C->getValueAPF();
+    bool LosesInfo;
+    Value.convert(llvm::APFloat::IEEEsingle(),
+                  llvm::APFloat::rmNearestTiesToEven, &LosesInfo);
+    Weights.push_back(Value.convertToFloat());
+  }
+  llvm::SmallVector<float, 16> Factors(2 * Extent);
+  if (!MyDSL::isUnrolledFilter(
+          Weights.data(), Extent,
+          MyDSL::factorSeparableFilter(Weights.data(), Extent,
+                                       Factors.data())))
+    return std::nullopt;
+  return Weights;
+}
+
+/**
+ * @brief Generates `void(ptr Dest, i64 Size, ptr Src, operands...)`, the
+ * direct convolution of a Size x Size input with the constant \p Window x
+ * \p Window filter \p Weights, specialized to its values. The input is Src,
+ * or the result of \p Chain if it is not null, whose operands follow Src as
+ * in ElementwiseChain::getOperands.
+ *
+ * The window is unrolled with the weights as immediates, zero weights are
+ * skipped and weights of 1 and -1 become additions and subtractions. Like the
+ * builtins, it accumulates in f32 and rounds once. The outputs of a row are
+ * computed in vectors of \p Lanes columns, the last one of a row is masked.
+ */
+llvm::Function *getUnrolledConv(llvm::Module &M, llvm::StringRef Suffix,
+                                const ElementwiseChain *Chain,
+                                llvm::ArrayRef<float> Weights,
+                                std::int64_t Window, unsigned Lanes) {
+  auto &Ctx = M.getContext();
+  auto *I64 = llvm::Type::getInt64Ty(Ctx);
+  auto *PtrTy = llvm::PointerType::getUnqual(Ctx);
+  llvm::SmallVector<llvm::Type *, 12> ArgTys{PtrTy, I64};
+  if (Chain) {
+    for (auto *Operand : Chain->getOperands())
+      ArgTys.push_back(Operand->getType());
+  } else {
+    ArgTys.push_back(PtrTy);
+  }
+  // the weights are part of the function, every convolution gets its own
+  auto Name = Chain ? Chain->getName("_conv_unrolled")
+                    : ("__mydsl_unrolled_tensor_conv" + Suffix).str();
+  auto *F = llvm::Function::Create(
+      llvm::FunctionType::get(llvm::Type::getVoidTy(Ctx), ArgTys, false),
+      llvm::GlobalValue::InternalLinkage, Name, M);
+  auto *ElementTy = getElementType(Ctx, Suffix);
+  llvm::SmallVector<llvm::Value *, 8> Operands;
+  for (auto &Arg : llvm::drop_begin(F->args(), 2))
+    Operands.push_back(&Arg);
+  auto *Dest = F->getArg(0);
+  auto *Size = F->getArg(1);
+
+  llvm::IRBuilder<> Builder(llvm::BasicBlock::Create(Ctx, "entry", F));
+  auto *Out = Builder.CreateSub(Size, Builder.getInt64(Window - 1));
+  auto *Step = Builder.getInt64(Lanes);
+
+  // computes the outputs at (Row, Col) and the following Lanes - 1 columns
+  auto Store = [&](llvm::Value *Row, llvm::Value *Col, llvm::Value *Mask) {
+    llvm::Value *Acc = nullptr;
+    for (std::int64_t U = 0; U < Window; ++U) {
+      auto *Base = Builder.CreateAdd(
+          Builder.CreateMul(Builder.CreateAdd(Row, Builder.getInt64(U)), Size),
+          Col);
+      for (std::int64_t V = 0; V < Window; ++V) {
+        float Weight = Weights[U * Window + V];
+        if (Weight == 0.f)
+          continue;
+        auto *Index = Builder.CreateAdd(Base, Builder.getInt64(V));
+        ElementwiseLanes Where{Index, Lanes, Mask, nullptr, false};
+        llvm::Value *X;
+        if (Chain) {
+          Where.Channel = emitChannel(Builder, *Chain, Operands, Index);
+          X = emitChain(Builder, *Chain, Operands, ElementTy, Where);
+        } else {
+          X = extendElements(Builder, loadElements(Builder, ElementTy,
+                                                   Operands[0], Index, Where));
+        }
+        if (Weight == 1.f) {
+          Acc = Acc ? Builder.CreateFAdd(Acc, X) : X;
+        } else if (Weight == -1.f) {
+          Acc = Acc ? Builder.CreateFSub(Acc, X) : Builder.CreateFNeg(X);
+        } else {
+          auto *Product = Builder.CreateFMul(
+              X, llvm::ConstantFP::get(X->getType(), Weight));
+          Acc = Acc ? Builder.CreateFAdd(Acc, Product) : Product;
+        }
+      }
+    }
+    auto *AccTy = Builder.getFloatTy();
+    if (Lanes > 1)
+      AccTy = llvm::FixedVectorType::get(AccTy, Lanes);
+    if (!Acc)
+      Acc = llvm::Constant::getNullValue(AccTy);
+    ElementwiseLanes Where{
+        Builder.CreateAdd(Builder.CreateMul(Row, Out), Col), Lanes, Mask,
+        nullptr, false};
+    storeElements(Builder, ElementTy, Acc, Dest, Where);
+  };
+
+  emitLoop(Builder, Builder.getInt64(0), Out, Builder.getInt64(1),
+           [&](llvm::Value *Row) {
+             auto *MainEnd =
+                 Builder.CreateSub(Out, Builder.CreateSRem(Out, Step));
+             emitLoop(Builder, Builder.getInt64(0), MainEnd, Step,
+                      [&](llvm::Value *Col) { Store(Row, Col, nullptr); });
+             if (Lanes == 1)
+               return;
+
+             auto *Tail = llvm::BasicBlock::Create(Ctx, "tail", F);
+             auto *Done = llvm::BasicBlock::Create(Ctx, "tail.end", F);
+             Builder.CreateCondBr(Builder.CreateICmpSLT(MainEnd, Out), Tail,
+                                  Done);
+             Builder.SetInsertPoint(Tail);
+             auto *Mask = Builder.CreateICmpSLT(
+                 Builder.CreateAdd(Builder.CreateVectorSplat(Lanes, MainEnd),
+                                   getLaneOffsets(Ctx, Lanes)),
+                 Builder.CreateVectorSplat(Lanes, Out));
+             Store(Row, MainEnd, Mask);
+             Builder.CreateBr(Done);
+             Builder.SetInsertPoint(Done);
+           });
+  Builder.CreateRetVoid();
+  return F;
 }
 
-bool fuseElementwiseMulIntoConv(llvm::StringRef FusedOpName, llvm::CallInst *Op,
-                                llvm::CallInst *Conv) {
-  auto FusedOp = Op->getFunction()->getParent()->getOrInsertFunction(
-      FusedOpName, Conv->getType(), Conv->getArgOperand(0)->getType(),
-      Op->getArgOperand(1)->getType(), Op->getArgOperand(2)->getType(),
-      Conv->getArgOperand(2)->getType(), Conv->getArgOperand(3)->getType(),
-      Conv->getArgOperand(4)->getType());
+/// Replaces the direct convolution \p Conv with the constant filter
+/// \p Weights by a call of the generated getUnrolledConv, which reads its
+/// input through \p Chain if it is not null. The channels of the Bias ops
+/// differ between the lanes of a vector, chains with Bias compute one output
+/// at a time.
+bool unrollConv(llvm::CallInst *Conv, llvm::ArrayRef<float> Weights,
+                const ElementwiseChain *Chain = nullptr) {
+  auto &F = *Conv->getFunction();
+  auto Window =
+      llvm::cast<llvm::ConstantInt>(Conv->getArgOperand(4))->getSExtValue();
+  unsigned Lanes = Chain && Chain->getBias() ? 1 : getChainLanes(F);
+  auto *Kernel = getUnrolledConv(
+      *F.getParent(), splitOpName(Conv->getCalledFunction()->getName()).second,
+      Chain, Weights, Window, Lanes);
+  llvm::SmallVector<llvm::Value *, 12> Args{Conv->getArgOperand(0),
+                                            Conv->getArgOperand(3)};
+  if (Chain)
+    Args.append(Chain->getOperands());
+  else
+    Args.push_back(Conv->getArgOperand(1));
 
+  llvm::errs() << "Unrolling\n" << *Conv << " to\n" << Kernel->getName();
+  if (Chain)
+    llvm::errs() << " with " << Chain->Ops.size() << " elementwise ops";
+  llvm::errs() << "\n";
   llvm::IRBuilder<> Builder(Conv);
+  Builder.CreateCall(Kernel, Args);
+  Conv->eraseFromParent();
+  if (Chain)
+    for (auto &Op : Chain->Ops)
+      Op.Call->eraseFromParent();
+  return true;
+}
+
+bool unrollConstantFilters(llvm::Function &F) {
+  llvm::SmallVector<std::pair<llvm::CallInst *, llvm::SmallVector<float, 16>>,
+                    4>
+      Convs;
+  for (auto &I : llvm::instructions(F))
+    if (auto *Conv = isConvolutionOp(I))
+      if (auto Weights = getUnrolledFilter(*Conv))
+        Convs.emplace_back(Conv, std::move(*Weights));
+
+  bool Changed = false;
+  for (auto &[Conv, Weights] : Convs)
+    Changed |= unrollConv(Conv, Weights);
+  return Changed;
+}
+
+/// Replaces \p Chain and the convolution \p Conv of its result by the fused
+/// elementwise and conv builtin, e.g.
+/// `__mydsl_fused_tensor_elementwise_conv_winograd_2_f32`, which reads its
+/// input through the generated getChainInput. Unrolled convolutions read it
+/// through the chain as well, see getUnrolledConv.
+bool fuseChainIntoConv(const ElementwiseChain &Chain, llvm::CallInst *Conv) {
+  if (auto Weights = getUnrolledFilter(*Conv))
+    return unrollConv(Conv, *Weights, &Chain);
+
+  auto &F = *Conv->getFunction();
+  auto &M = *F.getParent();
+  auto *OperandsTy = getChainOperandsType(Chain);
+
+  llvm::IRBuilder<> Builder(&*F.getEntryBlock().getFirstInsertionPt());
+  auto *Operands =
+      Builder.CreateAlloca(OperandsTy, nullptr, "elementwise_operands");
+  Builder.SetInsertPoint(Conv);
+  auto Fields = Chain.getOperands();
+  for (unsigned I = 0; I < Fields.size(); ++I)
+    Builder.CreateStore(Fields[I],
+                        Builder.CreateStructGEP(OperandsTy, Operands, I));
+
+  auto [ConvOp, ConvSuffix] = splitOpName(Conv->getCalledFunction()->getName());
+  auto Name =
+      ("__mydsl_fused_tensor_elementwise_" + ConvOp + ConvSuffix).str();
+  auto *Input = getChainInput(M, Chain);
+  llvm::SmallVector<llvm::Value *, 6> Args{Conv->getArgOperand(0), Input,
+                                           Operands};
+  Args.append(Conv->arg_begin() + 2, Conv->arg_end());
+  llvm::SmallVector<llvm::Type *, 6> ArgTys;
+  for (auto *Arg : Args)
+    ArgTys.push_back(Arg->getType());
+  auto FusedOp = M.getOrInsertFunction(
+      Name, llvm::FunctionType::get(Conv->getType(), ArgTys, false));
+
+  llvm::errs() << "Fusing " << Chain.Ops.size() << " elementwise ops with\n"
+               << *Conv << " to\n"
+               << Name << " reading " << Input->getName() << "\n";
   auto NewCI = Builder.CreateCall(
-      FusedOp,
-      {Conv->getArgOperand(0), Op->getArgOperand(1), Op->getArgOperand(2),
-       Conv->getArgOperand(2), Conv->getArgOperand(3), Conv->getArgOperand(4)},
-      "", Conv->getMetadata(llvm::LLVMContext::MD_fpmath));
-  Op->eraseFromParent();
+      FusedOp, Args, "", Conv->getMetadata(llvm::LLVMContext::MD_fpmath));
   Conv->replaceAllUsesWith(NewCI);
   Conv->eraseFromParent();
+  for (auto &Op : Chain.Ops)
+    Op.Call->eraseFromParent();
+  return true;
+}
+
+bool fuseElementwiseOpsIntoConv(llvm::Function &F) {
+  bool Changed = false;
+  for (auto &Chain : getElementwiseChains(F))
+    if (auto *Conv = getConvolutionOfChain(Chain))
+      Changed |= fuseChainIntoConv(Chain, Conv);
+  return Changed;
+}
+
+/// Replaces the ops of \p Chain by a call of the generated getChainKernel, at
+/// the last of them.
+bool fuseChain(const ElementwiseChain &Chain) {
+  auto *Last = Chain.Ops.back().Call;
+  auto &F = *Last->getFunction();
+  llvm::IRBuilder<> Builder(Last);
+  llvm::SmallVector<llvm::Value *, 12> Args{
+      Chain.getDest(), Chain.Ops.front().getCount()};
+  Args.append(Chain.getOperands());
+  auto *Kernel = getChainKernel(*F.getParent(), Chain, getChainLanes(F));
+
+  llvm::errs() << "Fusing " << Chain.Ops.size() << " elementwise ops to\n"
+               << Kernel->getName() << "\n";
+  Builder.CreateCall(Kernel, Args);
+  for (auto &Op : Chain.Ops)
+    Op.Call->eraseFromParent();
   return true;
 }
 
-bool fuseElementwiseOpsIntoConv(llvm::Function &F, llvm::DominatorTree &DT) {
+bool fuseElementwiseChains(llvm::Function &F) {
   bool Changed = false;
+  for (auto &Chain : getElementwiseChains(F))
+    if (Chain.Ops.size() > 1)
+      Changed |= fuseChain(Chain);
+  return Changed;
+}
+
+/// Matches the post-ops of convolutions and products, e.g.
+/// `__mydsl_tensor_elementwise_relu_4_f32`, see Tensor::addBias.
+std::optional<MyDSL::EpilogueKind> getEpilogueKind(llvm::CallInst &CI) {
+  auto *F = CI.getCalledFunction();
+  if (!F)
+    return std::nullopt;
+  auto Name = F->getName();
+  if (!Name.consume_front("__mydsl_tensor_elementwise_"))
+    return std::nullopt;
+  return llvm::StringSwitch<std::optional<MyDSL::EpilogueKind>>(
+             Name.take_until([](char C) { return C == '_'; }))
+      .Case("bias", MyDSL::EpilogueKind::Bias)
+      .Case("scale", MyDSL::EpilogueKind::Scale)
+      .Case("relu", MyDSL::EpilogueKind::ReLU)
+      .Case("clamp", MyDSL::EpilogueKind::Clamp)
+      .Default(std::nullopt);
+}
+
+/// Matches the builtins that can apply post-ops before they store a result:
+/// the convolutions, also fused with elementwise ops, and the quantized
+/// product and convolution.
+llvm::CallInst *isEpilogueProducer(llvm::Value &V) {
+  auto *CI = llvm::dyn_cast<llvm::CallInst>(&V);
+  if (!CI || !CI->getCalledFunction())
+    return nullptr;
+  auto Name = CI->getCalledFunction()->getName();
+  bool Conv = Name.starts_with("__mydsl_tensor_conv_") &&
+              !Name.starts_with("__mydsl_tensor_conv_strided_");
+  bool FusedConv =
+      Name.starts_with("__mydsl_fused_tensor_elementwise_conv_") &&
+      !Name.contains("_epilogue_");
+  bool Quantized = Name == "__mydsl_qtensor_mmul_2_i8" ||
+                   Name == "__mydsl_qtensor_conv_2_i8";
+  return Conv || FusedConv || Quantized ? CI : nullptr;
+}
+
+/// Returns the element type of the result of the builtin \p Name, e.g. `f16`.
+llvm::StringRef getResultType(llvm::StringRef Name) {
+  // the quantized builtins dequantize to f32
+  if (Name.starts_with("__mydsl_qtensor_"))
+    return "f32";
+  return Name.rsplit('_').second;
+}
+
+/// Returns the name of the variant of the builtin \p Name with post-ops, e.g.
+/// `__mydsl_fused_tensor_conv_nchw_epilogue_4_f32` for
+/// `__mydsl_tensor_conv_nchw_4_f32`.
+std::string getEpilogueOpName(llvm::StringRef Name) {
+  Name.consume_front("__mydsl_");
+  Name.consume_front("fused_");
+  auto Pos = Name.rfind('_', Name.rfind('_'));
+  return ("__mydsl_fused_" + Name.take_front(Pos) + "_epilogue" +
+          Name.drop_front(Pos))
+      .str();
+}
+
+/// Collects the post-ops that follow \p Producer in its block and compute in
+/// place on its result, up to the first other instruction that accesses
+/// memory or the result. The producer can then be moved to the last of them.
+llvm::SmallVector<llvm::CallInst *, 4> getEpilogue(llvm::CallInst *Producer) {
+  auto *Dest = Producer->getArgOperand(0);
+  auto Type = getResultType(Producer->getCalledFunction()->getName());
+  llvm::SmallVector<llvm::CallInst *, 4> PostOps;
+  for (auto &I : llvm::make_range(std::next(Producer->getIterator()),
+                                  Producer->getParent()->end())) {
+    auto *CI = llvm::dyn_cast<llvm::CallInst>(&I);
+    if (CI && getEpilogueKind(*CI) && CI->getArgOperand(0) == Dest &&
+        CI->getArgOperand(1) == Dest &&
+        getResultType(CI->getCalledFunction()->getName()) == Type) {
+      PostOps.push_back(CI);
+      continue;
+    }
+    if (I.mayReadOrWriteMemory() || llvm::is_contained(I.operands(), Dest))
+      break;
+  }
+  return PostOps;
+}
+
+/// The IR type of MyDSL::EpilogueOp.
+llvm::StructType *getEpilogueOpType(llvm::LLVMContext &Ctx) {
+  return llvm::StructType::get(
+      llvm::Type::getInt32Ty(Ctx), llvm::Type::getFloatTy(Ctx),
+      llvm::Type::getFloatTy(Ctx), llvm::PointerType::getUnqual(Ctx),
+      llvm::Type::getInt64Ty(Ctx), llvm::Type::getInt64Ty(Ctx),
+      llvm::Type::getInt64Ty(Ctx));
+}
 
-  auto FuseMap = getFusableTensorOps(F, DT);
+/// Replaces \p Producer and its \p PostOps by a call of the variant of the
+/// producer with post-ops, at the last post-op. The post-ops are passed as
+/// an array of MyDSL::EpilogueOp on the stack.
+bool fuseEpilogue(llvm::CallInst *Producer,
+                  llvm::ArrayRef<llvm::CallInst *> PostOps) {
+  auto &F = *Producer->getFunction();
+  auto &Ctx = F.getContext();
+  auto *OpTy = getEpilogueOpType(Ctx);
+  auto *ArrayTy = llvm::ArrayType::get(OpTy, PostOps.size());
 
-  for (auto &[Op, Conv] : FuseMap) {
-    auto FusedOpName = getFusedOpName(Op, Conv);
-    llvm::errs() << "Fusing " << *Op << " with\n"
-                 << *Conv << " to\n"
-                 << FusedOpName << "\n";
-    if (FusedOpName.starts_with("__mydsl_fused_tensor_elementwise_mul_conv_")) {
-      Changed |= fuseElementwiseMulIntoConv(FusedOpName, Op, Conv);
+  llvm::IRBuilder<> Builder(&*F.getEntryBlock().getFirstInsertionPt());
+  auto *Ops = Builder.CreateAlloca(ArrayTy, nullptr, "epilogue");
+
+  Builder.SetInsertPoint(PostOps.back());
+  for (std::size_t I = 0; I < PostOps.size(); ++I) {
+    auto *PostOp = PostOps[I];
+    auto Kind = *getEpilogueKind(*PostOp);
+    llvm::Value *Fields[] = {
+        Builder.getInt32(static_cast<std::int32_t>(Kind)),
+        llvm::ConstantFP::get(Builder.getFloatTy(), 0.),
+        llvm::ConstantFP::get(Builder.getFloatTy(), 0.),
+        llvm::ConstantPointerNull::get(Builder.getPtrTy()),
+        Builder.getInt64(0),
+        Builder.getInt64(0),
+        Builder.getInt64(0)};
+    // the arguments of the builtins, see Tensor::callElementwiseBuiltin
+    switch (Kind) {
+    case MyDSL::EpilogueKind::Bias:
+      Fields[3] = PostOp->getArgOperand(2);
+      for (unsigned Field = 4; Field < 7; ++Field)
+        Fields[Field] = PostOp->getArgOperand(Field);
+      break;
+    case MyDSL::EpilogueKind::Scale:
+      Fields[1] = PostOp->getArgOperand(2);
+      break;
+    case MyDSL::EpilogueKind::ReLU:
+      break;
+    case MyDSL::EpilogueKind::Clamp:
+      Fields[1] = PostOp->getArgOperand(2);
+      Fields[2] = PostOp->getArgOperand(3);
+      break;
     }
+    auto *Op = Builder.CreateConstInBoundsGEP2_64(ArrayTy, Ops, 0, I);
+    for (unsigned Field = 0; Field < std::size(Fields); ++Field)
+      Builder.CreateStore(Fields[Field],
+                          Builder.CreateStructGEP(OpTy, Op, Field));
   }
 
+  llvm::SmallVector<llvm::Value *, 20> Args(Producer->args());
+  Args.push_back(Ops);
+  Args.push_back(Builder.getInt64(PostOps.size()));
+  llvm::SmallVector<llvm::Type *, 20> ArgTys;
+  for (auto *Arg : Args)
+    ArgTys.push_back(Arg->getType());
+  auto Name = getEpilogueOpName(Producer->getCalledFunction()->getName());
+  auto FusedOp = F.getParent()->getOrInsertFunction(
+      Name, llvm::FunctionType::get(Producer->getType(), ArgTys, false));
+
+  llvm::errs() << "Fusing " << *Producer << " with " << PostOps.size()
+               << " post-ops to\n"
+               << Name << "\n";
+  auto NewCI = Builder.CreateCall(
+      FusedOp, Args, "", Producer->getMetadata(llvm::LLVMContext::MD_fpmath));
+  for (auto *PostOp : PostOps)
+    PostOp->eraseFromParent();
+  Producer->replaceAllUsesWith(NewCI);
+  Producer->eraseFromParent();
+  return true;
+}
+
+bool fuseEpilogues(llvm::Function &F) {
+  llvm::SmallVector<llvm::CallInst *, 8> Producers;
+  for (auto &I : llvm::instructions(F))
+    if (auto *CI = isEpilogueProducer(I))
+      Producers.push_back(CI);
+
+  bool Changed = false;
+  for (auto *Producer : Producers) {
+    auto PostOps = getEpilogue(Producer);
+    if (!PostOps.empty())
+      Changed |= fuseEpilogue(Producer, PostOps);
+  }
   return Changed;
 }
 
@@ -124,9 +1147,14 @@ bool fuseElementwiseOpsIntoConv(llvm::Function &F, llvm::DominatorTree &DT) {
 namespace MyDSL {
 llvm::PreservedAnalyses
 FuseTensorOpsPass::run(llvm::Function &F, llvm::FunctionAnalysisManager &FAM) {
-  auto &DT = FAM.getResult<llvm::DominatorTreeAnalysis>(F);
-
-  if (fuseElementwiseOpsIntoConv(F, DT)) {
+  // the fused convolutions take post-ops as well, the remaining chains are
+  // not next to a convolution. Unrolled convolutions leave their post-ops to
+  // fuseElementwiseChains.
+  bool Changed = fuseElementwiseOpsIntoConv(F);
+  Changed |= unrollConstantFilters(F);
+  Changed |= fuseEpilogues(F);
+  Changed |= fuseElementwiseChains(F);
+  if (Changed) {
     return llvm::PreservedAnalyses::none();
   }
   return llvm::PreservedAnalyses::all();
@@ -145,8 +1173,14 @@ void fuseOps(llvm::Module &M) {
   PB.registerLoopAnalyses(LAM);
   PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
 
+  // the DSL keeps scalars in allocas, after promoting them only the tensor
+  // operations access memory between the builtins
+  llvm::FunctionPassManager FPM;
+  FPM.addPass(llvm::PromotePass());
+  FPM.addPass(FuseTensorOpsPass());
+
   llvm::ModulePassManager MPM;
-  MPM.addPass(llvm::createModuleToFunctionPassAdaptor(FuseTensorOpsPass()));
+  MPM.addPass(llvm::createModuleToFunctionPassAdaptor(std::move(FPM)));
   MPM.run(M, MAM);
 }
 } // namespace MyDSL
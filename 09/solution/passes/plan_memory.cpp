@@ -0,0 +1,282 @@
+#include "plan_memory.hpp"
+
+#include <algorithm>
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Analysis/ValueTracking.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/CFG.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Transforms/Utils/Mem2Reg.h>
+
+namespace {
+/// Alignment of every slot in the arena, large enough for any vector load.
+constexpr std::uint64_t SlotAlignment = 64;
+
+struct TensorTemporary {
+  llvm::AllocaInst *Alloca;
+  /// Size in bytes, available at kernel entry.
+  llvm::Value *Size;
+  /// Blocks in which the memory of the tensor is live.
+  llvm::SmallPtrSet<llvm::BasicBlock *, 16> Live;
+};
+
+struct Slot {
+  llvm::SmallVector<TensorTemporary *, 4> Tensors;
+  llvm::Value *Size;
+};
+
+bool isTensorAlloca(llvm::Instruction &I) {
+  return llvm::isa<llvm::AllocaInst>(I) && I.getMetadata("mydsl.tensor");
+}
+
+/// Recomputes \p V at the insertion point of \p Builder. Only works if \p V
+/// is computed from arguments and constants by instructions that can be
+/// executed speculatively, returns nullptr otherwise.
+llvm::Value *materialize(llvm::Value *V, llvm::IRBuilder<> &Builder,
+                         llvm::DenseMap<llvm::Value *, llvm::Value *> &Cache) {
+  if (llvm::isa<llvm::Constant>(V) || llvm::isa<llvm::Argument>(V))
+    return V;
+  if (auto *Cached = Cache.lookup(V))
+    return Cached;
+
+  auto *I = llvm::dyn_cast<llvm::Instruction>(V);
+  if (!I ||
+      !(llvm::isa<llvm::BinaryOperator>(I) || llvm::isa<llvm::CastInst>(I)) ||
+      !llvm::isSafeToSpeculativelyExecute(I))
+    return nullptr;
+
+  auto *Clone = I->clone();
+  for (auto &Op : Clone->operands()) {
+    auto *NewOp = materialize(Op, Builder, Cache);
+    if (!NewOp) {
+      Clone->deleteValue();
+      return nullptr;
+    }
+    Op = NewOp;
+  }
+  Builder.Insert(Clone, I->getName());
+  Cache[V] = Clone;
+  return Clone;
+}
+
+/// Collects the blocks in which the memory of \p AI is accessed. Returns
+/// false if the pointer escapes.
+bool getAccessBlocks(llvm::AllocaInst *AI,
+                     llvm::SmallPtrSetImpl<llvm::BasicBlock *> &Blocks) {
+  llvm::SmallVector<llvm::Value *, 8> Worklist{AI};
+  llvm::SmallPtrSet<llvm::Value *, 8> Visited{AI};
+  while (!Worklist.empty()) {
+    auto *V = Worklist.pop_back_val();
+    for (auto *U : V->users()) {
+      auto *I = llvm::cast<llvm::Instruction>(U);
+      if (llvm::isa<llvm::GetElementPtrInst>(I) ||
+          llvm::isa<llvm::BitCastInst>(I) || llvm::isa<llvm::PHINode>(I) ||
+          llvm::isa<llvm::SelectInst>(I)) {
+        if (Visited.insert(I).second)
+          Worklist.push_back(I);
+        continue;
+      }
+      if (auto *SI = llvm::dyn_cast<llvm::StoreInst>(I)) {
+        if (SI->getValueOperand() == V)
+          return false;
+      } else if (!llvm::isa<llvm::LoadInst>(I) &&
+                 !llvm::isa<llvm::CallBase>(I)) {
+        return false;
+      }
+      Blocks.insert(I->getParent());
+    }
+  }
+  return true;
+}
+
+/// Computes the blocks in which the memory of \p AI is live: the blocks that
+/// are reachable from an access and from which an access is reachable. Paths
+/// that come back into the block of the alloca are not followed, executing the
+/// alloca again yields fresh memory. Accesses in that block still reach its
+/// successors and predecessors.
+llvm::SmallPtrSet<llvm::BasicBlock *, 16>
+getLiveBlocks(llvm::AllocaInst *AI,
+              const llvm::SmallPtrSetImpl<llvm::BasicBlock *> &Accesses) {
+  auto *AllocBB = AI->getParent();
+  auto Reachable = [&](auto &&Next) {
+    llvm::SmallPtrSet<llvm::BasicBlock *, 16> Visited(Accesses.begin(),
+                                                     Accesses.end());
+    llvm::SmallVector<llvm::BasicBlock *, 16> Worklist(Accesses.begin(),
+                                                      Accesses.end());
+    while (!Worklist.empty()) {
+      auto *BB = Worklist.pop_back_val();
+      for (auto *N : Next(BB))
+        if (Visited.insert(N).second && N != AllocBB)
+          Worklist.push_back(N);
+    }
+    return Visited;
+  };
+
+  auto Forward = Reachable([](llvm::BasicBlock *BB) { return successors(BB); });
+  auto Backward =
+      Reachable([](llvm::BasicBlock *BB) { return predecessors(BB); });
+
+  llvm::SmallPtrSet<llvm::BasicBlock *, 16> Live;
+  for (auto *BB : Forward)
+    if (Backward.contains(BB))
+      Live.insert(BB);
+  return Live;
+}
+
+bool interfere(const TensorTemporary &A, const TensorTemporary &B) {
+  return llvm::any_of(
+      A.Live, [&](llvm::BasicBlock *BB) { return B.Live.contains(BB); });
+}
+
+/// Rounds \p Size up to the slot alignment.
+llvm::Value *alignSize(llvm::IRBuilder<> &Builder, llvm::Value *Size) {
+  return Builder.CreateAnd(
+      Builder.CreateAdd(Size, Builder.getInt64(SlotAlignment - 1)),
+      Builder.getInt64(~(SlotAlignment - 1)));
+}
+
+/// Maximum of two sizes, folded if both are constant.
+llvm::Value *createUMax(llvm::IRBuilder<> &Builder, llvm::Value *LHS,
+                        llvm::Value *RHS) {
+  auto *C1 = llvm::dyn_cast<llvm::ConstantInt>(LHS);
+  auto *C2 = llvm::dyn_cast<llvm::ConstantInt>(RHS);
+  if (C1 && C2)
+    return C1->getValue().uge(C2->getValue()) ? LHS : RHS;
+  return Builder.CreateBinaryIntrinsic(llvm::Intrinsic::umax, LHS, RHS);
+}
+
+bool planTensorMemory(llvm::Function &F, std::uint64_t StackLimit) {
+  llvm::SmallVector<llvm::AllocaInst *, 8> Allocas;
+  for (auto &BB : F)
+    for (auto &I : BB)
+      if (isTensorAlloca(I))
+        Allocas.push_back(llvm::cast<llvm::AllocaInst>(&I));
+  if (Allocas.empty())
+    return false;
+
+  const auto &DL = F.getParent()->getDataLayout();
+  auto &EntryBB = F.getEntryBlock();
+  llvm::IRBuilder<> Builder(&EntryBB, EntryBB.getFirstInsertionPt());
+
+  llvm::DenseMap<llvm::Value *, llvm::Value *> Cache;
+  llvm::SmallVector<TensorTemporary, 8> Temporaries;
+  for (auto *AI : Allocas) {
+    llvm::SmallPtrSet<llvm::BasicBlock *, 16> Accesses;
+    if (!getAccessBlocks(AI, Accesses))
+      continue;
+    auto *Count = materialize(AI->getArraySize(), Builder, Cache);
+    if (!Count)
+      continue;
+    auto *ElementSize =
+        Builder.getInt64(DL.getTypeAllocSize(AI->getAllocatedType()));
+    auto *Size = alignSize(
+        Builder, Builder.CreateMul(Builder.CreateZExtOrTrunc(
+                                       Count, Builder.getInt64Ty()),
+                                   ElementSize));
+    Temporaries.push_back({AI, Size, getLiveBlocks(AI, Accesses)});
+  }
+  if (Temporaries.empty())
+    return false;
+
+  // greedy coloring of the interference graph, each color is a slot
+  llvm::SmallVector<Slot, 8> Slots;
+  for (auto &Tmp : Temporaries) {
+    auto It = llvm::find_if(Slots, [&](const Slot &S) {
+      return llvm::none_of(S.Tensors, [&](const TensorTemporary *Other) {
+        return interfere(Tmp, *Other);
+      });
+    });
+    if (It == Slots.end()) {
+      Slots.push_back({{&Tmp}, Tmp.Size});
+      continue;
+    }
+    It->Tensors.push_back(&Tmp);
+    It->Size = createUMax(Builder, It->Size, Tmp.Size);
+  }
+
+  llvm::Value *ArenaSize = Builder.getInt64(0);
+  llvm::SmallVector<llvm::Value *, 8> Offsets;
+  for (auto &S : Slots) {
+    Offsets.push_back(ArenaSize);
+    ArenaSize = Builder.CreateAdd(ArenaSize, S.Size, "arena_size");
+  }
+
+  llvm::Value *Arena;
+  auto *ConstSize = llvm::dyn_cast<llvm::ConstantInt>(ArenaSize);
+  if (ConstSize && ConstSize->getZExtValue() <= StackLimit) {
+    auto *AI = Builder.CreateAlloca(
+        llvm::ArrayType::get(Builder.getInt8Ty(), ConstSize->getZExtValue()),
+        nullptr, "arena");
+    AI->setAlignment(llvm::Align(SlotAlignment));
+    Arena = AI;
+  } else {
+    auto &M = *F.getParent();
+    auto AlignedAlloc = M.getOrInsertFunction(
+        "aligned_alloc", Builder.getPtrTy(), Builder.getInt64Ty(),
+        Builder.getInt64Ty());
+    auto Free = M.getOrInsertFunction("free", Builder.getVoidTy(),
+                                      Builder.getPtrTy());
+    Arena = Builder.CreateCall(
+        AlignedAlloc, {Builder.getInt64(SlotAlignment), ArenaSize}, "arena");
+    for (auto &BB : F)
+      if (auto *Ret = llvm::dyn_cast<llvm::ReturnInst>(BB.getTerminator()))
+        llvm::CallInst::Create(Free, {Arena}, "", Ret);
+  }
+
+  for (auto [S, Offset] : llvm::zip(Slots, Offsets)) {
+    auto *SlotPtr = Builder.CreateGEP(Builder.getInt8Ty(), Arena, {Offset},
+                                      "tensor_slot", /*inbounds=*/true);
+    for (auto *Tmp : S.Tensors)
+      Tmp->Alloca->replaceAllUsesWith(SlotPtr);
+  }
+  // erased last, the builder may point at one of them
+  for (auto &Tmp : Temporaries)
+    Tmp.Alloca->eraseFromParent();
+
+  llvm::errs() << "Planned " << Temporaries.size() << " tensor temporaries in "
+               << Slots.size() << " arena slots\n";
+  return true;
+}
+} // namespace
+
+namespace MyDSL {
+llvm::PreservedAnalyses
+PlanTensorMemoryPass::run(llvm::Function &F,
+                          llvm::FunctionAnalysisManager &FAM) {
+  if (::planTensorMemory(F, StackLimit)) {
+    llvm::PreservedAnalyses PA;
+    PA.preserveSet<llvm::CFGAnalyses>();
+    return PA;
+  }
+  return llvm::PreservedAnalyses::all();
+}
+
+void planTensorMemory(llvm::Module &M, std::uint64_t StackLimit) {
+  llvm::PassBuilder PB;
+
+  llvm::LoopAnalysisManager LAM;
+  llvm::FunctionAnalysisManager FAM;
+  llvm::CGSCCAnalysisManager CGAM;
+  llvm::ModuleAnalysisManager MAM;
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  // tensor sizes are computed from DSL values, which live in allocas until
+  // they are promoted
+  llvm::FunctionPassManager FPM;
+  FPM.addPass(llvm::PromotePass());
+  FPM.addPass(PlanTensorMemoryPass(StackLimit));
+
+  llvm::ModulePassManager MPM;
+  MPM.addPass(llvm::createModuleToFunctionPassAdaptor(std::move(FPM)));
+  MPM.run(M, MAM);
+}
+} // namespace MyDSL
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+
+#include <llvm/IR/PassManager.h>
+
+namespace MyDSL {
+
+/**
+ * @brief Plans the memory of the tensor temporaries of a kernel.
+ *
+ * Computes the live interval of every tensor alloca and assigns the tensors
+ * to slots of a single arena, reusing a slot once its previous tensor is dead.
+ * The arena is allocated once at kernel entry: on the stack if its size is a
+ * constant not exceeding the stack limit, on the heap otherwise.
+ */
+struct PlanTensorMemoryPass : llvm::PassInfoMixin<PlanTensorMemoryPass> {
+  /// Largest arena (in bytes) that is allocated on the stack.
+  std::uint64_t StackLimit;
+
+  PlanTensorMemoryPass(std::uint64_t StackLimit = 64 * 1024)
+      : StackLimit(StackLimit) {}
+
+  llvm::PreservedAnalyses run(llvm::Function &F,
+                              llvm::FunctionAnalysisManager &FAM);
+};
+
+void planTensorMemory(llvm::Module &M, std::uint64_t StackLimit = 64 * 1024);
+
+} // namespace MyDSL
@@ -0,0 +1,149 @@
+#pragma once
+
+#include "float_ops.hpp"
+#include "int_ops.hpp"
+#include "tensor_ops.hpp"
+
+#include <cassert>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Module.h>
+
+namespace MyDSL {
+
+/**
+ * @brief A quantized tensor. Every Int8 element q represents the real value
+ * `scale * (q - zeroPoint)`, with one scale and zero point for the whole
+ * tensor.
+ *
+ * Matrix products and convolutions of quantized tensors multiply the Int8
+ * elements and accumulate in 32 bit integers, which is exact. Only the final
+ * sums are scaled to Float.
+ */
+template <int Dim> class QTensor {
+  Tensor<Int8, Dim> data_;
+  Float scale_;
+  Integer zeroPoint_;
+
+  /// Returns the elements in a dense tensor, as the builtins expect them.
+  Tensor<Int8, Dim> dense() const {
+    if (data_.isContiguous())
+      return data_;
+    return Tensor<Int8, Dim>{data_.expr()};
+  }
+
+  /// Truncates the zero point to the 32 bit accumulators of the builtins.
+  llvm::Value *zeroPoint32() const {
+    auto &builder = data_.builder_;
+    return builder.CreateTrunc(zeroPoint_.getValue(), builder.getInt32Ty());
+  }
+
+public:
+  static constexpr int rank = Dim;
+
+  /**
+   * @brief Views quantized elements.
+   *
+   * @param data The Int8 elements.
+   * @param scale The size of one quantization step.
+   * @param zeroPoint The element that represents 0, in [-128, 127].
+   */
+  QTensor(const Tensor<Int8, Dim> &data, const Float &scale,
+          const Integer &zeroPoint)
+      : data_(data), scale_(scale), zeroPoint_(zeroPoint) {}
+
+  /**
+   * @brief Quantizes \a values into a new tensor: rounds `values / scale` to
+   * the nearest integer, ties to even, adds the zero point and saturates.
+   *
+   * @param values A Float tensor or expression.
+   * @param scale The size of one quantization step.
+   * @param zeroPoint The element that represents 0, in [-128, 127].
+   * @return QTensor The quantized tensor.
+   */
+  template <TensorOperand<Float> U>
+  static QTensor quantize(const U &values, const Float &scale,
+                          const Integer &zeroPoint)
+    requires(U::rank == Dim)
+  {
+    return {Tensor<Int8, Dim>{values.expr().template map<Int8>(
+                [scale, zeroPoint](const Float &x) {
+                  return Int8::saturate((x / scale).round().toInteger() +
+                                        zeroPoint);
+                })},
+            scale, zeroPoint};
+  }
+
+  /// Returns the real values as a lazy expression.
+  TensorExpr<Float, Dim> dequantize() const {
+    return data_.expr().template map<Float>(
+        [scale = scale_, zeroPoint = zeroPoint_](const Int8 &q) {
+          return (q.toInteger() - zeroPoint).toFloat() * scale;
+        });
+  }
+
+  const Tensor<Int8, Dim> &data() const { return data_; }
+  const Float &scale() const { return scale_; }
+  const Integer &zeroPoint() const { return zeroPoint_; }
+
+  /**
+   * @brief Computes the matrix product with \a other in int32 and returns it
+   * dequantized, i.e. scaled by the product of both scales.
+   *
+   * @param other A quantized (k x n) matrix, for this (m x k) matrix.
+   * @return Tensor<Float, 2> The (m x n) product.
+   */
+  Tensor<Float, 2> mmul(const QTensor<2> &other) const
+    requires(Dim == 2)
+  {
+    auto &builder = data_.builder_;
+    auto &M = *builder.GetInsertBlock()->getModule();
+    auto *PtrTy = builder.getPtrTy();
+    auto *I32Ty = builder.getInt32Ty();
+    auto *IntTy = Integer::getType(M.getContext());
+
+    auto a = dense();
+    auto b = other.dense();
+    Tensor<Float, 2> result{{data_.extent(0), other.data_.extent(1)},
+                            builder};
+    auto FC = M.getOrInsertFunction(
+        "__mydsl_qtensor_mmul_2_i8", builder.getVoidTy(), PtrTy, PtrTy, I32Ty,
+        PtrTy, I32Ty, builder.getFloatTy(), IntTy, IntTy, IntTy);
+    builder.CreateCall(FC, {result.data_, a.data_, zeroPoint32(), b.data_,
+                            other.zeroPoint32(), scale_ * other.scale_,
+                            a.size_[0], a.size_[1], b.size_[1]});
+    return result;
+  }
+
+  /**
+   * @brief Convolves with \a filter in int32 and stores the dequantized
+   * result into \a dest, like Tensor::conv2d.
+   *
+   * @param dest A dense Float tensor for the result.
+   * @param filter The quantized filter, square with odd extent.
+   */
+  void conv2d(Tensor<Float, 2> &dest, const QTensor<2> &filter) const
+    requires(Dim == 2)
+  {
+    // pre: size_[0] and size_[1] are equiv
+    assert(dest.isContiguous() && "The result must be dense");
+    auto &builder = data_.builder_;
+    auto &M = *builder.GetInsertBlock()->getModule();
+    auto *PtrTy = builder.getPtrTy();
+    auto *I32Ty = builder.getInt32Ty();
+    auto *IntTy = Integer::getType(M.getContext());
+
+    auto a = dense();
+    auto f = filter.dense();
+    auto FC = M.getOrInsertFunction(
+        "__mydsl_qtensor_conv_2_i8", builder.getVoidTy(), PtrTy, PtrTy, I32Ty,
+        PtrTy, I32Ty, builder.getFloatTy(), IntTy, IntTy);
+    builder.CreateCall(FC, {dest.data_, a.data_, zeroPoint32(), f.data_,
+                            filter.zeroPoint32(), scale_ * filter.scale_,
+                            a.size_[0], f.size_[0]});
+  }
+
+  template <int D> friend class QTensor;
+};
+
+} // namespace MyDSL
@@ -2,48 +2,703 @@
 
 #include "base_ops.hpp"
 #include "control_flow.hpp"
+#include "conv_algorithm.hpp"
+#include "float_ops.hpp"
 #include "int_ops.hpp"
 #include "ref.hpp"
+#include "vec_ops.hpp"
 
 #include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <concepts>
+#include <cstdint>
+#include <functional>
+#include <numeric>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <llvm/ADT/STLExtras.h>
 #include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringExtras.h>
 #include <llvm/ADT/Twine.h>
+#include <llvm/IR/Constants.h>
 #include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/GlobalVariable.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Metadata.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/ErrorHandling.h>
+#include <llvm/Support/MathExtras.h>
 
 namespace MyDSL {
 
-class Float;
+/**
+ * @brief Compile-time extents of a tensor, e.g. `Extents<3, 3>` for a 3x3
+ * filter. Pass an instance to the Tensor constructor to create a tensor with
+ * static shape.
+ */
+template <std::int64_t... N> struct Extents {
+  static_assert(((N > 0) && ...), "Static extents must be positive");
+  static constexpr int rank = sizeof...(N);
+};
+
+template <class T, int Dim> class TensorExpr;
+template <int Dim> class QTensor;
+
+/// Padding of the input of the convolution of NCHW tensors, see
+/// Tensor::conv2d. Padded elements are zeros.
+enum class ConvPadding {
+  /// No padding, all windows lie inside the input.
+  Valid,
+  /// The output has ceil(extent / stride) rows and columns. The windows are
+  /// centered, odd paddings have the extra row or column at the end.
+  Same,
+  /// The padding given by Conv2dOptions::padBegin and padEnd.
+  Explicit
+};
+
+/// Parameters of the convolution of NCHW tensors, see Tensor::conv2d. The
+/// arrays hold the values for the height and the width.
+struct Conv2dOptions {
+  std::array<std::int64_t, 2> stride = {1, 1};
+  /// Distance of adjacent filter elements in the input, 1 for dense windows.
+  std::array<std::int64_t, 2> dilation = {1, 1};
+  ConvPadding padding = ConvPadding::Valid;
+  /// Rows and columns of zeros before and after the input, only used with
+  /// ConvPadding::Explicit.
+  std::array<std::int64_t, 2> padBegin = {0, 0};
+  std::array<std::int64_t, 2> padEnd = {0, 0};
+};
+
+/// How explicitly vectorized tensor loops handle the elements after the last
+/// full vector.
+enum class TailPolicy {
+  /// A scalar remainder loop.
+  Scalar,
+  /// A single iteration with masked loads and stores.
+  Masked
+};
+
+/**
+ * @brief Makes the elementwise tensor operations of \a kernel emit explicit
+ * vector code instead of scalar loops, see Tensor::assign. Must be called
+ * before the body of the kernel is emitted.
+ *
+ * @param kernel The kernel function.
+ * @param vectorBits The width of a vector register in bits, e.g. from
+ * getNativeVectorBits.
+ * @param tail How the remaining elements are handled.
+ */
+inline void vectorizeTensorOps(llvm::Function &kernel, unsigned vectorBits,
+                               TailPolicy tail) {
+  kernel.addFnAttr("mydsl-vector-bits", llvm::utostr(vectorBits));
+  kernel.addFnAttr("mydsl-vector-tail",
+                   tail == TailPolicy::Masked ? "masked" : "scalar");
+}
+
+/**
+ * @brief Makes the tensor operations of \a kernel compute indices and offsets
+ * in i32 with no signed wrap, and count their loop nests in i32. Indices are
+ * only sign-extended by the address computations. 32 bit multiplications and
+ * divisions are cheaper, and vectors of indices (e.g. for gathers) have twice
+ * as many lanes. Must be called before the body of the kernel is emitted.
+ *
+ * Only valid if no tensor of the kernel has 2^31 or more elements.
+ *
+ * @param kernel The kernel function.
+ */
+inline void useIndex32(llvm::Function &kernel) {
+  kernel.addFnAttr("mydsl-index-bits", "32");
+}
+
+/// Calls `f.template operator()<N>()` with the vector length \a lanes as
+/// template argument N.
+template <class F> decltype(auto) withLanes(unsigned lanes, F &&f) {
+  switch (lanes) {
+  case 2:
+    return f.template operator()<2>();
+  case 4:
+    return f.template operator()<4>();
+  case 8:
+    return f.template operator()<8>();
+  case 16:
+    return f.template operator()<16>();
+  }
+  llvm_unreachable("Unsupported vector length");
+}
+
+/// Properties of the element type \a T of tensors.
+template <class T> struct ElementTraits {
+  /// Type of the elements in host memory.
+  using Storage = typename T::NativeType;
+  /// Type in which reductions accumulate.
+  using Accumulator = T;
+  /// Converts an element to the accumulator type.
+  static const T &extend(const T &value) { return value; }
+};
+
+/// Reduced floats accumulate in Float, which avoids losing the small
+/// summands once the sum gets large.
+template <llvm::Type::TypeID ID> struct ElementTraits<ReducedFloat<ID>> {
+  /// The raw bits, C++ has no portable 16 bit floating point type.
+  using Storage = std::uint16_t;
+  using Accumulator = Float;
+  static Float extend(const ReducedFloat<ID> &value) {
+    return value.toFloat();
+  }
+};
+
+/// Int8 elements are accumulated in Integer, they would overflow quickly.
+template <> struct ElementTraits<Int8> {
+  using Storage = Int8::NativeType;
+  using Accumulator = Integer;
+  static Integer extend(const Int8 &value) { return value.toInteger(); }
+};
+
+/// Tensors and tensor expressions with elements of type \a T. Both can be
+/// operands of elementwise operations.
+template <class U, class T>
+concept TensorOperand = requires(const U &u) {
+  { u.expr() } -> std::convertible_to<TensorExpr<T, U::rank>>;
+};
+
+/// A tensor that an expression loads: its memory and the strides it is read
+/// with at the index of the expression. The strides are empty if it is read
+/// at other indices, e.g. broadcast.
+struct TensorLoad {
+  llvm::Value *data;
+  llvm::SmallVector<llvm::Value *, 4> strides;
+};
+
+/**
+ * @brief A lazily evaluated elementwise tensor expression.
+ *
+ * Arithmetic on tensors does not compute temporary tensors, it builds an
+ * expression tree instead. The tree is evaluated in a single loop nest when it
+ * is assigned to a tensor, so `D = A * B + C` reads every input element once
+ * and writes D once. Assign to an explicitly typed Tensor to materialize the
+ * expression, `auto` keeps it lazy.
+ */
+template <class T, int Dim> class TensorExpr {
+public:
+  /// Emits the computation of the element at the given index.
+  using EvalFn = std::function<T(llvm::ArrayRef<llvm::Value *>)>;
+  /// Emits the computation of the element at the given position of the
+  /// flattened, row-major tensor.
+  using FlatEvalFn = std::function<T(const Integer &)>;
+  /// Emits the computation of `lanes` consecutive elements of the flattened
+  /// tensor as a vector value. Lanes that are not set in the mask (if any)
+  /// must not be loaded.
+  using VectorEvalFn = std::function<llvm::Value *(
+      const Integer &index, unsigned lanes, llvm::Value *mask)>;
+
+private:
+  llvm::SmallVector<llvm::Value *, Dim> size_;
+  EvalFn eval_;
+  /// Only set if all tensors in the expression are contiguous, which allows
+  /// evaluating it in a single flat loop.
+  FlatEvalFn flat_;
+  /// Set along with flat_ if the element type has a Vec type.
+  VectorEvalFn vector_;
+  /// The layout of the memory that flat_ and vector_ index, the flat
+  /// positions of operands of different layouts are different elements.
+  TensorLayout layout_ = TensorLayout::NCHW;
+  /// The tensors the expression loads, see Tensor::assign.
+  llvm::SmallVector<TensorLoad, 2> loads_;
+
+  llvm::IRBuilder<> &builder_;
+
+  template <class U, int D> friend class Tensor;
+  template <class U, int D> friend class TensorExpr;
+
+  static bool isOne(llvm::Value *extent) {
+    auto *C = llvm::dyn_cast<llvm::ConstantInt>(extent);
+    return C && C->isOne();
+  }
+
+  /// Computes the shape of an elementwise operation with an operand of shape
+  /// \a other, following NumPy: shapes are aligned at the innermost
+  /// dimension, missing dimensions and dimensions with static extent 1 are
+  /// broadcast.
+  template <int D2>
+  llvm::SmallVector<llvm::Value *, std::max(Dim, D2)>
+  broadcastShape(llvm::ArrayRef<llvm::Value *> other) const {
+    // pre: dynamic extents that are not broadcast are equiv
+    constexpr int R = std::max(Dim, D2);
+    llvm::SmallVector<llvm::Value *, R> shape(R);
+    for (int r = 0; r < R; ++r) {
+      llvm::Value *a = r >= R - Dim ? size_[r - (R - Dim)] : nullptr;
+      llvm::Value *b = r >= R - D2 ? other[r - (R - D2)] : nullptr;
+      assert(!(a && b && llvm::isa<llvm::ConstantInt>(a) &&
+               llvm::isa<llvm::ConstantInt>(b) && a != b && !isOne(a) &&
+               !isOne(b)) &&
+             "Shapes cannot be broadcast");
+      shape[r] = !a || (b && isOne(a)) ? b : a;
+    }
+    return shape;
+  }
+
+  /// Broadcasts the expression to \a shape. Broadcast dimensions are
+  /// evaluated at index 0, so the loads of the operand do not depend on the
+  /// loops over these dimensions and are hoisted out of them.
+  template <int R>
+  TensorExpr<T, R> broadcastTo(llvm::ArrayRef<llvm::Value *> shape) const {
+    llvm::SmallVector<bool, Dim> repeat(Dim);
+    bool broadcast = R != Dim;
+    for (int d = 0; d < Dim; ++d) {
+      repeat[d] = isOne(size_[d]) && !isOne(shape[d + R - Dim]);
+      broadcast |= repeat[d];
+    }
+    if constexpr (R == Dim) {
+      if (!broadcast)
+        return *this;
+    }
+
+    TensorExpr<T, R> result{
+        shape,
+        [eval = eval_, repeat,
+         &builder = builder_](llvm::ArrayRef<llvm::Value *> index) -> T {
+          llvm::SmallVector<llvm::Value *, Dim> inner(Dim);
+          for (int d = 0; d < Dim; ++d)
+            inner[d] = repeat[d] ? builder.getInt64(0) : index[d + R - Dim];
+          return eval(inner);
+        },
+        builder_};
+    for (auto &load : loads_)
+      result.loads_.push_back({load.data, {}});
+    return result;
+  }
+
+  template <int D2, class F>
+  TensorExpr<T, std::max(Dim, D2)> combine(const TensorExpr<T, D2> &other,
+                                           F f) const {
+    constexpr int R = std::max(Dim, D2);
+    auto shape = broadcastShape<D2>(other.size_);
+    auto lhs = broadcastTo<R>(shape);
+    auto rhs = other.template broadcastTo<R>(shape);
+
+    TensorExpr<T, R> result{shape,
+                            [lhs = lhs.eval_, rhs = rhs.eval_,
+                             f](llvm::ArrayRef<llvm::Value *> index) -> T {
+                              return f(lhs(index), rhs(index));
+                            },
+                            builder_};
+    // broadcast operands cannot be evaluated at a flat index
+    const bool flat = lhs.flat_ && rhs.flat_ && lhs.layout_ == rhs.layout_;
+    result.layout_ = lhs.layout_;
+    result.loads_ = lhs.loads_;
+    result.loads_.append(rhs.loads_.begin(), rhs.loads_.end());
+    if (flat)
+      result.flat_ = [lhs = lhs.flat_, rhs = rhs.flat_,
+                      f](const Integer &index) -> T {
+        return f(lhs(index), rhs(index));
+      };
+    // reduced floats have no vector arithmetic, see VectorElement
+    if constexpr (VectorElement<T>) {
+      if (flat && lhs.vector_ && rhs.vector_)
+        result.vector_ = [lhs = lhs.vector_, rhs = rhs.vector_, f,
+                          &builder = builder_](const Integer &index,
+                                               unsigned lanes,
+                                               llvm::Value *mask) {
+          llvm::Value *a = lhs(index, lanes, mask);
+          llvm::Value *b = rhs(index, lanes, mask);
+          return withLanes(lanes, [&]<unsigned N>() {
+            return f(Vec<T, N>{a, builder}, Vec<T, N>{b, builder}).getValue();
+          });
+        };
+    }
+    return result;
+  }
+
+  template <class F> TensorExpr<T, Dim> combine(const T &other, F f) const {
+    // the scalar is read once, where the expression is built
+    llvm::Value *scalar = other.getValue();
+    TensorExpr<T, Dim> result{size_,
+                              [lhs = eval_, scalar, &builder = builder_,
+                               f](llvm::ArrayRef<llvm::Value *> index) -> T {
+                                return f(lhs(index), T{scalar, builder});
+                              },
+                              builder_};
+    result.layout_ = layout_;
+    result.loads_ = loads_;
+    if (flat_)
+      result.flat_ = [lhs = flat_, scalar, &builder = builder_,
+                      f](const Integer &index) -> T {
+        return f(lhs(index), T{scalar, builder});
+      };
+    if constexpr (VectorElement<T>) {
+      if (vector_)
+        result.vector_ = [lhs = vector_, scalar, f, &builder = builder_](
+                             const Integer &index, unsigned lanes,
+                             llvm::Value *mask) {
+          llvm::Value *a = lhs(index, lanes, mask);
+          return withLanes(lanes, [&]<unsigned N>() {
+            Vec<T, N> b{T{scalar, builder}, builder};
+            return f(Vec<T, N>{a, builder}, b).getValue();
+          });
+        };
+    }
+    return result;
+  }
+
+public:
+  static constexpr int rank = Dim;
+
+  TensorExpr(llvm::ArrayRef<llvm::Value *> size, EvalFn eval,
+             llvm::IRBuilder<> &builder, FlatEvalFn flat = nullptr)
+      : size_(size.begin(), size.end()), eval_(std::move(eval)),
+        flat_(std::move(flat)), builder_(builder) {}
+
+  /// Returns the extent of dimension \a d.
+  Integer extent(int d) const { return {size_[d], builder_}; }
+
+  const TensorExpr<T, Dim> &expr() const { return *this; }
+
+  /**
+   * @brief Applies \a f to every element, e.g. to convert between element
+   * types. The result is evaluated element by element.
+   *
+   * @tparam U The element type of the result.
+   * @param f Functor from T to U.
+   * @return TensorExpr<U, Dim> The mapped expression.
+   */
+  template <class U, class F> TensorExpr<U, Dim> map(F f) const {
+    typename TensorExpr<U, Dim>::FlatEvalFn flat;
+    if (flat_)
+      flat = [flat = flat_, f](const Integer &index) -> U {
+        return f(flat(index));
+      };
+    TensorExpr<U, Dim> result{
+        size_,
+        [eval = eval_, f](llvm::ArrayRef<llvm::Value *> index) -> U {
+          return f(eval(index));
+        },
+        builder_, std::move(flat)};
+    result.layout_ = layout_;
+    result.loads_ = loads_;
+    return result;
+  }
+
+  template <TensorOperand<T> U>
+  TensorExpr<T, std::max(Dim, U::rank)> operator*(const U &other) const
+    requires(Multiplicable<T, T>)
+  {
+    return combine(other.expr(),
+                   [](const auto &a, const auto &b) { return a * b; });
+  }
+
+  TensorExpr<T, Dim> operator*(const T &other) const
+    requires(Multiplicable<T, T>)
+  {
+    return combine(other, [](const auto &a, const auto &b) { return a * b; });
+  }
+
+  template <TensorOperand<T> U>
+  TensorExpr<T, std::max(Dim, U::rank)> operator/(const U &other) const
+    requires(Divisible<T, T>)
+  {
+    return combine(other.expr(),
+                   [](const auto &a, const auto &b) { return a / b; });
+  }
+
+  TensorExpr<T, Dim> operator/(const T &other) const
+    requires(Divisible<T, T>)
+  {
+    return combine(other, [](const auto &a, const auto &b) { return a / b; });
+  }
+
+  template <TensorOperand<T> U>
+  TensorExpr<T, std::max(Dim, U::rank)> operator+(const U &other) const
+    requires(Addable<T, T>)
+  {
+    return combine(other.expr(),
+                   [](const auto &a, const auto &b) { return a + b; });
+  }
+
+  TensorExpr<T, Dim> operator+(const T &other) const
+    requires(Addable<T, T>)
+  {
+    return combine(other, [](const auto &a, const auto &b) { return a + b; });
+  }
+
+  template <TensorOperand<T> U>
+  TensorExpr<T, std::max(Dim, U::rank)> operator-(const U &other) const
+    requires(Subtractable<T, T>)
+  {
+    return combine(other.expr(),
+                   [](const auto &a, const auto &b) { return a - b; });
+  }
+
+  TensorExpr<T, Dim> operator-(const T &other) const
+    requires(Subtractable<T, T>)
+  {
+    return combine(other, [](const auto &a, const auto &b) { return a - b; });
+  }
+};
 
 template <class T, int Dim> class Tensor {
-  llvm::SmallVector<Integer, Dim> size_;
+  /// Shape and strides (in elements) are plain SSA values, computed once when
+  /// the tensor is created. Static extents are constants.
+  llvm::SmallVector<llvm::Value *, Dim> size_;
+  llvm::SmallVector<llvm::Value *, Dim> strides_;
+  /// The dimensions from the largest to the smallest stride, i.e. the loop
+  /// order that walks the memory of the tensor sequentially. Strides are SSA
+  /// values, so views track how they permute the dimensions.
+  llvm::SmallVector<int, Dim> order_;
+  /// True if the strides are the ones of a dense row-major tensor.
+  bool contiguous_ = false;
+  /// The layout of a dense 4D tensor created with a layout. Views are NCHW,
+  /// their strides describe the layout. Blocked layouts (see getLayoutBlock)
+  /// scale the block of the channel by strides_[1] and add its position in
+  /// the block.
+  TensorLayout layout_ = TensorLayout::NCHW;
   llvm::Value *data_;
 
   llvm::IRBuilder<> &builder_;
 
   template <class U, int D> friend class Tensor;
+  template <int D> friend class QTensor;
+
+  Tensor(llvm::ArrayRef<llvm::Value *> size,
+         llvm::ArrayRef<llvm::Value *> strides, llvm::ArrayRef<int> order,
+         bool contiguous, llvm::Value *data, llvm::IRBuilder<> &builder)
+      : size_(size.begin(), size.end()),
+        strides_(strides.begin(), strides.end()),
+        order_(order.begin(), order.end()), contiguous_(contiguous),
+        data_(data), builder_(builder) {}
+
+  /// Computes the strides of a dense row-major tensor.
+  void initStrides() {
+    assert((indexType()->getBitWidth() == 64 || fitsIndexType()) &&
+           "Tensor too large for 32 bit indices");
+    contiguous_ = true;
+    order_.resize(Dim);
+    std::iota(order_.begin(), order_.end(), 0);
+    strides_.resize(Dim);
+    strides_[Dim - 1] = builder_.getInt64(1);
+    for (int d = Dim - 2; d >= 0; --d)
+      strides_[d] = builder_.CreateMul(strides_[d + 1], size_[d + 1], "stride",
+                                       /*HasNUW=*/false, /*HasNSW=*/true);
+  }
+
+  /// Computes the strides of a dense tensor in \a layout.
+  void initLayout(TensorLayout layout)
+    requires(Dim == 4)
+  {
+    initStrides();
+    layout_ = layout;
+    if (layout == TensorLayout::NCHW)
+      return;
+
+    contiguous_ = false;
+    auto mul = [&](llvm::Value *a, llvm::Value *b) {
+      return builder_.CreateMul(a, b, "stride", /*HasNUW=*/false,
+                                /*HasNSW=*/true);
+    };
+    if (layout == TensorLayout::NHWC) {
+      strides_[1] = builder_.getInt64(1);
+      strides_[3] = size_[1];
+      strides_[2] = mul(size_[3], strides_[3]);
+      strides_[0] = mul(size_[2], strides_[2]);
+      order_ = {0, 2, 3, 1};
+      return;
+    }
+
+    auto block = getLayoutBlock(layout);
+    auto *blocks = builder_.CreateUDiv(
+        builder_.CreateAdd(size_[1], builder_.getInt64(block - 1)),
+        builder_.getInt64(block), "channel_blocks");
+    strides_[3] = builder_.getInt64(block);
+    strides_[2] = mul(size_[3], strides_[3]);
+    strides_[1] = mul(size_[2], strides_[2]);
+    strides_[0] = mul(blocks, strides_[1]);
+  }
+
+  /// Returns true if the tensor has a blocked layout, see getLayoutBlock.
+  bool isBlocked() const { return getLayoutBlock(layout_) != 0; }
+
+  /// Returns true if the tensor is dense in its layout, so its elements can
+  /// be evaluated in the order of its memory.
+  bool isDense() const {
+    return contiguous_ || layout_ != TensorLayout::NCHW;
+  }
+
+  /// Marks \a alloca as tensor storage, which allows the memory planner
+  /// (see planTensorMemory) to move it into the kernel's arena.
+  static llvm::AllocaInst *markTemporary(llvm::AllocaInst *alloca) {
+    alloca->setMetadata("mydsl.tensor",
+                        llvm::MDNode::get(alloca->getContext(), {}));
+    return alloca;
+  }
+
+  /// Returns the type of index arithmetic, i32 if the kernel uses
+  /// useIndex32 and i64 otherwise.
+  llvm::IntegerType *indexType() const {
+    auto *F = builder_.GetInsertBlock()->getParent();
+    if (F->getFnAttribute("mydsl-index-bits").getValueAsString() == "32")
+      return builder_.getInt32Ty();
+    return builder_.getInt64Ty();
+  }
+
+  /// Converts an index, extent or stride to indexType.
+  llvm::Value *toIndex(llvm::Value *value) const {
+    return builder_.CreateSExtOrTrunc(value, indexType());
+  }
+
+  /// Returns false if the tensor has a static shape with more elements than
+  /// indexType can address, true otherwise.
+  bool fitsIndexType() const {
+    std::uint64_t count = 1;
+    for (auto *V : size_) {
+      auto *C = llvm::dyn_cast<llvm::ConstantInt>(V);
+      if (!C)
+        return true;
+      count *= C->getZExtValue();
+    }
+    return llvm::isUIntN(indexType()->getBitWidth() - 1, count);
+  }
+
+  /// Returns the number of elements in the memory of a dense tensor,
+  /// including the padding channels of blocked layouts.
+  Integer numStored() const {
+    if (!isBlocked())
+      return numElements();
+    return {builder_.CreateMul(size_[0], strides_[0], "num_stored",
+                               /*HasNUW=*/false, /*HasNSW=*/true),
+            builder_};
+  }
+
+  /// Scales \a index by the stride of dimension \a d, in indexType.
+  llvm::Value *offset(llvm::Value *index, int d) const {
+    if (d == 1 && isBlocked()) {
+      auto *Block = llvm::ConstantInt::get(indexType(), getLayoutBlock(layout_));
+      auto *Channel = toIndex(index);
+      return builder_.CreateAdd(
+          builder_.CreateMul(builder_.CreateUDiv(Channel, Block),
+                             toIndex(strides_[1]), "offset", /*HasNUW=*/false,
+                             /*HasNSW=*/true),
+          builder_.CreateURem(Channel, Block), "offset", /*HasNUW=*/false,
+          /*HasNSW=*/true);
+    }
+    auto *C = llvm::dyn_cast<llvm::ConstantInt>(strides_[d]);
+    if (C && C->isOne())
+      return toIndex(index);
+    if (C && C->isZero())
+      return llvm::ConstantInt::get(indexType(), 0);
+    return builder_.CreateMul(toIndex(index), toIndex(strides_[d]), "offset",
+                              /*HasNUW=*/false, /*HasNSW=*/true);
+  }
 
 public:
-  using NativeType = typename T::NativeType *;
+  using NativeType = typename ElementTraits<T>::Storage *;
+  using AccumulatorType = typename ElementTraits<T>::Accumulator;
+  static constexpr int rank = Dim;
 
   Tensor(const llvm::SmallVector<Integer, Dim> &size, llvm::Value *data,
          llvm::IRBuilder<> &builder)
-      : size_(size), data_(data), builder_(builder) {}
+      : data_(data), builder_(builder) {
+    for (const auto &i : size)
+      size_.push_back(i.getValue());
+    initStrides();
+  }
 
   Tensor(const llvm::SmallVector<Integer, Dim> &size,
          llvm::IRBuilder<> &builder)
-      : size_(size), builder_(builder) {
+      : builder_(builder) {
+    for (const auto &i : size)
+      size_.push_back(i.getValue());
+    initStrides();
 
     // auto &EntryBB = builder.GetInsertBlock()->getParent()->getEntryBlock();
 
-    Integer totalSize = size[0];
-    for (const auto &i : llvm::drop_begin(size))
-      totalSize *= i;
+    data_ = markTemporary(builder_.CreateAlloca(
+        getScalarType(builder_.getContext()), numElements(), "tensor_data"));
+  }
+
+  /// Views \a data as a dense tensor stored in \a layout.
+  Tensor(const llvm::SmallVector<Integer, Dim> &size, TensorLayout layout,
+         llvm::Value *data, llvm::IRBuilder<> &builder)
+    requires(Dim == 4)
+      : data_(data), builder_(builder) {
+    for (const auto &i : size)
+      size_.push_back(i.getValue());
+    initLayout(layout);
+  }
+
+  /// Creates a tensor stored in \a layout. The padding channels of blocked
+  /// layouts are never read or written by element accesses.
+  Tensor(const llvm::SmallVector<Integer, Dim> &size, TensorLayout layout,
+         llvm::IRBuilder<> &builder)
+    requires(Dim == 4)
+      : builder_(builder) {
+    for (const auto &i : size)
+      size_.push_back(i.getValue());
+    initLayout(layout);
+    data_ = markTemporary(builder_.CreateAlloca(
+        getScalarType(builder_.getContext()), numStored(), "tensor_data"));
+  }
+
+  /// Views \a data as a tensor with the static shape \a extents.
+  template <std::int64_t... N>
+  Tensor(Extents<N...>, llvm::Value *data, llvm::IRBuilder<> &builder)
+    requires(Extents<N...>::rank == Dim)
+      : size_{builder.getInt64(N)...}, data_(data), builder_(builder) {
+    initStrides();
+  }
 
-    data_ = builder_.CreateAlloca(getScalarType(builder_.getContext()),
-                                  totalSize, "tensor_data");
+  /// Creates a tensor with the static shape \a extents. As the size is known,
+  /// the storage is a fixed-size array in the entry block.
+  template <std::int64_t... N>
+  Tensor(Extents<N...>, llvm::IRBuilder<> &builder)
+    requires(Extents<N...>::rank == Dim)
+      : size_{builder.getInt64(N)...}, builder_(builder) {
+    initStrides();
+    auto &EntryBB = builder.GetInsertBlock()->getParent()->getEntryBlock();
+    auto *ArrayTy =
+        llvm::ArrayType::get(getScalarType(builder_.getContext()), (N * ...));
+    data_ = markTemporary(
+        llvm::IRBuilder<>{&EntryBB, EntryBB.getFirstInsertionPt()}.CreateAlloca(
+            ArrayTy, nullptr, "tensor_data"));
+  }
+
+  /**
+   * @brief Creates a read-only tensor with the static shape \a extents from
+   * host data. The values are emitted as a private constant global, so
+   * optimizations can see them as constants.
+   *
+   * @param values The elements in row-major order.
+   * @param extents The shape of the tensor.
+   * @param builder The builder to use for emitting operations.
+   * @return Tensor A view onto the constant global.
+   */
+  template <std::int64_t... N>
+  static Tensor fromConstant(llvm::ArrayRef<typename T::NativeType> values,
+                             Extents<N...> extents, llvm::IRBuilder<> &builder)
+    requires(Extents<N...>::rank == Dim)
+  {
+    assert(values.size() == (N * ...) && "Size mismatch");
+    auto &M = *builder.GetInsertBlock()->getModule();
+    auto *Ty = getScalarType(M.getContext());
+    // the native values are rounded to the element type, e.g. for Half
+    llvm::SmallVector<llvm::Constant *, 16> Elements;
+    for (auto value : values) {
+      if constexpr (std::is_floating_point_v<typename T::NativeType>)
+        Elements.push_back(llvm::ConstantFP::get(Ty, value));
+      else
+        Elements.push_back(llvm::ConstantInt::get(Ty, value));
+    }
+    auto *Init = llvm::ConstantArray::get(
+        llvm::ArrayType::get(Ty, values.size()), Elements);
+    auto *GV = new llvm::GlobalVariable(M, Init->getType(), /*isConstant=*/true,
+                                        llvm::GlobalValue::PrivateLinkage, Init,
+                                        "tensor_const");
+    GV->setUnnamedAddr(llvm::GlobalValue::UnnamedAddr::Global);
+    return {extents, GV, builder};
   }
 
   static llvm::Type *getScalarType(llvm::LLVMContext &Ctx) {
@@ -54,18 +709,232 @@ public:
     return llvm::PointerType::getUnqual(getScalarType(Ctx));
   }
 
-  Tensor<T, Dim - 1> operator[](Integer index)
+  /**
+   * @brief Returns the name of the builtin \a op for tensors of this type,
+   * e.g. `__mydsl_tensor_conv_2_f32` or `__mydsl_tensor_conv_2_bf16`.
+   *
+   * @param op The name of the operation, e.g. "conv".
+   * @param Ctx The context.
+   * @return std::string The name, empty if the builtin library has no variant
+   * for tensors of this element type. Whether it has one for this rank
+   * depends on the operation.
+   */
+  static std::string builtinName(llvm::StringRef op, llvm::LLVMContext &Ctx) {
+    auto *Ty = getScalarType(Ctx);
+    const char *Suffix = Ty->isFloatTy()    ? "f32"
+                         : Ty->isHalfTy()   ? "f16"
+                         : Ty->isBFloatTy() ? "bf16"
+                                            : nullptr;
+    if (!Suffix)
+      return {};
+    return ("__mydsl_tensor_" + op + "_" + llvm::Twine(Dim) + "_" + Suffix)
+        .str();
+  }
+
+  /// Returns true if all extents of the tensor are known at compile time.
+  bool isStatic() const {
+    return llvm::all_of(
+        size_, [](llvm::Value *V) { return llvm::isa<llvm::ConstantInt>(V); });
+  }
+
+  /// Returns the elements of the tensor, rounded to float, if it is a
+  /// constant (see fromConstant) square filter of odd extent, as the 2D
+  /// convolutions expect.
+  std::optional<llvm::SmallVector<float, 16>> getConstantFilter() const {
+    auto *GV = llvm::dyn_cast<llvm::GlobalVariable>(data_);
+    if (Dim != 2 || !contiguous_ || !isStatic() || !GV || !GV->isConstant() ||
+        !GV->hasDefinitiveInitializer())
+      return std::nullopt;
+
+    auto window = llvm::cast<llvm::ConstantInt>(size_[0])->getSExtValue();
+    if (llvm::cast<llvm::ConstantInt>(size_[1])->getSExtValue() != window ||
+        window % 2 == 0)
+      return std::nullopt;
+    llvm::SmallVector<float, 16> Weights;
+    for (std::int64_t k = 0; k < window * window; ++k) {
+      auto *C = llvm::dyn_cast_or_null<llvm::ConstantFP>(
+          GV->getInitializer()->getAggregateElement(k));
+      if (!C)
+        return std::nullopt;
+      llvm::APFloat Value = C->getValueAPF();
+      bool LosesInfo;
+      Value.convert(llvm::APFloat::IEEEsingle(),
+                    llvm::APFloat::rmNearestTiesToEven, &LosesInfo);
+      Weights.push_back(Value.convertToFloat());
+    }
+    return Weights;
+  }
+
+  /**
+   * @brief Returns the factors of a separable filter (see
+   * factorSeparableFilter) if the tensor is a constant (see fromConstant)
+   * square filter of rank 1.
+   */
+  std::optional<llvm::SmallVector<float, 16>> getSeparableFactors() const {
+    auto Weights = getConstantFilter();
+    if (!Weights)
+      return std::nullopt;
+
+    auto window = llvm::cast<llvm::ConstantInt>(size_[0])->getSExtValue();
+    llvm::SmallVector<float, 16> Factors(2 * window);
+    if (!factorSeparableFilter(Weights->data(), window, Factors.data()))
+      return std::nullopt;
+    return Factors;
+  }
+
+  /// Returns the extent of dimension \a d.
+  Integer extent(int d) const { return {size_[d], builder_}; }
+
+  /// Returns the total number of elements of the tensor.
+  Integer numElements() const {
+    llvm::Value *totalSize = size_[0];
+    for (const auto &i : llvm::drop_begin(size_))
+      totalSize = builder_.CreateMul(totalSize, i, "num_elements",
+                                     /*HasNUW=*/false, /*HasNSW=*/true);
+    return {totalSize, builder_};
+  }
+
+  /// Returns true if the tensor is dense and row-major, i.e. not a view
+  /// created by slice, transpose or broadcast.
+  bool isContiguous() const { return contiguous_; }
+
+  /// Returns the layout of a dense 4D tensor, NCHW for views.
+  TensorLayout layout() const { return layout_; }
+
+  /**
+   * @brief Copies the tensor into a new tensor stored in \a layout, or returns
+   * it if it is dense in \a layout already.
+   */
+  Tensor<T, Dim> toLayout(TensorLayout layout) const
+    requires(Dim == 4)
+  {
+    if (layout_ == layout && isDense())
+      return *this;
+    llvm::SmallVector<Integer, Dim> size;
+    for (int d = 0; d < Dim; ++d)
+      size.push_back(extent(d));
+    Tensor<T, Dim> result{size, layout, builder_};
+    result = *this;
+    return result;
+  }
+
+  /**
+   * @brief Creates a view of the elements \a begin to \a end (exclusive) of
+   * dimension \a d. The view shares the memory of this tensor.
+   *
+   * @param d The dimension to slice.
+   * @param begin The first index in the view.
+   * @param end One past the last index in the view.
+   * @return Tensor The view.
+   */
+  Tensor<T, Dim> slice(int d, const Integer &begin, const Integer &end) const {
+    assert(!isBlocked() && "Views of blocked tensors are not supported");
+    auto GEP = builder_.CreateGEP(getScalarType(builder_.getContext()), data_,
+                                  {offset(begin.getValue(), d)}, "tensor_slice",
+                                  /*inbounds=*/true);
+    Tensor<T, Dim> result(size_, strides_, order_, contiguous_ && d == 0, GEP,
+                          builder_);
+    result.size_[d] = (end - begin).getValue();
+    return result;
+  }
+
+  /// Creates a view with the dimensions \a d0 and \a d1 swapped.
+  Tensor<T, Dim> transpose(int d0, int d1) const {
+    assert(!isBlocked() && "Views of blocked tensors are not supported");
+    Tensor<T, Dim> result(*this);
+    if (d0 == d1)
+      return result;
+    result.layout_ = TensorLayout::NCHW;
+    std::swap(result.size_[d0], result.size_[d1]);
+    std::swap(result.strides_[d0], result.strides_[d1]);
+    for (int &d : result.order_)
+      d = d == d0 ? d1 : d == d1 ? d0 : d;
+    result.contiguous_ = false;
+    return result;
+  }
+
+  Tensor<T, Dim> transpose() const
+    requires(Dim == 2)
+  {
+    return transpose(0, 1);
+  }
+
+  /**
+   * @brief Views the elements of this tensor with another shape. Only
+   * contiguous tensors can be reshaped without a copy.
+   *
+   * @param size The new shape, with as many elements as this tensor.
+   * @return Tensor A dense tensor sharing the memory of this tensor.
+   */
+  template <int NewDim>
+  Tensor<T, NewDim>
+  reshape(const llvm::SmallVector<Integer, NewDim> &size) const {
+    assert(contiguous_ && "Only contiguous tensors can be reshaped");
+    return {size, data_, builder_};
+  }
+
+  /**
+   * @brief Repeats dimension \a d, which must have extent 1, \a extent times.
+   * All elements along the dimension alias the same memory (stride 0), so the
+   * view must not be written to.
+   *
+   * @param d The dimension to broadcast.
+   * @param extent The extent of the dimension in the view.
+   * @return Tensor The view.
+   */
+  Tensor<T, Dim> broadcast(int d, const Integer &extent) const {
+    // pre: size_[d] is 1
+    assert(!isBlocked() && "Views of blocked tensors are not supported");
+    Tensor<T, Dim> result(*this);
+    result.layout_ = TensorLayout::NCHW;
+    result.size_[d] = extent.getValue();
+    result.strides_[d] = builder_.getInt64(0);
+    result.contiguous_ = false;
+    return result;
+  }
+
+  /**
+   * @brief Inserts a dimension with static extent 1 before dimension \a d,
+   * like `x[:, None]` in NumPy. Elementwise operations broadcast it.
+   *
+   * @param d The position of the new dimension, at most Dim.
+   * @return Tensor The view.
+   */
+  Tensor<T, Dim + 1> unsqueeze(int d) const {
+    assert(!isBlocked() && "Views of blocked tensors are not supported");
+    llvm::SmallVector<llvm::Value *, Dim + 1> size(size_.begin(), size_.end());
+    llvm::SmallVector<llvm::Value *, Dim + 1> strides(strides_.begin(),
+                                                      strides_.end());
+    size.insert(size.begin() + d, builder_.getInt64(1));
+    strides.insert(strides.begin() + d, builder_.getInt64(0));
+
+    // the new dimension has a single index, it can be walked first
+    llvm::SmallVector<int, Dim + 1> order{d};
+    for (int o : order_)
+      order.push_back(o < d ? o : o + 1);
+
+    return Tensor<T, Dim + 1>(size, strides, order, contiguous_, data_,
+                              builder_);
+  }
+
+  Tensor<T, Dim - 1> operator[](const Integer &index)
     requires(Dim > 1)
   {
-    for (const auto &i : llvm::drop_begin(size_))
-      index *= i;
+    assert(!isBlocked() && "Views of blocked tensors are not supported");
     auto GEP = builder_.CreateGEP(getScalarType(builder_.getContext()), data_,
-                                  {index}, "tensor_index." + llvm::Twine{Dim},
+                                  {offset(index, 0)},
+                                  "tensor_index." + llvm::Twine{Dim},
                                   /*inbounds=*/true);
 
-    llvm::SmallVector<Integer, Dim - 1> newSize(size_.begin() + 1, size_.end());
+    llvm::SmallVector<int, Dim - 1> order;
+    for (int d : order_)
+      if (d != 0)
+        order.push_back(d - 1);
 
-    return Tensor<T, Dim - 1>(newSize, GEP, builder_);
+    return Tensor<T, Dim - 1>(
+        llvm::ArrayRef<llvm::Value *>(size_).drop_front(),
+        llvm::ArrayRef<llvm::Value *>(strides_).drop_front(), order,
+        contiguous_, GEP, builder_);
   }
 
   Tensor<T, Dim - 1> operator[](int index)
@@ -78,7 +947,8 @@ public:
     requires(Dim == 1)
   {
     auto GEP = builder_.CreateGEP(getScalarType(builder_.getContext()), data_,
-                                  {index}, "tensor_index." + llvm::Twine{Dim},
+                                  {offset(index, 0)},
+                                  "tensor_index." + llvm::Twine{Dim},
                                   /*inbounds=*/true);
     return {getScalarType(builder_.getContext()), GEP, builder_};
   }
@@ -115,197 +985,705 @@ public:
     return const_cast<Tensor<T, Dim> *>(this)->operator[](index);
   }
 
+  /**
+   * @brief Loads the \a N elements starting at \a index. Rows with unit
+   * stride are read with a single vector load, other views are gathered.
+   *
+   * @param index The index of the first element.
+   * @return Vec The elements.
+   */
+  template <unsigned N>
+  Vec<T, N> loadVector(const Integer &index) const
+    requires(Dim == 1)
+  {
+    auto *VecTy = Vec<T, N>::getType(builder_.getContext());
+    if (hasUnitStride())
+      return {builder_.CreateAlignedLoad(VecTy, elementPtr({index.getValue()}),
+                                         elementAlign()),
+              builder_};
+    return {builder_.CreateMaskedGather(VecTy, vectorPtrs<N>(index),
+                                        elementAlign()),
+            builder_};
+  }
+
+  /// Loads the lanes of \a mask that are set, the other lanes are zero.
+  template <unsigned N>
+  Vec<T, N> loadVector(const Integer &index, const Mask<N> &mask) const
+    requires(Dim == 1)
+  {
+    auto *VecTy = Vec<T, N>::getType(builder_.getContext());
+    auto *Zero = llvm::Constant::getNullValue(VecTy);
+    if (hasUnitStride())
+      return {builder_.CreateMaskedLoad(VecTy, elementPtr({index.getValue()}),
+                                        elementAlign(), mask.getValue(), Zero),
+              builder_};
+    return {builder_.CreateMaskedGather(VecTy, vectorPtrs<N>(index),
+                                        elementAlign(), mask.getValue(), Zero),
+            builder_};
+  }
+
+  /// Stores \a value to the elements starting at \a index.
+  template <unsigned N>
+  void storeVector(const Integer &index, const Vec<T, N> &value)
+    requires(Dim == 1)
+  {
+    if (hasUnitStride())
+      builder_.CreateAlignedStore(value.getValue(),
+                                  elementPtr({index.getValue()}),
+                                  elementAlign());
+    else
+      builder_.CreateMaskedScatter(value.getValue(), vectorPtrs<N>(index),
+                                   elementAlign());
+  }
+
+  /// Stores the lanes of \a value for which \a mask is set.
+  template <unsigned N>
+  void storeVector(const Integer &index, const Vec<T, N> &value,
+                   const Mask<N> &mask)
+    requires(Dim == 1)
+  {
+    if (hasUnitStride())
+      builder_.CreateMaskedStore(value.getValue(),
+                                 elementPtr({index.getValue()}),
+                                 elementAlign(), mask.getValue());
+    else
+      builder_.CreateMaskedScatter(value.getValue(), vectorPtrs<N>(index),
+                                   elementAlign(), mask.getValue());
+  }
+
   operator llvm::Value *() const { return data_; }
 
 private:
-  template <class F>
-  void elementwiseOp(Tensor<T, Dim> &dest, const Tensor<T, Dim> &other,
-                     F &&f) const {
+  /// Loads the element at position \a index of the flattened tensor. Views
+  /// split the index into one index per dimension.
+  T element(const Integer &index) const {
+    auto *Ty = getScalarType(builder_.getContext());
+    if (!contiguous_) {
+      llvm::SmallVector<llvm::Value *, Dim> indices(Dim);
+      llvm::Value *rest = toIndex(index.getValue());
+      for (int d = Dim - 1; d > 0; --d) {
+        indices[d] = builder_.CreateURem(rest, toIndex(size_[d]));
+        rest = builder_.CreateUDiv(rest, toIndex(size_[d]));
+      }
+      indices[0] = rest;
+      return {builder_.CreateLoad(Ty, elementPtr(indices)), builder_};
+    }
+    auto GEP = builder_.CreateGEP(Ty, data_, {index}, "tensor_flat_index",
+                                  /*inbounds=*/true);
+    return {builder_.CreateLoad(Ty, GEP), builder_};
+  }
+
+  bool hasUnitStride() const {
+    auto *C = llvm::dyn_cast<llvm::ConstantInt>(strides_[Dim - 1]);
+    return C && C->isOne();
+  }
+
+  llvm::Align elementAlign() const {
+    return llvm::Align(
+        getScalarType(builder_.getContext())->getScalarSizeInBits() / 8);
+  }
+
+  /// Returns the pointers to the \a N elements starting at \a index of the
+  /// innermost dimension.
+  template <unsigned N>
+  llvm::Value *vectorPtrs(const Integer &index) const
+    requires(Dim == 1)
+  {
+    llvm::SmallVector<llvm::Constant *, N> lanes;
+    for (unsigned lane = 0; lane < N; ++lane)
+      lanes.push_back(llvm::ConstantInt::get(indexType(), lane));
+    llvm::Value *Offsets = builder_.CreateMul(
+        llvm::ConstantVector::get(lanes),
+        builder_.CreateVectorSplat(N, toIndex(strides_[0])), "lane_offsets",
+        /*HasNUW=*/false, /*HasNSW=*/true);
+    return builder_.CreateGEP(getScalarType(builder_.getContext()),
+                              elementPtr({index.getValue()}), {Offsets},
+                              "lane_ptrs", /*inbounds=*/true);
+  }
+
+  /// Returns a pointer to the element at the multi-dimensional \a index. The
+  /// offset is computed in indexType, the GEP sign-extends it.
+  llvm::Value *elementPtr(llvm::ArrayRef<llvm::Value *> index) const {
+    llvm::Value *Offset = offset(index[0], 0);
+    for (int d = 1; d < Dim; ++d)
+      Offset = builder_.CreateAdd(Offset, offset(index[d], d), "offset",
+                                  /*HasNUW=*/false, /*HasNSW=*/true);
+    return builder_.CreateGEP(getScalarType(builder_.getContext()), data_,
+                              {Offset}, "tensor_elem", /*inbounds=*/true);
+  }
+
+  /// Evaluates \a expr for all elements in a single loop nest and stores the
+  /// results into this tensor. The loops follow the memory order of this
+  /// tensor, so the innermost loop walks its smallest stride.
+  ///
+  /// An expression that reads this tensor at other elements than the ones
+  /// written, e.g. `A = A.transpose()`, is evaluated into a temporary first.
+  /// Views of the memory at other base pointers, e.g. slices, are not
+  /// detected.
+  void assign(const TensorExpr<T, Dim> &expr) {
+    // pre: size_ and expr.size_ are equiv
+    if (llvm::any_of(expr.loads_, [&](const TensorLoad &load) {
+          return load.data == data_ && !llvm::equal(load.strides, strides_);
+        })) {
+      Tensor<T, Dim> copy{expr};
+      assign(copy.expr());
+      return;
+    }
+    if (isDense() && expr.flat_ && expr.layout_ == layout_) {
+      assignFlat(expr);
+      return;
+    }
+
     ControlFlow CF(builder_);
+    llvm::SmallVector<llvm::Value *, Dim> index(Dim);
+    // the counters have indexType, they can only be compared and incremented
+    auto *IndexTy = indexType();
 
-    if constexpr (Dim == 1) {
+    std::function<void(int)> emitLoop = [&](int level) {
+      if (level == Dim) {
+        builder_.CreateStore(expr.eval_(index).getValue(), elementPtr(index));
+        return;
+      }
+      const int d = order_[level];
+      Integer end{toIndex(size_[d]), builder_};
       CF.For(
-          Integer{0, builder_}, [&](Integer i) { return i < size_[0]; },
-          [&](Integer i) { return i + 1; },
+          Integer{llvm::ConstantInt::get(IndexTy, 0), builder_},
+          [&](Integer i) { return i < end; },
           [&](Integer i) {
-            dest[i] = std::forward<F>(f)((*this)[i], other[i]);
-          });
-    } else {
-      CF.For(
-          Integer{0, builder_}, [&](Integer i) { return i < size_[0]; },
-          [&](Integer i) { return i + 1; },
+            return Integer{
+                builder_.CreateAdd(i.getValue(),
+                                   llvm::ConstantInt::get(IndexTy, 1), "",
+                                   /*HasNUW=*/false, /*HasNSW=*/true),
+                builder_};
+          },
           [&](Integer i) {
-            Tensor<T, Dim - 1> dst(dest[i]);
-            (*this)[i].elementwiseOp(dst, other[i], std::forward<F>(f));
+            index[d] = i.getValue();
+            emitLoop(level + 1);
           });
+    };
+    emitLoop(0);
+  }
+
+  /// Elements per iteration of the main loop of assignFlat. The body is
+  /// unrolled that many times, which the SLP vectorizer turns into vector
+  /// code without runtime checks on the trip count.
+  static constexpr Integer::NativeType FlatUnroll = 8;
+
+  /// Evaluates \a expr in a single loop over the flattened tensor. All
+  /// operands share the dense layout of this tensor, so the element at a flat
+  /// index is the same for all of them. The padding channels of blocked
+  /// layouts are computed as well.
+  void assignFlat(const TensorExpr<T, Dim> &expr) {
+    if (unsigned lanes = vectorLanes(); lanes && expr.vector_) {
+      assignVector(expr, lanes);
+      return;
     }
+
+    ControlFlow CF(builder_);
+    auto *Ty = getScalarType(builder_.getContext());
+    auto store = [&](const Integer &index) {
+      auto GEP = builder_.CreateGEP(Ty, data_, {index}, "tensor_flat_index",
+                                    /*inbounds=*/true);
+      builder_.CreateStore(expr.flat_(index).getValue(), GEP);
+    };
+
+    Integer end = numStored();
+    Integer mainEnd = end - end % FlatUnroll;
+    CF.For(
+        Integer{0, builder_}, [&](Integer i) { return i < mainEnd; },
+        [&](Integer i) { return i + FlatUnroll; },
+        [&](Integer i) {
+          for (Integer::NativeType lane = 0; lane < FlatUnroll; ++lane)
+            store(i + lane);
+        });
+
+    // remainder
+    CF.For(
+        mainEnd, [&](Integer i) { return i < end; },
+        [&](Integer i) { return i + 1; }, [&](Integer i) { store(i); });
   }
+  /// Maximum number of lanes of the vectors emitted by assignVector.
+  static constexpr unsigned MaxLanes = 16;
 
-  template <class F>
-  void elementwiseOp(Tensor<T, Dim> &dest, const T &other, F &&f) const {
+  /// Returns the number of lanes for explicitly vectorized loops in the
+  /// current kernel, or 0 if vectorizeTensorOps was not used.
+  unsigned vectorLanes() const {
+    auto *F = builder_.GetInsertBlock()->getParent();
+    unsigned bits = 0;
+    if (!F->hasFnAttribute("mydsl-vector-bits") ||
+        F->getFnAttribute("mydsl-vector-bits")
+            .getValueAsString()
+            .getAsInteger(10, bits))
+      return 0;
+    unsigned lanes = std::min(
+        bits / getScalarType(builder_.getContext())->getScalarSizeInBits(),
+        MaxLanes);
+    return lanes >= 2 ? std::bit_floor(lanes) : 0;
+  }
+
+  /// Loads \a lanes elements starting at position \a index of the flattened
+  /// tensor, only the lanes set in \a mask if it is not null.
+  llvm::Value *loadLanes(const Integer &index, unsigned lanes,
+                         llvm::Value *mask) const {
+    auto *Ty = getScalarType(builder_.getContext());
+    auto *VecTy = llvm::FixedVectorType::get(Ty, lanes);
+    auto GEP = builder_.CreateGEP(Ty, data_, {index}, "tensor_flat_index",
+                                  /*inbounds=*/true);
+    if (mask)
+      return builder_.CreateMaskedLoad(VecTy, GEP, elementAlign(), mask,
+                                       llvm::Constant::getNullValue(VecTy));
+    return builder_.CreateAlignedLoad(VecTy, GEP, elementAlign());
+  }
+
+  /**
+   * @brief Evaluates \a expr in a single loop over the flattened tensor that
+   * computes \a lanes elements per iteration with vector instructions. The
+   * remaining elements are computed according to the tail policy of the
+   * kernel, see vectorizeTensorOps.
+   */
+  void assignVector(const TensorExpr<T, Dim> &expr, unsigned lanes) {
     ControlFlow CF(builder_);
+    auto *Ty = getScalarType(builder_.getContext());
+    auto *F = builder_.GetInsertBlock()->getParent();
+    // inactive lanes compute on zeros, which would trap for integer division
+    const bool masked =
+        F->getFnAttribute("mydsl-vector-tail").getValueAsString() ==
+            "masked" &&
+        Ty->isFloatingPointTy();
 
-    if constexpr (Dim == 1) {
-      CF.For(
-          Integer{0, builder_}, [&](Integer i) { return i < size_[0]; },
-          [&](Integer i) { return i + 1; },
-          [&](Integer i) { dest[i] = std::forward<F>(f)((*this)[i], other); });
-    } else {
-      CF.For(
-          Integer{0, builder_}, [&](Integer i) { return i < size_[0]; },
-          [&](Integer i) { return i + 1; },
-          [&](Integer i) {
-            Tensor<T, Dim - 1> dst(dest[i]);
-            (*this)[i].elementwiseOp(dst, other, std::forward<F>(f));
-          });
+    Integer end = numStored();
+    Integer mainEnd = end - end % static_cast<Integer::NativeType>(lanes);
+    CF.For(
+        Integer{0, builder_}, [&](Integer i) { return i < mainEnd; },
+        [&](Integer i) { return i + static_cast<Integer::NativeType>(lanes); },
+        [&](Integer i) {
+          auto GEP = builder_.CreateGEP(Ty, data_, {i}, "tensor_flat_index",
+                                        /*inbounds=*/true);
+          builder_.CreateAlignedStore(expr.vector_(i, lanes, nullptr), GEP,
+                                      elementAlign());
+        });
+
+    if (masked) {
+      CF.If(mainEnd < end, [&] {
+        llvm::Value *mask = withLanes(lanes, [&]<unsigned N>() {
+          return Mask<N>::activeLanes(mainEnd, end, builder_).getValue();
+        });
+        auto GEP = builder_.CreateGEP(Ty, data_, {mainEnd}, "tensor_flat_index",
+                                      /*inbounds=*/true);
+        builder_.CreateMaskedStore(expr.vector_(mainEnd, lanes, mask), GEP,
+                                   elementAlign(), mask);
+      });
+      return;
     }
+
+    // remainder
+    CF.For(
+        mainEnd, [&](Integer i) { return i < end; },
+        [&](Integer i) { return i + 1; },
+        [&](Integer i) {
+          auto GEP = builder_.CreateGEP(Ty, data_, {i}, "tensor_flat_index",
+                                        /*inbounds=*/true);
+          builder_.CreateStore(expr.flat_(i).getValue(), GEP);
+        });
+  }
+
+  /// Returns the padding before and after the spatial dimension \a d (2 or
+  /// 3) of this NCHW tensor for a filter of extent \a window.
+  std::pair<Integer, Integer> convPadding(int d, const Integer &window,
+                                          const Conv2dOptions &options) const
+    requires(Dim == 4)
+  {
+    const int axis = d - 2;
+    switch (options.padding) {
+    case ConvPadding::Valid:
+      return {Integer{0, builder_}, Integer{0, builder_}};
+    case ConvPadding::Explicit:
+      return {Integer{builder_.getInt64(options.padBegin[axis]), builder_},
+              Integer{builder_.getInt64(options.padEnd[axis]), builder_}};
+    case ConvPadding::Same: {
+      const auto stride = options.stride[axis];
+      Integer input = extent(d);
+      Integer output = (input + (stride - 1)) / stride;
+      Integer span = (window - 1) * options.dilation[axis] + 1;
+      Integer total{builder_.CreateBinaryIntrinsic(
+                        llvm::Intrinsic::smax,
+                        ((output - 1) * stride + span - input).getValue(),
+                        builder_.getInt64(0)),
+                    builder_};
+      Integer begin = total / 2;
+      return {begin, total - begin};
+    }
+    }
+    llvm_unreachable("Unknown padding");
+  }
+
+  /**
+   * @brief Calls the builtin `elementwise_<op>` (see builtinName), which
+   * computes a post-op of convolutions and products in place on the memory
+   * of this tensor. FuseTensorOpsPass folds these calls into the output
+   * write of the producer.
+   *
+   * @param operands The arguments after the tensor and before the number of
+   * stored elements.
+   * @param trailing The arguments after the number of stored elements.
+   * @return bool False if there is no builtin for this tensor, the caller
+   * then evaluates an expression instead.
+   */
+  bool callElementwiseBuiltin(llvm::StringRef op,
+                              llvm::ArrayRef<llvm::Value *> operands,
+                              llvm::ArrayRef<llvm::Value *> trailing = {}) {
+#ifndef NO_TENSOR_OP_FUSION
+    auto &M = *builder_.GetInsertBlock()->getModule();
+    auto Name = builtinName(("elementwise_" + op).str(), M.getContext());
+    if ((Dim != 2 && Dim != 4) || !isDense() || Name.empty())
+      return false;
+
+    llvm::SmallVector<llvm::Value *, 8> Args{data_, data_};
+    Args.append(operands.begin(), operands.end());
+    Args.push_back(numStored().getValue());
+    Args.append(trailing.begin(), trailing.end());
+    llvm::SmallVector<llvm::Type *, 8> ArgTys;
+    for (auto *Arg : Args)
+      ArgTys.push_back(Arg->getType());
+    auto FC = M.getOrInsertFunction(
+        Name, llvm::FunctionType::get(builder_.getVoidTy(), ArgTys, false));
+    builder_.CreateCall(FC, Args);
+    return true;
+#else
+    return false;
+#endif
   }
 
 public:
-  Tensor<T, Dim> operator*(const Tensor<T, Dim> &other) const
-    requires(Multiplicable<T, T>)
+  /// Materializes \a expr into a new dense tensor.
+  Tensor(const TensorExpr<T, Dim> &expr)
+      : Tensor(expr.size_, {}, {}, /*contiguous=*/true, nullptr,
+               expr.builder_) {
+    initStrides();
+    data_ = markTemporary(builder_.CreateAlloca(
+        getScalarType(builder_.getContext()), numElements(), "tensor_data"));
+    assign(expr);
+  }
+
+  /// Evaluates \a other, broadcast to the shape of this tensor, into the
+  /// storage of this tensor.
+  template <TensorOperand<T> U>
+  Tensor<T, Dim> &operator=(const U &other)
+    requires(U::rank <= Dim)
   {
-    Tensor<T, Dim> result(size_, builder_);
-    elementwiseOp(result, other,
-                  [](const auto &a, const auto &b) { return a * b; });
+    assign(other.expr().template broadcastTo<Dim>(size_));
+    return *this;
+  }
+
+  /// Copies the elements of \a other, copying the Tensor object itself only
+  /// creates another view of the same memory.
+  Tensor<T, Dim> &operator=(const Tensor<T, Dim> &other) {
+    assign(other.expr());
+    return *this;
+  }
+
+  /// Lifts the tensor into an expression that loads its elements.
+  TensorExpr<T, Dim> expr() const {
+    TensorExpr<T, Dim> result{
+        size_,
+        [tensor = *this](llvm::ArrayRef<llvm::Value *> index) -> T {
+          auto *Ty = getScalarType(tensor.builder_.getContext());
+          return {tensor.builder_.CreateLoad(Ty, tensor.elementPtr(index)),
+                  tensor.builder_};
+        },
+        builder_};
+    result.loads_.push_back({data_, {strides_.begin(), strides_.end()}});
+    if (contiguous_) {
+      result.flat_ = [tensor = *this](const Integer &index) {
+        return tensor.element(index);
+      };
+    } else if (isDense() &&
+               (!isBlocked() ||
+                getScalarType(builder_.getContext())->isFloatingPointTy())) {
+      // the flat index is the position in memory, the padding channels of
+      // blocked layouts are unspecified and must not trap, e.g. in integer
+      // divisions
+      result.flat_ = [tensor = *this](const Integer &index) -> T {
+        auto *Ty = getScalarType(tensor.builder_.getContext());
+        auto GEP = tensor.builder_.CreateGEP(Ty, tensor.data_, {index},
+                                             "tensor_flat_index",
+                                             /*inbounds=*/true);
+        return {tensor.builder_.CreateLoad(Ty, GEP), tensor.builder_};
+      };
+    }
+    if (result.flat_) {
+      result.layout_ = layout_;
+      result.vector_ = [tensor = *this](const Integer &index, unsigned lanes,
+                                        llvm::Value *mask) {
+        return tensor.loadLanes(index, lanes, mask);
+      };
+    }
     return result;
   }
 
-  Tensor<T, Dim> operator*(const T &other) const
+  template <TensorOperand<T> U>
+  TensorExpr<T, std::max(Dim, U::rank)> operator*(const U &other) const
     requires(Multiplicable<T, T>)
   {
-    Tensor<T, Dim> result(size_, builder_);
-    elementwiseOp(result, other,
-                  [](const auto &a, const auto &b) { return a * b; });
-    return result;
+    return expr() * other;
   }
 
-  Tensor<T, Dim> operator/(const Tensor<T, Dim> &other) const
+  TensorExpr<T, Dim> operator*(const T &other) const
+    requires(Multiplicable<T, T>)
+  {
+    return expr() * other;
+  }
+
+  template <TensorOperand<T> U>
+  TensorExpr<T, std::max(Dim, U::rank)> operator/(const U &other) const
     requires(Divisible<T, T>)
   {
-    Tensor<T, Dim> result(size_, builder_);
-    elementwiseOp(result, other,
-                  [](const auto &a, const auto &b) { return a / b; });
-    return result;
+    return expr() / other;
   }
 
-  Tensor<T, Dim> operator/(const T &other) const
+  TensorExpr<T, Dim> operator/(const T &other) const
     requires(Divisible<T, T>)
   {
-    Tensor<T, Dim> result(size_, builder_);
-    elementwiseOp(result, other,
-                  [](const auto &a, const auto &b) { return a / b; });
-    return result;
+    return expr() / other;
   }
 
-  Tensor<T, Dim> operator+(const Tensor<T, Dim> &other) const
+  template <TensorOperand<T> U>
+  TensorExpr<T, std::max(Dim, U::rank)> operator+(const U &other) const
     requires(Addable<T, T>)
   {
-    Tensor<T, Dim> result(size_, builder_);
-    elementwiseOp(result, other,
-                  [](const auto &a, const auto &b) { return a + b; });
-    return result;
+    return expr() + other;
   }
 
-  Tensor<T, Dim> operator+(const T &other) const
+  TensorExpr<T, Dim> operator+(const T &other) const
     requires(Addable<T, T>)
   {
-    Tensor<T, Dim> result(size_, builder_);
-    elementwiseOp(result, other,
-                  [](const auto &a, const auto &b) { return a + b; });
-    return result;
+    return expr() + other;
   }
 
-  Tensor<T, Dim> operator-(const Tensor<T, Dim> &other) const
+  template <TensorOperand<T> U>
+  TensorExpr<T, std::max(Dim, U::rank)> operator-(const U &other) const
     requires(Subtractable<T, T>)
   {
-    Tensor<T, Dim> result(size_, builder_);
-    elementwiseOp(result, other,
-                  [](const auto &a, const auto &b) { return a - b; });
-    return result;
+    return expr() - other;
   }
 
-  Tensor<T, Dim> operator-(const T &other) const
+  TensorExpr<T, Dim> operator-(const T &other) const
     requires(Subtractable<T, T>)
   {
-    Tensor<T, Dim> result(size_, builder_);
-    elementwiseOp(result, other,
-                  [](const auto &a, const auto &b) { return a - b; });
-    return result;
+    return expr() - other;
   }
 
   Tensor<T, Dim> &operator*=(const Tensor<T, Dim> &other)
     requires(Multiplicable<T, T>)
   {
-#ifdef NO_TENSOR_OP_FUSION
-    elementwiseOp(*this, other,
-                  [](const auto &a, const auto &b) { return a * b; });
-#else
+#ifndef NO_TENSOR_OP_FUSION
+    // the builtin expects dense 2D operands of the same shape, which need
+    // not be square
     auto &M = *builder_.GetInsertBlock()->getModule();
-    auto FC = M.getOrInsertFunction(
-        "__mydsl_tensor_elementwise_mul_2_f32", builder_.getVoidTy(),
-        getType(M.getContext()), getType(M.getContext()),
-        getType(M.getContext()), Integer::getType(M.getContext()));
+    auto Name = builtinName("elementwise_mul", M.getContext());
+    if (Dim == 2 && contiguous_ && other.contiguous_ && !Name.empty()) {
+      auto FC = M.getOrInsertFunction(
+          Name, builder_.getVoidTy(), getType(M.getContext()),
+          getType(M.getContext()), getType(M.getContext()),
+          Integer::getType(M.getContext()));
 
-    builder_.CreateCall(FC, {data_, data_, other.data_, size_[0]});
+      builder_.CreateCall(
+          FC, {data_, data_, other.data_, numElements().getValue()});
+      return *this;
+    }
 #endif
-    return *this;
+    return *this = expr() * other;
+  }
+
+  // The compound operators evaluate in place: every element of this tensor is
+  // read before it is written, at the same index. The other operand is
+  // broadcast to the shape of this tensor.
+
+  template <TensorOperand<T> U>
+  Tensor<T, Dim> &operator*=(const U &other)
+    requires(Multiplicable<T, T> && U::rank <= Dim)
+  {
+    return *this = expr() * other;
   }
 
   Tensor<T, Dim> &operator*=(const T &other)
     requires(Multiplicable<T, T>)
   {
-    elementwiseOp(*this, other,
-                  [](const auto &a, const auto &b) { return a * b; });
-    return *this;
+    // the scale post-op of convolutions and products
+    if constexpr (std::is_same_v<AccumulatorType, Float>) {
+      if (callElementwiseBuiltin(
+              "scale", {ElementTraits<T>::extend(other).getValue()}))
+        return *this;
+    }
+    return *this = expr() * other;
   }
 
-  Tensor<T, Dim> &operator/=(const Tensor<T, Dim> &other)
-    requires(Divisible<T, T>)
+  template <TensorOperand<T> U>
+  Tensor<T, Dim> &operator/=(const U &other)
+    requires(Divisible<T, T> && U::rank <= Dim)
   {
-    elementwiseOp(*this, other,
-                  [](const auto &a, const auto &b) { return a / b; });
-    return *this;
+    return *this = expr() / other;
   }
 
   Tensor<T, Dim> &operator/=(const T &other)
     requires(Divisible<T, T>)
   {
-    elementwiseOp(*this, other,
-                  [](const auto &a, const auto &b) { return a / b; });
-    return *this;
+    return *this = expr() / other;
   }
 
-  Tensor<T, Dim> &operator+=(const Tensor<T, Dim> &other)
-    requires(Addable<T, T>)
+  template <TensorOperand<T> U>
+  Tensor<T, Dim> &operator+=(const U &other)
+    requires(Addable<T, T> && U::rank <= Dim)
   {
-    elementwiseOp(*this, other,
-                  [](const auto &a, const auto &b) { return a + b; });
-    return *this;
+    return *this = expr() + other;
   }
 
   Tensor<T, Dim> &operator+=(const T &other)
     requires(Addable<T, T>)
   {
-    elementwiseOp(*this, other,
-                  [](const auto &a, const auto &b) { return a + b; });
-    return *this;
+    return *this = expr() + other;
   }
 
-  Tensor<T, Dim> &operator-=(const Tensor<T, Dim> &other)
-    requires(Subtractable<T, T>)
+  template <TensorOperand<T> U>
+  Tensor<T, Dim> &operator-=(const U &other)
+    requires(Subtractable<T, T> && U::rank <= Dim)
   {
-    elementwiseOp(*this, other,
-                  [](const auto &a, const auto &b) { return a - b; });
-    return *this;
+    return *this = expr() - other;
   }
 
   Tensor<T, Dim> &operator-=(const T &other)
     requires(Subtractable<T, T>)
   {
-    elementwiseOp(*this, other,
-                  [](const auto &a, const auto &b) { return a - b; });
-    return *this;
+    return *this = expr() - other;
+  }
+
+  // The post-ops of convolutions and products, which FuseTensorOpsPass
+  // applies before the result of the producer is stored, along with
+  // multiplying by a scalar.
+
+  /**
+   * @brief Adds `bias[c]` to the elements of channel c, in place. The
+   * channels are dimension 1: the columns of matrices and the channels of 4D
+   * tensors in all layouts.
+   *
+   * @param bias One element per channel.
+   */
+  Tensor<T, Dim> &addBias(const Tensor<T, 1> &bias)
+    requires(Addable<T, T> && (Dim == 2 || Dim == 4))
+  {
+    // pre: bias.size_[0] and size_[1] are equiv
+    if (bias.contiguous_) {
+      // the elements of a channel, see getEpilogueChannel
+      llvm::Value *Inner = builder_.getInt64(1);
+      Integer::NativeType Block = 1;
+      if constexpr (Dim == 4) {
+        if (layout_ == TensorLayout::NCHW) {
+          Inner = (extent(2) * extent(3)).getValue();
+        } else if (isBlocked()) {
+          Block = getLayoutBlock(layout_);
+          Inner = (extent(2) * extent(3) * Block).getValue();
+        }
+      }
+      if (callElementwiseBuiltin("bias", {bias.data_},
+                                 {size_[1], Inner, builder_.getInt64(Block)}))
+        return *this;
+    }
+    if constexpr (Dim == 2)
+      return *this = expr() + bias;
+    else
+      return *this = expr() + bias.unsqueeze(1).unsqueeze(2);
+  }
+
+  /// Replaces the negative elements by 0, in place.
+  Tensor<T, Dim> &relu()
+    requires(PartiallyOrdered<T, T>)
+  {
+    if (callElementwiseBuiltin("relu", {}))
+      return *this;
+    T zero{typename T::NativeType{}, builder_};
+    return *this = expr().template map<T>(
+               [zero, &builder = builder_](const T &x) -> T {
+                 return {builder.CreateSelect((x < zero).getValue(),
+                                              zero.getValue(), x.getValue()),
+                         builder};
+               });
+  }
+
+  /// Clamps the elements to [\a lower, \a upper], in place.
+  Tensor<T, Dim> &clamp(const T &lower, const T &upper)
+    requires(PartiallyOrdered<T, T>)
+  {
+    if constexpr (std::is_same_v<AccumulatorType, Float>) {
+      if (callElementwiseBuiltin(
+              "clamp", {ElementTraits<T>::extend(lower).getValue(),
+                        ElementTraits<T>::extend(upper).getValue()}))
+        return *this;
+    }
+    return *this = expr().template map<T>(
+               [lower, upper, &builder = builder_](const T &x) -> T {
+                 auto *Low = builder.CreateSelect((x < lower).getValue(),
+                                                  lower.getValue(),
+                                                  x.getValue());
+                 return {builder.CreateSelect((x > upper).getValue(),
+                                              upper.getValue(), Low),
+                         builder};
+               });
+  }
+
+  /**
+   * @brief Reduces all elements of the tensor with the given operator.
+   * The operator is treated as associative, see ControlFlow::Reduce. The
+   * elements are accumulated in AccumulatorType, e.g. Float for Half.
+   *
+   * @param Kind The reduction operator.
+   * @return AccumulatorType The reduced value.
+   */
+  AccumulatorType reduce(ReduceKind Kind) const {
+    ControlFlow CF(builder_);
+    return CF.Reduce<AccumulatorType>(
+        Kind, Integer{0, builder_}, numElements(),
+        [&](const Integer &i) -> AccumulatorType {
+          return ElementTraits<T>::extend(element(i));
+        });
+  }
+
+  AccumulatorType sum() const
+    requires(Addable<T, T>)
+  {
+    return reduce(ReduceKind::Add);
+  }
+
+  AccumulatorType min() const
+    requires(PartiallyOrdered<T, T>)
+  {
+    return reduce(ReduceKind::Min);
+  }
+
+  AccumulatorType max() const
+    requires(PartiallyOrdered<T, T>)
+  {
+    return reduce(ReduceKind::Max);
+  }
+
+  /**
+   * @brief Computes the sum of the elementwise products with \a other without
+   * materializing the products. The squared norm is `t.dot(t)`.
+   *
+   * @param other The other tensor, of the same shape.
+   * @return AccumulatorType The dot product, the products are computed in
+   * AccumulatorType as well.
+   */
+  AccumulatorType dot(const Tensor<T, Dim> &other) const
+    requires(Multiplicable<T, T> && Addable<T, T>)
+  {
+    // pre: size_ and other.size_ are equiv
+    ControlFlow CF(builder_);
+    return CF.Reduce<AccumulatorType>(
+        ReduceKind::Add, Integer{0, builder_}, numElements(),
+        [&](const Integer &i) -> AccumulatorType {
+          return ElementTraits<T>::extend(element(i)) *
+                 ElementTraits<T>::extend(other.element(i));
+        });
   }
 
   void conv2d(Tensor<T, Dim> &dest, const Tensor<T, Dim> &filter) const
@@ -315,15 +1693,162 @@ public:
     //      filter.size_[0] and filter.size_[1] are equiv and odd
 
     auto &M = *builder_.GetInsertBlock()->getModule();
+    auto *PtrTy = getType(M.getContext());
+    auto *IntTy = Integer::getType(M.getContext());
+
+    // the builtins accumulate in f32 for all element types
+    if (dest.contiguous_ && contiguous_ && filter.contiguous_) {
+      // the builtin selects the algorithm by the cost model at run time,
+      // static shapes select it now. Constant separable filters are factored
+      // now and use two 1D passes, unless the shapes are static and the cost
+      // model prefers another algorithm. Constant filters with few nonzero
+      // elements use the direct convolution, whose window FuseTensorOpsPass
+      // unrolls, also when it reads its input through fused elementwise ops.
+      auto Factors = filter.getSeparableFactors();
+      auto Weights = filter.getConstantFilter();
+      std::optional<ConvAlgorithm> Algorithm;
+      if (Weights &&
+          isUnrolledFilter(Weights->data(),
+                           llvm::cast<llvm::ConstantInt>(filter.size_[0])
+                               ->getSExtValue(),
+                           Factors.has_value()))
+        Algorithm = ConvAlgorithm::Direct;
+      else if (isStatic() && filter.isStatic())
+        Algorithm = selectConvAlgorithm(
+            llvm::cast<llvm::ConstantInt>(size_[0])->getSExtValue(),
+            llvm::cast<llvm::ConstantInt>(filter.size_[0])->getSExtValue(),
+            Factors.has_value());
+      else if (Factors)
+        Algorithm = ConvAlgorithm::Separable;
+
+      std::string Op = "conv";
+      if (Algorithm)
+        Op += std::string("_") + getConvAlgorithmName(*Algorithm);
+      llvm::Value *Filter = filter.data_;
+      if (Algorithm == ConvAlgorithm::Separable) {
+        auto *Init = llvm::ConstantDataArray::get(M.getContext(), *Factors);
+        auto *GV = new llvm::GlobalVariable(
+            M, Init->getType(), /*isConstant=*/true,
+            llvm::GlobalValue::PrivateLinkage, Init, "conv_factors");
+        GV->setUnnamedAddr(llvm::GlobalValue::UnnamedAddr::Global);
+        Filter = GV;
+      }
+      auto Name = builtinName(Op, M.getContext());
+      assert(!Name.empty() && "No convolution for this element type");
+      auto FC = M.getOrInsertFunction(Name, builder_.getVoidTy(), PtrTy, PtrTy,
+                                      PtrTy, IntTy, IntTy);
+
+      builder_.CreateCall(
+          FC, {dest.data_, data_, Filter, size_[0], filter.size_[0]});
+      return;
+    }
+
+    // views are passed with their strides
+    auto Name = builtinName("conv_strided", M.getContext());
+    assert(!Name.empty() && "No convolution for this element type");
+    auto FC = M.getOrInsertFunction(Name, builder_.getVoidTy(), PtrTy, IntTy,
+                                    IntTy, PtrTy, IntTy, IntTy, PtrTy, IntTy,
+                                    IntTy, IntTy, IntTy);
+
+    builder_.CreateCall(
+        FC, {dest.data_, dest.strides_[0], dest.strides_[1], data_,
+             strides_[0], strides_[1], filter.data_, filter.strides_[0],
+             filter.strides_[1], size_[0], filter.size_[0]});
+  }
+
+  /**
+   * @brief Returns the shape of the convolution of this NCHW tensor with the
+   * OIHW \a filter, see conv2d: batch, output channels, height and width.
+   */
+  llvm::SmallVector<Integer, Dim>
+  conv2dShape(const Tensor<T, Dim> &filter,
+              const Conv2dOptions &options = {}) const
+    requires(Dim == 4)
+  {
+    llvm::SmallVector<Integer, Dim> shape{extent(0), filter.extent(0)};
+    for (int d = 2; d < 4; ++d) {
+      auto [begin, end] = convPadding(d, filter.extent(d), options);
+      const auto stride = options.stride[d - 2];
+      Integer span = (filter.extent(d) - 1) * options.dilation[d - 2] + 1;
+      // no outputs if the padded input is smaller than the dilated window,
+      // the division truncates towards zero
+      Integer steps{builder_.CreateBinaryIntrinsic(
+                        llvm::Intrinsic::smax,
+                        (extent(d) + begin + end - span + stride).getValue(),
+                        builder_.getInt64(0)),
+                    builder_};
+      shape.push_back(steps / stride);
+    }
+    return shape;
+  }
+
+  /**
+   * @brief Convolves this NCHW tensor (batch, channels, height, width) with
+   * the OIHW \a filter (output channels, input channels, height, width):
+   * `dest[n][o][y][x]` is the sum of `input[n][c][y * stride + u * dilation -
+   * padBegin][x * ...] * filter[o][c][u][v]` over c, u and v, with zeros
+   * outside the input.
+   *
+   * The builtin computes blocks of output channels as the lanes of a vector,
+   * so every input element is loaded once per block and multiplied with a
+   * contiguous vector of weights. It accumulates in f32 for all element
+   * types. There is one builtin per layout of the input (see TensorLayout),
+   * dest is computed in the same layout. In NHWC and the blocked layouts the
+   * channels of an output block are one contiguous store.
+   *
+   * @param dest The result, of the shape conv2dShape.
+   * @param filter The filter, with as many input channels as this tensor.
+   * @param options Stride, dilation and padding.
+   */
+  void conv2d(Tensor<T, Dim> &dest, const Tensor<T, Dim> &filter,
+              const Conv2dOptions &options = {}) const
+    requires(Multiplicable<T, T> && Addable<T, T> && Dim == 4)
+  {
+    // pre: size_[1] and filter.size_[1] are equiv
+    assert(llvm::all_of(options.stride, [](auto s) { return s > 0; }) &&
+           llvm::all_of(options.dilation, [](auto d) { return d > 0; }) &&
+           "Strides and dilations must be positive");
 
+    // the builtins expect dense operands, the input and dest in the same
+    // layout and the filter in NCHW (OIHW), other operands are copied
+    if (!isDense()) {
+      Tensor<T, Dim>{expr()}.conv2d(dest, filter, options);
+      return;
+    }
+    if (!filter.contiguous_) {
+      conv2d(dest, Tensor<T, Dim>{filter.expr()}, options);
+      return;
+    }
+    if (!dest.isDense() || dest.layout_ != layout_) {
+      Tensor<T, Dim> result{conv2dShape(filter, options), layout_, builder_};
+      conv2d(result, filter, options);
+      dest = result;
+      return;
+    }
+
+    auto &M = *builder_.GetInsertBlock()->getModule();
+    auto *PtrTy = getType(M.getContext());
+    auto *IntTy = Integer::getType(M.getContext());
+    auto Name = builtinName(std::string("conv_") + getTensorLayoutName(layout_),
+                            M.getContext());
+    assert(!Name.empty() && "No convolution for this element type");
+    llvm::SmallVector<llvm::Type *, 18> ArgTys{PtrTy, PtrTy, PtrTy};
+    ArgTys.append(15, IntTy);
     auto FC = M.getOrInsertFunction(
-        "__mydsl_tensor_conv_2_f32", builder_.getVoidTy(),
-        getType(M.getContext()), getType(M.getContext()),
-        getType(M.getContext()), Integer::getType(M.getContext()),
-        Integer::getType(M.getContext()));
+        Name, llvm::FunctionType::get(builder_.getVoidTy(), ArgTys, false));
 
+    // the padding at the end only shows in the shape of dest
+    Integer padTop = convPadding(2, filter.extent(2), options).first;
+    Integer padLeft = convPadding(3, filter.extent(3), options).first;
     builder_.CreateCall(
-        FC, {dest.data_, data_, filter.data_, size_[0], filter.size_[0]});
+        FC, {dest.data_, data_, filter.data_, size_[0], size_[1], size_[2],
+             size_[3], filter.size_[0], filter.size_[2], filter.size_[3],
+             dest.size_[2], dest.size_[3],
+             builder_.getInt64(options.stride[0]),
+             builder_.getInt64(options.stride[1]),
+             builder_.getInt64(options.dilation[0]),
+             builder_.getInt64(options.dilation[1]), padTop.getValue(),
+             padLeft.getValue()});
   }
 
 };
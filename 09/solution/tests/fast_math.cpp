@@ -0,0 +1,72 @@
+#include "../control_flow.hpp"
+#include "../float_ops.hpp"
+#include "../int_ops.hpp"
+#include "../jit.hpp"
+
+#include <cmath>
+#include <cstdio>
+
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Module.h>
+
+using namespace MyDSL;
+
+/// Returns `a * b + c` rounded once. Returns whether a FastMathScope allowed
+/// contraction only while it was alive.
+bool kernel(llvm::Value *A, llvm::Value *B, llvm::Value *C,
+            llvm::IRBuilder<> &Builder) {
+
+  ControlFlow CF(Builder);
+  Float a(A, Builder), b(B, Builder), c(C, Builder);
+  bool contract;
+  {
+    FastMathScope scope(Builder, {FastMath::Contract});
+    contract = Builder.getFastMathFlags().allowContract();
+  }
+  Float fused = a.fma(b, c);
+  CF.Return(fused);
+  return contract && !Builder.getFastMathFlags().any();
+}
+
+int main(int argc, const char *argv[]) {
+
+  llvm::ExitOnError ExitOnErr;
+
+  auto [Context, M, JITP] = initialize();
+  auto &JIT = *JITP;
+  auto &Ctx = *Context;
+
+  auto Kernel = make_kernel_function(
+      M.get(), Float::getType(Ctx),
+      {Float::getType(Ctx), Float::getType(Ctx), Float::getType(Ctx)});
+
+  llvm::IRBuilder<> Builder(&Kernel->getEntryBlock());
+
+  if (!kernel(Kernel->getArg(0), Kernel->getArg(1), Kernel->getArg(2),
+              Builder)) {
+    fprintf(stderr, "FastMathScope did not set and restore the flags\n");
+    return 1;
+  }
+
+  linkBuiltinFunctions(*M);
+
+  optimize(*M, JIT);
+
+  auto *FP = ExitOnErr(JIT(std::move(M), std::move(Context)))
+                 .toPtr<Float::NativeType(Float::NativeType, Float::NativeType,
+                                          Float::NativeType)>();
+
+  // (1 + 2^-12)^2 = 1 + 2^-11 + 2^-24, the last term is lost if the product
+  // is rounded before the addition
+  const float a = 1.f + std::ldexp(1.f, -12);
+  const float c = -(1.f + std::ldexp(1.f, -11));
+  const float result = FP(a, a, c);
+  if (result != std::ldexp(1.f, -24)) {
+    fprintf(stderr, "wrong result %a, expected %a\n", result,
+            std::ldexp(1.f, -24));
+    return 1;
+  }
+  fprintf(stdout, "Float::fma: ok\n");
+
+  return 0;
+}
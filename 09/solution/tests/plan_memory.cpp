@@ -0,0 +1,109 @@
+#include "../control_flow.hpp"
+#include "../float_ops.hpp"
+#include "../int_ops.hpp"
+#include "../jit.hpp"
+#include "../passes/plan_memory.hpp"
+#include "../tensor_ops.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <numeric>
+#include <vector>
+
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Module.h>
+
+using namespace MyDSL;
+
+/// Convolves into a temporary in straight-line code and reads it after two
+/// loops over other temporaries, so planTensorMemory must not give them the
+/// memory of the convolution.
+void kernel(llvm::Value *Result, llvm::Value *Input, llvm::Value *Filter,
+            llvm::Value *Size, llvm::IRBuilder<> &Builder) {
+
+  ControlFlow CF(Builder);
+  Integer s(Size, Builder);
+  Integer windowsize{3, Builder};
+  llvm::SmallVector<Integer, 2> size{s, s};
+  llvm::SmallVector<Integer, 2> in_size{s + (windowsize - 1),
+                                        s + (windowsize - 1)};
+  Tensor<Float, 2> In{in_size, Input, Builder};
+  Tensor<Float, 2> A{size, Input, Builder};
+  Tensor<Float, 2> filter{{windowsize, windowsize}, Filter, Builder};
+  Tensor<Float, 2> Tres{size, Result, Builder};
+
+  Tensor<Float, 2> tmp{size, Builder};
+  In.conv2d(tmp, filter);
+  Tensor<Float, 2> w{A + A};
+  Tensor<Float, 2> u{w * A};
+
+  Tres = tmp + u;
+
+  CF.Return();
+}
+
+int main(int argc, const char *argv[]) {
+
+  llvm::ExitOnError ExitOnErr;
+
+  auto [Context, M, JITP] = initialize();
+  auto &JIT = *JITP;
+  auto &Ctx = *Context;
+
+  auto Kernel = make_kernel_function(
+      M.get(), llvm::Type::getVoidTy(Ctx),
+      {Tensor<Float, 2>::getType(Ctx), Tensor<Float, 2>::getType(Ctx),
+       Tensor<Float, 2>::getType(Ctx), Integer::getType(Ctx)});
+
+  llvm::IRBuilder<> Builder(&Kernel->getEntryBlock());
+
+  kernel(Kernel->getArg(0), Kernel->getArg(1), Kernel->getArg(2),
+         Kernel->getArg(3), Builder);
+
+  planTensorMemory(*M);
+
+  linkBuiltinFunctions(*M);
+
+  optimize(*M, JIT);
+
+  // the kernel reads the first size x size elements of its input as well
+  const std::size_t size = 10;
+  const std::size_t in_size = size + 2;
+  std::vector<Float::NativeType> In(in_size * in_size);
+  std::iota(In.begin(), In.end(), 0);
+  std::transform(In.begin(), In.end(), In.begin(),
+                 [](auto I) { return static_cast<int>(I) % 7 - 3; });
+  std::vector<Float::NativeType> Filter{1.f, 2.f, 1.f, 0.f, 0.f,
+                                        0.f, -1.f, -2.f, -1.f};
+  std::vector<Float::NativeType> Result(size * size);
+
+  void (*FP)(typename Tensor<Float, 2>::NativeType,
+             typename Tensor<Float, 2>::NativeType,
+             typename Tensor<Float, 2>::NativeType,
+             typename Integer::NativeType) =
+      ExitOnErr(JIT(std::move(M), std::move(Context)))
+          .toPtr<void(typename Tensor<Float, 2>::NativeType,
+                      typename Tensor<Float, 2>::NativeType,
+                      typename Tensor<Float, 2>::NativeType,
+                      typename Integer::NativeType)>();
+
+  FP(Result.data(), In.data(), Filter.data(), size);
+
+  for (std::size_t i = 0; i < size; ++i) {
+    for (std::size_t j = 0; j < size; ++j) {
+      float conv = 0.f;
+      for (std::size_t u = 0; u < 3; ++u)
+        for (std::size_t v = 0; v < 3; ++v)
+          conv += In[(i + u) * in_size + j + v] * Filter[u * 3 + v];
+      float a = In[i * size + j];
+      if (std::abs(Result[i * size + j] - (conv + (a + a) * a)) > 1e-3f) {
+        fprintf(stderr, "wrong result at %zu, %zu\n", i, j);
+        return 1;
+      }
+    }
+  }
+  fprintf(stdout, "planTensorMemory: ok\n");
+
+  return 0;
+}
@@ -0,0 +1,358 @@
+#pragma once
+
+#include <array>
+#include <concepts>
+#include <cstddef>
+#include <type_traits>
+
+#include "base_ops.hpp"
+#include "bool_ops.hpp"
+#include "float_ops.hpp"
+#include "int_ops.hpp"
+
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Intrinsics.h>
+
+namespace MyDSL {
+template <class T, unsigned N> class Vec;
+
+/// The element types of Vec. Reduced floats like Half are computed in Float
+/// and have no vectors of their own.
+template <class T>
+concept VectorElement = std::is_same_v<T, Float> || std::is_same_v<T, Integer>;
+
+/**
+ * @brief A vector of \a N booleans, the result of comparing two vectors.
+ * Masks select lanes in Mask::select and in the masked loads and stores of
+ * Tensor.
+ */
+template <unsigned N> class Mask : public BaseOps {
+public:
+  Mask(bool value, llvm::IRBuilder<> &builder)
+      : BaseOps(builder.CreateVectorSplat(N, builder.getInt1(value)),
+                builder) {}
+  Mask(llvm::Value *value, llvm::IRBuilder<> &builder)
+      : BaseOps(value, builder) {
+    assert(value->getType() == getType(builder.getContext()));
+  }
+
+  static llvm::Type *getType(llvm::LLVMContext &Ctx) {
+    return llvm::FixedVectorType::get(llvm::Type::getInt1Ty(Ctx), N);
+  }
+
+  /**
+   * @brief Creates the mask of the lanes `index + lane` that are smaller than
+   * \a end, e.g. for the last, partial iteration of a vectorized loop.
+   *
+   * @param index The index of lane 0.
+   * @param end The end of the iteration space.
+   * @param builder The builder to use for emitting operations.
+   * @return Mask The active lanes.
+   */
+  static Mask activeLanes(const Integer &index, const Integer &end,
+                          llvm::IRBuilder<> &builder) {
+    return {builder.CreateIntrinsic(
+                llvm::Intrinsic::get_active_lane_mask,
+                {getType(builder.getContext()), index.getValue()->getType()},
+                {index.getValue(), end.getValue()}),
+            builder};
+  }
+
+  Mask operator&&(const Mask &other) const {
+    return {builder_.CreateAnd(getValue(), other.getValue()), builder_};
+  }
+  Mask operator||(const Mask &other) const {
+    return {builder_.CreateOr(getValue(), other.getValue()), builder_};
+  }
+  Mask operator!() const { return {builder_.CreateNot(getValue()), builder_}; }
+
+  /// Returns true if any lane is set.
+  Bool any() const { return {builder_.CreateOrReduce(getValue()), builder_}; }
+  /// Returns true if all lanes are set.
+  Bool all() const { return {builder_.CreateAndReduce(getValue()), builder_}; }
+
+  /// Returns the lanes of \a onTrue where the mask is set and the lanes of
+  /// \a onFalse otherwise.
+  template <class T>
+  Vec<T, N> select(const Vec<T, N> &onTrue, const Vec<T, N> &onFalse) const {
+    return {builder_.CreateSelect(getValue(), onTrue.getValue(),
+                                  onFalse.getValue()),
+            builder_};
+  }
+};
+
+/**
+ * @brief A SIMD vector of \a N Floats or Integers, an LLVM fixed vector.
+ *
+ * Operations on vectors always emit vector instructions, independent of the
+ * heuristics of the loop and SLP vectorizers. Use Tensor::loadVector and
+ * Tensor::storeVector to access the rows of tensors.
+ */
+template <class T, unsigned N> class Vec : public BaseOps {
+  static_assert(VectorElement<T>, "Vectors of Float or Integer only");
+  static constexpr bool IsFloat = std::is_same_v<T, Float>;
+
+public:
+  using ElementType = T;
+  static constexpr unsigned lanes = N;
+
+private:
+  static llvm::Constant *getConst(llvm::LLVMContext &Ctx,
+                                  typename T::NativeType value) {
+    if constexpr (IsFloat)
+      return llvm::ConstantFP::get(T::getType(Ctx), value);
+    else
+      return llvm::ConstantInt::get(T::getType(Ctx), value, /*IsSigned=*/true);
+  }
+
+  Vec getConstVec(typename T::NativeType value) const {
+    return {llvm::ConstantVector::getSplat(
+                llvm::ElementCount::getFixed(N),
+                getConst(builder_.getContext(), value)),
+            builder_};
+  }
+
+  Vec binaryOp(llvm::Instruction::BinaryOps FloatOp,
+               llvm::Instruction::BinaryOps IntOp, const Vec &other) const {
+    return {builder_.CreateBinOp(IsFloat ? FloatOp : IntOp, getValue(),
+                                 other.getValue()),
+            builder_};
+  }
+
+  Mask<N> compare(llvm::CmpInst::Predicate FloatPred,
+                  llvm::CmpInst::Predicate IntPred, const Vec &other) const {
+    return {builder_.CreateCmp(IsFloat ? FloatPred : IntPred, getValue(),
+                               other.getValue()),
+            builder_};
+  }
+
+  /// Ref constructor.
+  Vec(llvm::Type *type, llvm::Value *value, llvm::IRBuilder<> &builder)
+      : BaseOps(type, value, builder) {}
+
+  template <class U> friend class Ref;
+
+public:
+  Vec(llvm::Value *value, llvm::IRBuilder<> &builder)
+      : BaseOps(value, builder) {
+    assert(value->getType() == getType(builder.getContext()));
+  }
+
+  /// Broadcasts \a value to all lanes.
+  Vec(const T &value, llvm::IRBuilder<> &builder)
+      : BaseOps(builder.CreateVectorSplat(N, value.getValue()), builder) {}
+
+  /// Broadcasts the constant \a value to all lanes.
+  Vec(auto value, llvm::IRBuilder<> &builder)
+      // disambiguate 0 int literal and nullptr
+    requires(std::is_arithmetic_v<decltype(value)> &&
+             !std::is_same_v<decltype(NULL), decltype(value)>)
+      : BaseOps(llvm::ConstantVector::getSplat(
+                    llvm::ElementCount::getFixed(N),
+                    getConst(builder.getContext(),
+                             static_cast<typename T::NativeType>(value))),
+                builder) {}
+
+  explicit Vec(const BaseOps &base) : BaseOps(base) {
+    assert(base.getType() == getType(builder_.getContext()));
+  }
+
+  static llvm::Type *getType(llvm::LLVMContext &Ctx) {
+    return llvm::FixedVectorType::get(T::getType(Ctx), N);
+  }
+
+  /// arithmetic operators
+  Vec operator+(const Vec &other) const {
+    return binaryOp(llvm::Instruction::FAdd, llvm::Instruction::Add, other);
+  }
+  Vec operator-(const Vec &other) const {
+    return binaryOp(llvm::Instruction::FSub, llvm::Instruction::Sub, other);
+  }
+  Vec operator*(const Vec &other) const {
+    return binaryOp(llvm::Instruction::FMul, llvm::Instruction::Mul, other);
+  }
+  Vec operator/(const Vec &other) const {
+    return binaryOp(llvm::Instruction::FDiv, llvm::Instruction::SDiv, other);
+  }
+  Vec operator%(const Vec &other) const {
+    return binaryOp(llvm::Instruction::FRem, llvm::Instruction::SRem, other);
+  }
+  Vec operator-() const {
+    if constexpr (IsFloat)
+      return {builder_.CreateFNeg(getValue()), builder_};
+    else
+      return {builder_.CreateNeg(getValue()), builder_};
+  }
+
+  Vec operator+(const T &other) const { return *this + Vec{other, builder_}; }
+  Vec operator-(const T &other) const { return *this - Vec{other, builder_}; }
+  Vec operator*(const T &other) const { return *this * Vec{other, builder_}; }
+  Vec operator/(const T &other) const { return *this / Vec{other, builder_}; }
+
+  Vec operator+(typename T::NativeType value) const {
+    return *this + getConstVec(value);
+  }
+  Vec operator-(typename T::NativeType value) const {
+    return *this - getConstVec(value);
+  }
+  Vec operator*(typename T::NativeType value) const {
+    return *this * getConstVec(value);
+  }
+  Vec operator/(typename T::NativeType value) const {
+    return *this / getConstVec(value);
+  }
+
+  /// compound assignment operators
+  Vec &operator+=(const Vec &other) {
+    store((*this + other).getValue());
+    return *this;
+  }
+  Vec &operator-=(const Vec &other) {
+    store((*this - other).getValue());
+    return *this;
+  }
+  Vec &operator*=(const Vec &other) {
+    store((*this * other).getValue());
+    return *this;
+  }
+  Vec &operator/=(const Vec &other) {
+    store((*this / other).getValue());
+    return *this;
+  }
+
+  /// relational operators, lane by lane
+  Mask<N> operator==(const Vec &other) const {
+    return compare(llvm::CmpInst::FCMP_OEQ, llvm::CmpInst::ICMP_EQ, other);
+  }
+  Mask<N> operator!=(const Vec &other) const {
+    return compare(llvm::CmpInst::FCMP_ONE, llvm::CmpInst::ICMP_NE, other);
+  }
+  Mask<N> operator<(const Vec &other) const {
+    return compare(llvm::CmpInst::FCMP_OLT, llvm::CmpInst::ICMP_SLT, other);
+  }
+  Mask<N> operator<=(const Vec &other) const {
+    return compare(llvm::CmpInst::FCMP_OLE, llvm::CmpInst::ICMP_SLE, other);
+  }
+  Mask<N> operator>(const Vec &other) const {
+    return compare(llvm::CmpInst::FCMP_OGT, llvm::CmpInst::ICMP_SGT, other);
+  }
+  Mask<N> operator>=(const Vec &other) const {
+    return compare(llvm::CmpInst::FCMP_OGE, llvm::CmpInst::ICMP_SGE, other);
+  }
+
+  /// Lane-wise minimum.
+  Vec min(const Vec &other) const {
+    return {builder_.CreateBinaryIntrinsic(IsFloat ? llvm::Intrinsic::minnum
+                                                   : llvm::Intrinsic::smin,
+                                           getValue(), other.getValue()),
+            builder_};
+  }
+
+  /// Lane-wise maximum.
+  Vec max(const Vec &other) const {
+    return {builder_.CreateBinaryIntrinsic(IsFloat ? llvm::Intrinsic::maxnum
+                                                   : llvm::Intrinsic::smax,
+                                           getValue(), other.getValue()),
+            builder_};
+  }
+
+  /// Lane-wise fused multiply-add: computes `*this * mul + add`.
+  Vec fma(const Vec &mul, const Vec &add) const
+    requires(IsFloat)
+  {
+    return {builder_.CreateIntrinsic(llvm::Intrinsic::fma,
+                                     {getValue()->getType()},
+                                     {getValue(), mul.getValue(),
+                                      add.getValue()}),
+            builder_};
+  }
+
+  /// Returns lane \a lane.
+  T operator[](unsigned lane) const {
+    assert(lane < N && "Lane out of range");
+    return {builder_.CreateExtractElement(getValue(), lane), builder_};
+  }
+
+  /// Returns a copy of the vector with lane \a lane replaced by \a value.
+  Vec insert(unsigned lane, const T &value) const {
+    assert(lane < N && "Lane out of range");
+    return {builder_.CreateInsertElement(getValue(), value.getValue(), lane),
+            builder_};
+  }
+
+  /**
+   * @brief Rearranges the lanes: lane i of the result is lane `lanes[i]` of
+   * this vector.
+   *
+   * @param lanes The source lane of every result lane.
+   * @return Vec The shuffled vector.
+   */
+  template <std::size_t M>
+  Vec<T, M> shuffle(const std::array<int, M> &lanes) const {
+    return {builder_.CreateShuffleVector(getValue(), lanes), builder_};
+  }
+
+  /**
+   * @brief Rearranges the lanes of this vector and \a other: lane i of the
+   * result is lane `lanes[i]` of the concatenation of both vectors.
+   *
+   * @param other The vector providing the lanes N to 2N - 1.
+   * @param lanes The source lane of every result lane.
+   * @return Vec The shuffled vector.
+   */
+  template <std::size_t M>
+  Vec<T, M> shuffle(const Vec &other, const std::array<int, M> &lanes) const {
+    return {builder_.CreateShuffleVector(getValue(), other.getValue(), lanes),
+            builder_};
+  }
+
+  /// Returns the vector with the lanes in reverse order.
+  Vec reverse() const {
+    return {builder_.CreateVectorReverse(getValue()), builder_};
+  }
+
+  // Horizontal reductions. Floating point reductions are reassociated, i.e.
+  // computed as a tree instead of lane by lane.
+
+  T sum() const {
+    if constexpr (IsFloat) {
+      FastMathScope scope(builder_, {FastMath::Reassoc});
+      auto *Zero =
+          llvm::ConstantFP::getNegativeZero(T::getType(builder_.getContext()));
+      return {builder_.CreateFAddReduce(Zero, getValue()), builder_};
+    } else {
+      return {builder_.CreateAddReduce(getValue()), builder_};
+    }
+  }
+
+  T product() const {
+    if constexpr (IsFloat) {
+      FastMathScope scope(builder_, {FastMath::Reassoc});
+      return {builder_.CreateFMulReduce(getConst(builder_.getContext(), 1),
+                                        getValue()),
+              builder_};
+    } else {
+      return {builder_.CreateMulReduce(getValue()), builder_};
+    }
+  }
+
+  T min() const {
+    if constexpr (IsFloat)
+      return {builder_.CreateFPMinReduce(getValue()), builder_};
+    else
+      return {builder_.CreateIntMinReduce(getValue(), /*IsSigned=*/true),
+              builder_};
+  }
+
+  T max() const {
+    if constexpr (IsFloat)
+      return {builder_.CreateFPMaxReduce(getValue()), builder_};
+    else
+      return {builder_.CreateIntMaxReduce(getValue(), /*IsSigned=*/true),
+              builder_};
+  }
+};
+
+} // namespace MyDSL